@@ -0,0 +1,33 @@
+#include <stdlib.h>
+#include "sim.h"
+
+/* Counting allocator hook for the sim-count build. The linker's --wrap
+ * option sends every call to these functions from the simulator's own
+ * code here instead, and __real_* reaches the C library versions.
+ */
+unsigned long alloc_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	alloc_count++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	alloc_count++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	alloc_count++;
+	return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size) {
+	alloc_count++;
+	return __real_posix_memalign(memptr, alignment, size);
+}
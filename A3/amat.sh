@@ -0,0 +1,25 @@
+#!/bin/bash
+# Compares replacement algorithms by estimated run time rather than hit
+# rate, using sim's latency model.
+#
+# Usage: ./amat.sh tracefile [latencies] [memsize ...]
+#
+# latencies is passed to sim -t (fault,pagein,pageout,hit,minor, in
+# microseconds); use "" for the defaults. Prints one line per algorithm
+# and memsize with the hit rate, estimated run time and AMAT.
+
+trace=$1
+lat=$2
+shift 2 2>/dev/null
+sizes=${@:-50 100 200}
+algs=${ALGS:-rand fifo lru clock gds gdsf}
+
+for m in $sizes; do
+	for alg in $algs; do
+		./sim -f $trace -m $m -s 100000 -a $alg ${lat:+-t $lat} | awk -v alg=$alg -v m=$m '
+			/^Hit rate/ { hit = $3 }
+			/^Estimated run time/ { time = $4; amat = $7 }
+			END { printf("%-6s memsize %6d: hit rate %7.3f%%, run time %10.3f ms, AMAT %8.4f us\n",
+				     alg, m, hit, time, amat) }'
+	done
+done
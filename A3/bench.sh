@@ -0,0 +1,34 @@
+#!/bin/bash
+# Times sim at memory sizes well beyond the L2 cache, where the layout of
+# the coremap decides how fast eviction scans run.
+#
+# Usage: ./bench.sh [algorithm] [references per run] [memsize ...]
+#
+# Each run replays a synthetic trace over 1.5x as many pages as there are
+# frames: 70% of references go to a hot set of half the frames and the
+# rest are spread over all pages, so nearly every miss evicts a page.
+
+alg=${1:-clock}
+refs=${2:-2000000}
+shift 2 2>/dev/null
+sizes=${@:-65536 262144 1048576}
+trace=$(mktemp bench.XXXXXX)
+
+for m in $sizes; do
+	awk -v n=$refs -v m=$m 'BEGIN {
+		srand(1); pages = int(m * 3 / 2); hot = int(m / 2)
+		for (i = 0; i < n; i++) {
+			pg = (rand() < 0.7) ? int(rand() * hot) : int(rand() * pages)
+			printf("%s %x\n", (rand() < 0.3) ? "S" : "L", (pg + 1) * 4096)
+		}
+	}' > $trace
+
+	start=$(date +%s.%N)
+	./sim -f $trace -m $m -s $((m * 2)) -a $alg | grep "Miss count" > /dev/null
+	end=$(date +%s.%N)
+	awk -v alg=$alg -v m=$m -v n=$refs -v s=$start -v e=$end 'BEGIN {
+		printf("%s memsize %8d: %.3f s, %.1f ns/ref\n", alg, m, e - s, (e - s) * 1e9 / n)
+	}'
+done
+
+rm -f $trace
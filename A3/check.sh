@@ -0,0 +1,97 @@
+#!/bin/bash
+# Regression checks for the replacement algorithms (make check).
+#
+# Usage: ./check.sh [-u]
+#
+# First, every eviction is checked against a reference version of the
+# algorithm (sim -V, see verify.c) for lru, fifo, clock and opt, on the
+# traces in golden/ and on synthetic traces that tracegen generates from
+# models fitted to them. Every algorithm then replays the traces in golden/
+# with the page-out daemon (-L, -H), and -V checks that no store is lost,
+# up to a daemon that frees every frame after each reference. Then every
+# algorithm replays the traces in golden/, and the hit, miss and eviction
+# counts must be those recorded in golden/counts. When a change to the
+# results is intended, -u rewrites golden/counts instead; the diff then
+# shows what changed.
+#
+# The traces in golden/ are short page-level traces of the programs in
+# traceprogs (captured with pgrun) and fork.ref, which forks two children
+# that share and copy pages.
+
+verified="lru fifo clock opt"
+algs="rand lru fifo clock opt gds gdsf lecar"
+sizes="8 64 256"
+seeds="1 2"
+tmp=$(mktemp -d check.XXXXXX)
+trap 'rm -rf $tmp' EXIT
+fail=0
+
+# Replays $1 with algorithm $2 in $3 frames, with any further arguments
+# passed on to sim, and prints "hits misses clean dirty".
+run() {
+	./sim -f $1 -m $3 -s 20000 -a $2 "${@:4}" | awk '
+		/^Hit count/ { h = $3 } /^Miss count/ { m = $3 }
+		/^Clean evictions/ { c = $3 } /^Dirty evictions/ { d = $3 }
+		END { print h, m, c, d }'
+	return ${PIPESTATUS[0]}
+}
+
+traces=$(ls golden/*.ref)
+for t in golden/*.ref; do
+	name=$(basename $t .ref)
+	./tracegen fit $t > $tmp/$name.model || exit 1
+	for s in $seeds; do
+		./tracegen gen -n 8000 -s $s $tmp/$name.model > $tmp/$name-gen$s.ref || exit 1
+		traces="$traces $tmp/$name-gen$s.ref"
+	done
+done
+
+for t in $traces; do
+	for a in $verified; do
+		for m in $sizes; do
+			if ! run $t $a $m -V > /dev/null; then
+				echo "FAIL: $a on $t with $m frames differs from the reference"
+				fail=1
+			fi
+		done
+	done
+done
+echo "Differential: $(echo $traces | wc -w) traces, algorithms $verified"
+
+for t in golden/*.ref; do
+	for a in $algs; do
+		for w in 8:16 64:64; do
+			if ! run $t $a 64 -L ${w%:*} -H ${w#*:} -V > /dev/null; then
+				echo "FAIL: $a on $t with -L ${w%:*} -H ${w#*:} lost page contents"
+				fail=1
+			fi
+		done
+	done
+done
+echo "Page-out daemon: page contents kept, algorithms $algs"
+
+for t in golden/*.ref; do
+	for a in $algs; do
+		for m in $sizes; do
+			echo "$(basename $t .ref) $a $m $(run $t $a $m)"
+		done
+	done
+done > $tmp/counts
+
+if [ "$1" = "-u" ]; then
+	{
+		echo "# trace algorithm frames hits misses clean-evictions dirty-evictions"
+		echo "# Written by ./check.sh -u"
+		cat $tmp/counts
+	} > golden/counts
+	echo "Golden: golden/counts rewritten"
+elif ! diff <(grep -v '^#' golden/counts) $tmp/counts > $tmp/diff; then
+	echo "FAIL: counts differ from golden/counts (< golden, > now):"
+	cat $tmp/diff
+	fail=1
+else
+	echo "Golden: $(wc -l < $tmp/counts) runs match golden/counts"
+fi
+
+rm -f swapfile.*
+exit $fail
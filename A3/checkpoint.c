@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "pagetable.h"
+
+#define CKPT_MAGIC   "SIMCKPT"
+#define CKPT_VERSION 8
+
+/* Header written at the start of every checkpoint. The simulator must be
+ * started with the same memsize and algorithm to restore from it.
+ */
+struct ckpt_header {
+	char magic[8];
+	unsigned version;
+	unsigned memsize;
+	unsigned pagesize;   // SIMPAGESIZE the checkpoint was taken with
+	char alg[16];        // Name of the replacement algorithm
+};
+
+void ckpt_write(FILE *fp, const void *buf, size_t len) {
+	if (fwrite(buf, 1, len, fp) != len) {
+		perror("Error writing checkpoint");
+		exit(1);
+	}
+}
+
+void ckpt_read(FILE *fp, void *buf, size_t len) {
+	if (fread(buf, 1, len, fp) != len) {
+		fprintf(stderr, "Error reading checkpoint: file is truncated\n");
+		exit(1);
+	}
+}
+
+/*
+ * Writes the simulator state to the file at path. The checkpoint holds, in
+ * order: the header, the event counters, the page tables of every process,
+ * the coremap and free frame stack, physmem, the swap bitmap and swap
+ * contents, the compressed pool, and finally the replacement algorithm's
+ * own state.
+ *
+ * Returns 0 on success, -1 if the file could not be created.
+ */
+int checkpoint_save(const char *path, const char *alg) {
+	struct ckpt_header hdr;
+	FILE *fp;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		perror("Error opening checkpoint file");
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	strncpy(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic));
+	hdr.version = CKPT_VERSION;
+	hdr.memsize = memsize;
+	hdr.pagesize = SIMPAGESIZE;
+	strncpy(hdr.alg, alg, sizeof(hdr.alg) - 1);
+	ckpt_write(fp, &hdr, sizeof(hdr));
+
+	ckpt_write(fp, &hit_count, sizeof(int));
+	ckpt_write(fp, &miss_count, sizeof(int));
+	ckpt_write(fp, &ref_count, sizeof(int));
+	ckpt_write(fp, &evict_clean_count, sizeof(int));
+	ckpt_write(fp, &evict_dirty_count, sizeof(int));
+	ckpt_write(fp, &free_frame_faults, sizeof(int));
+	ckpt_write(fp, &minor_faults, sizeof(int));
+	ckpt_write(fp, &reclaim_batches, sizeof(int));
+	ckpt_write(fp, &reclaim_pages, sizeof(int));
+
+	proc_save(fp);
+
+	// The pte back-pointers are not saved, since they are only valid in
+	// this process. They are rebuilt from the vaddr of each frame.
+	ckpt_write(fp, coremap.flags, memsize * sizeof(unsigned char));
+	ckpt_write(fp, coremap.in_use, memsize * sizeof(char));
+	ckpt_write(fp, coremap.vaddr, memsize * sizeof(addr_t));
+	ckpt_write(fp, coremap.mappers, memsize * sizeof(uint64_t));
+	numa_save(fp);
+	free_frames_save(fp);
+	ckpt_write(fp, physmem, memsize * SIMPAGESIZE);
+
+	swap_save(fp);
+	ckpt_write(fp, &zswap_percent, sizeof(unsigned));
+	if (zswap_percent > 0) {
+		zswap_save(fp);
+	}
+	save_fcn(fp);
+
+	if (fclose(fp) != 0) {
+		perror("Error closing checkpoint file");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Replaces the simulator state with the one stored in the checkpoint at
+ * path. Must be called after the coremap, swap, page directory and the
+ * replacement algorithm have been initialized.
+ *
+ * Returns 0 on success, -1 if the file could not be opened or was taken
+ * with a different configuration.
+ */
+int checkpoint_restore(const char *path, const char *alg) {
+	struct ckpt_header hdr;
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror("Error opening checkpoint file");
+		return -1;
+	}
+
+	ckpt_read(fp, &hdr, sizeof(hdr));
+	if (strncmp(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic)) != 0
+	    || hdr.version != CKPT_VERSION) {
+		fprintf(stderr, "Error: %s is not a version %d checkpoint\n",
+			path, CKPT_VERSION);
+		fclose(fp);
+		return -1;
+	}
+	if (hdr.memsize != memsize || hdr.pagesize != SIMPAGESIZE
+	    || strncmp(hdr.alg, alg, sizeof(hdr.alg)) != 0) {
+		fprintf(stderr, "Error: checkpoint was taken with -m %u -a %s "
+			"(page size %u)\n", hdr.memsize, hdr.alg, hdr.pagesize);
+		fclose(fp);
+		return -1;
+	}
+
+	ckpt_read(fp, &hit_count, sizeof(int));
+	ckpt_read(fp, &miss_count, sizeof(int));
+	ckpt_read(fp, &ref_count, sizeof(int));
+	ckpt_read(fp, &evict_clean_count, sizeof(int));
+	ckpt_read(fp, &evict_dirty_count, sizeof(int));
+	ckpt_read(fp, &free_frame_faults, sizeof(int));
+	ckpt_read(fp, &minor_faults, sizeof(int));
+	ckpt_read(fp, &reclaim_batches, sizeof(int));
+	ckpt_read(fp, &reclaim_pages, sizeof(int));
+
+	proc_restore(fp);
+
+	ckpt_read(fp, coremap.flags, memsize * sizeof(unsigned char));
+	ckpt_read(fp, coremap.in_use, memsize * sizeof(char));
+	ckpt_read(fp, coremap.vaddr, memsize * sizeof(addr_t));
+	ckpt_read(fp, coremap.mappers, memsize * sizeof(uint64_t));
+
+	for (i = 0; i < memsize; i++) {
+		coremap.pte[i] = NULL;
+		if (coremap.in_use[i]) {
+			coremap.pte[i] = find_pte(coremap.vaddr[i]);
+		}
+	}
+	numa_restore(fp);
+	free_frames_restore(fp);
+	ckpt_read(fp, physmem, memsize * SIMPAGESIZE);
+
+	swap_restore(fp);
+	ckpt_read(fp, &i, sizeof(int));
+	if ((unsigned)i != zswap_percent) {
+		fprintf(stderr, "Error: checkpoint was taken with -z %d\n", i);
+		exit(1);
+	}
+	if (zswap_percent > 0) {
+		zswap_restore(fp);
+	}
+	restore_fcn(fp);
+
+	fclose(fp);
+	return 0;
+}
@@ -4,27 +4,105 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include "pagetable.h"
+#include "sim.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SIMD_SWEEP
+#endif
 
-extern int memsize;
 
 extern int debug;
 
-extern struct frame *coremap;
+extern struct coremap coremap;
 
 int clock_head;
 
+/* A sweep moves the clock hand over flags[start, end), clearing PG_REF on
+ * each frame it passes, and stops at the first frame without PG_REF.
+ * It returns the index of that frame, or end if every frame in the range
+ * had been referenced. The SIMD versions test a whole vector of frames at
+ * a time, and are picked by clock_init if the CPU supports them.
+ */
+static int (*sweep)(unsigned char *flags, int start, int end);
+
+static int sweep_scalar(unsigned char *flags, int start, int end) {
+	int i;
+	for (i = start; i < end && (flags[i] & PG_REF); i++) {
+		flags[i] &= ~PG_REF; // Remove ref bit
+	}
+	return i;
+}
+
+#ifdef HAVE_SIMD_SWEEP
+__attribute__((target("sse2")))
+static int sweep_sse2(unsigned char *flags, int start, int end) {
+	const __m128i ref = _mm_set1_epi8(PG_REF);
+	const __m128i lane = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+	int i;
+
+	for (i = start; i + 16 <= end; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *)(flags + i));
+		__m128i unref = _mm_cmpeq_epi8(_mm_and_si128(v, ref),
+					       _mm_setzero_si128());
+		unsigned mask = _mm_movemask_epi8(unref);
+
+		if (mask) {
+			// Only clear the frames in front of the victim
+			int n = __builtin_ctz(mask);
+			__m128i passed = _mm_cmplt_epi8(lane, _mm_set1_epi8(n));
+			v = _mm_andnot_si128(_mm_and_si128(passed, ref), v);
+			_mm_storeu_si128((__m128i *)(flags + i), v);
+			return i + n;
+		}
+		_mm_storeu_si128((__m128i *)(flags + i), _mm_andnot_si128(ref, v));
+	}
+	return sweep_scalar(flags, i, end);
+}
+
+__attribute__((target("avx2")))
+static int sweep_avx2(unsigned char *flags, int start, int end) {
+	const __m256i ref = _mm256_set1_epi8(PG_REF);
+	const __m256i lane = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					      8, 9, 10, 11, 12, 13, 14, 15,
+					      16, 17, 18, 19, 20, 21, 22, 23,
+					      24, 25, 26, 27, 28, 29, 30, 31);
+	int i;
+
+	for (i = start; i + 32 <= end; i += 32) {
+		__m256i v = _mm256_loadu_si256((__m256i *)(flags + i));
+		__m256i unref = _mm256_cmpeq_epi8(_mm256_and_si256(v, ref),
+						  _mm256_setzero_si256());
+		unsigned mask = _mm256_movemask_epi8(unref);
+
+		if (mask) {
+			// Only clear the frames in front of the victim
+			int n = __builtin_ctz(mask);
+			__m256i passed = _mm256_cmpgt_epi8(_mm256_set1_epi8(n), lane);
+			v = _mm256_andnot_si256(_mm256_and_si256(passed, ref), v);
+			_mm256_storeu_si256((__m256i *)(flags + i), v);
+			return i + n;
+		}
+		_mm256_storeu_si256((__m256i *)(flags + i), _mm256_andnot_si256(ref, v));
+	}
+	return sweep_sse2(flags, i, end);
+}
+#endif
+
 /* Page to evict is chosen using the clock algorithm.
  * Returns the page frame number (which is also the index in the coremap)
  * for the page that is to be evicted.
  */
 int clock_evict() {
-	// Loop through coremap until we find a frame that doesn't have the 
-	// PG_REF bit set, removing the bit for frames passed over.
-	while (coremap[clock_head].pte->frame & PG_REF) {
-		coremap[clock_head].pte->frame &= ~PG_REF; // Remove ref bit
-		clock_head = (clock_head + 1) % memsize; // Increment clock pointer
+	// Sweep through coremap until we find a frame that doesn't have the 
+	// PG_REF bit set, removing the bit for frames passed over. The hand
+	// wraps back to frame 0 when it reaches the end of the coremap.
+	int frame;
+	while ((frame = sweep(coremap.flags, clock_head, memsize)) == memsize) {
+		clock_head = 0;
 	}
+	clock_head = frame;
 	return clock_head;
 }
 
@@ -42,4 +120,24 @@ void clock_ref(pgtbl_entry_t *p) {
  */
 void clock_init() {
 	clock_head = 0;
+
+	sweep = sweep_scalar;
+#ifdef HAVE_SIMD_SWEEP
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		sweep = sweep_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		sweep = sweep_sse2;
+	}
+#endif
 }
+
+void clock_save(FILE *fp) {
+	ckpt_write(fp, &clock_head, sizeof(int));
+}
+
+void clock_restore(FILE *fp) {
+	ckpt_read(fp, &clock_head, sizeof(int));
+}
+
+SIM_DEFINE_PLUGIN("clock", clock)
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "sim.h"
+#include "pagetable.h"
+
+/*
+ * Concurrent replay (-T threads). Each thread replays its own trace
+ * against one shared address space: the page directory of process 0, the
+ * coremap and physmem. A trace name with a %d in it is a pattern for one
+ * file per thread (trace.%d gives trace.0, trace.1, ...); otherwise the
+ * one trace is dealt out in n contiguous chunks, one per thread. Dealing
+ * single references round-robin instead would give each thread a trace
+ * with none of the original's locality, as the threads drift apart.
+ *
+ * Hits take no locks. A reference to a resident page sets PG_REF (and
+ * PG_DIRTY for a store) in its pte with a compare-and-swap on the frame
+ * word. A fault locks the pte by setting PG_LOCKED in the same way, and
+ * other threads that fault on the page wait for it to come back valid,
+ * so each page is read in once. Second-level page tables are installed
+ * under a mutex, which is only taken the first time a region is touched.
+ *
+ * Frames are handed out in order until memory is full, and after that
+ * taken by a lock-free clock: each evicting thread advances a shared hand
+ * with an atomic add, clears PG_REF of referenced pages, and unmaps the
+ * first unreferenced page it finds with a compare-and-swap that also locks
+ * its pte, so a page referenced or locked in the meantime is passed over.
+ * Swap keeps its single-threaded caches, so calls into it are serialised
+ * by swap_lock.
+ *
+ * Page contents are not checked or written, since a page can be evicted
+ * between a thread's lookup and its access, which on real hardware a TLB
+ * shootdown would prevent.
+ */
+
+struct mt_ref {
+	addr_t vaddr;
+	char type;
+};
+
+struct mt_thread {
+	pthread_t tid;
+	struct mt_ref *refs;
+	size_t nrefs;
+	size_t cap;
+	// Counters, added to the global ones once the threads finish
+	int hits;
+	int misses;
+	int minor;
+	int evict_clean;
+	int evict_dirty;
+	int waits;   // References that waited for another thread's fault
+};
+
+static struct mt_thread *threads;
+static unsigned nthreads;
+static pthread_barrier_t start_barrier;
+static pthread_mutex_t pgdir_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t swap_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned next_frame;      // Frames below this have been handed out
+static unsigned long clock_hand;
+
+/* Adds a reference to the trace of thread t. */
+static void add_ref(struct mt_thread *t, char type, addr_t vaddr) {
+	if (t->nrefs == t->cap) {
+		t->cap = t->cap ? 2 * t->cap : 4096;
+		if ((t->refs = realloc(t->refs, t->cap * sizeof(struct mt_ref))) == NULL) {
+			perror("Failed to allocate trace");
+			exit(1);
+		}
+	}
+	t->refs[t->nrefs].vaddr = vaddr;
+	t->refs[t->nrefs].type = type;
+	t->nrefs++;
+}
+
+/*
+ * Reads the references of infp into the trace of thread t. Returns -1 if
+ * the trace has process events.
+ */
+static int load_trace(FILE *infp, struct mt_thread *t) {
+	char buf[MAXLINE];
+	addr_t vaddr;
+	char type;
+
+	while (fgets(buf, MAXLINE, infp) != NULL) {
+		if (buf[0] == '=') {
+			continue;
+		}
+		if (buf[0] == 'F' || buf[0] == 'X') {
+			return -1;
+		}
+		if (sscanf(buf, "%c %lx", &type, &vaddr) != 2) {
+			continue;
+		}
+		add_ref(t, type, vaddr);
+	}
+	return 0;
+}
+
+/*
+ * Deals the trace loaded into thread 0 out to all n threads in contiguous
+ * chunks, the first chunk to thread 0, so that each thread replays a
+ * stretch of the trace with its locality intact.
+ */
+static void deal_chunks(unsigned n) {
+	size_t total = threads[0].nrefs;
+	unsigned i;
+
+	for (i = 1; i < n; i++) {
+		struct mt_thread *t = &threads[i];
+		size_t from = total * i / n;
+
+		t->nrefs = t->cap = total * (i + 1) / n - from;
+		if (t->nrefs == 0) {
+			continue;
+		}
+		if ((t->refs = malloc(t->nrefs * sizeof(struct mt_ref))) == NULL) {
+			perror("Failed to allocate trace");
+			exit(1);
+		}
+		memcpy(t->refs, threads[0].refs + from, t->nrefs * sizeof(struct mt_ref));
+	}
+	threads[0].nrefs = total / n;
+}
+
+/* Returns the pte for vaddr, installing its second-level table if needed. */
+static pgtbl_entry_t *mt_pte(addr_t vaddr) {
+	pgdir_entry_t *dir = &pgdir[PGDIR_INDEX(vaddr)];
+	uintptr_t pde = __atomic_load_n(&dir->pde, __ATOMIC_ACQUIRE);
+
+	if (pde == 0) {
+		pthread_mutex_lock(&pgdir_lock);
+		if ((pde = dir->pde) == 0) {
+			pde = init_second_level().pde;
+			__atomic_store_n(&dir->pde, pde, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&pgdir_lock);
+	}
+	return (pgtbl_entry_t *)(pde & PAGE_MASK) + PGTBL_INDEX(vaddr);
+}
+
+/*
+ * Takes a frame by evicting the page the clock hand finds first that is
+ * unreferenced, unlocked and valid, writing it to swap if it is dirty.
+ * Never waits for a pte lock, so a thread can evict while holding the lock
+ * of the page it is faulting in.
+ */
+static int mt_evict(struct mt_thread *t) {
+	for (;;) {
+		int frame = __atomic_fetch_add(&clock_hand, 1, __ATOMIC_RELAXED) % memsize;
+		pgtbl_entry_t *p = __atomic_load_n(&coremap.pte[frame], __ATOMIC_ACQUIRE);
+		unsigned v;
+
+		if (p == NULL) {
+			continue;
+		}
+		v = __atomic_load_n(&p->frame, __ATOMIC_ACQUIRE);
+		if ((v >> PAGE_SHIFT) != (unsigned)frame
+		    || (v & (PG_VALID | PG_LOCKED)) != PG_VALID) {
+			continue;
+		}
+		if (v & PG_REF) {
+			// Second chance; losing the race to a hit is fine too
+			__atomic_compare_exchange_n(&p->frame, &v, v & ~PG_REF, 0,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (!__atomic_compare_exchange_n(&p->frame, &v,
+						 (v & ~PG_VALID) | PG_LOCKED, 0,
+						 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		// The page is unmapped and its pte locked, so the frame is ours
+		if (v & PG_DIRTY) {
+			pthread_mutex_lock(&swap_lock);
+			int off = swap_pageout(frame, p->swap_off, coremap.vaddr[frame]);
+			pthread_mutex_unlock(&swap_lock);
+			assert(off != INVALID_SWAP);
+			p->swap_off = off;
+			t->evict_dirty++;
+		} else {
+			t->evict_clean++;
+		}
+		__atomic_store_n(&p->frame, PG_ONSWAP, __ATOMIC_RELEASE);
+		return frame;
+	}
+}
+
+/* Brings the page for vaddr into a frame. p is locked by this thread. */
+static void mt_fault(struct mt_thread *t, pgtbl_entry_t *p, unsigned v,
+		     addr_t vaddr, unsigned set) {
+	unsigned frame = memsize;
+	unsigned bits;
+
+	if (__atomic_load_n(&next_frame, __ATOMIC_RELAXED) < memsize) {
+		frame = __atomic_fetch_add(&next_frame, 1, __ATOMIC_RELAXED);
+	}
+	if (frame >= memsize) {
+		frame = mt_evict(t);
+	}
+
+	if (v & PG_ONSWAP) {
+		pthread_mutex_lock(&swap_lock);
+		int ret = swap_pagein(frame, p->swap_off);
+		pthread_mutex_unlock(&swap_lock);
+		assert(ret == 0);
+		bits = PG_ONSWAP;
+	} else {
+		init_frame(frame, vaddr);
+		t->minor++;
+		bits = PG_DIRTY;
+	}
+	t->misses++;
+
+	coremap.vaddr[frame] = vaddr;
+	__atomic_store_n(&coremap.pte[frame], p, __ATOMIC_RELEASE);
+	__atomic_store_n(&p->frame, (frame << PAGE_SHIFT) | bits | set | PG_VALID,
+			 __ATOMIC_RELEASE);
+}
+
+static void mt_access(struct mt_thread *t, char type, addr_t vaddr) {
+	pgtbl_entry_t *p = mt_pte(vaddr);
+	unsigned set = PG_REF | ((type == 'S' || type == 'M') ? PG_DIRTY : 0);
+	unsigned v = __atomic_load_n(&p->frame, __ATOMIC_ACQUIRE);
+	int waited = 0;
+
+	for (;;) {
+		if (v & PG_VALID) {
+			if ((v & set) == set
+			    || __atomic_compare_exchange_n(&p->frame, &v, v | set, 0,
+							   __ATOMIC_ACQUIRE,
+							   __ATOMIC_ACQUIRE)) {
+				t->hits++;
+				break;
+			}
+		} else if (v & PG_LOCKED) {
+			// Another thread is faulting the page in or evicting it
+			waited = 1;
+			sched_yield();
+			v = __atomic_load_n(&p->frame, __ATOMIC_ACQUIRE);
+		} else if (__atomic_compare_exchange_n(&p->frame, &v, v | PG_LOCKED, 0,
+						       __ATOMIC_ACQUIRE,
+						       __ATOMIC_ACQUIRE)) {
+			mt_fault(t, p, v, vaddr, set);
+			break;
+		}
+	}
+	t->waits += waited;
+}
+
+static void *mt_run(void *arg) {
+	struct mt_thread *t = arg;
+	size_t i;
+
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < t->nrefs; i++) {
+		mt_access(t, t->refs[i].type, t->refs[i].vaddr);
+	}
+	return NULL;
+}
+
+/*
+ * Replays tracefile with n threads (see above), then adds their counters
+ * to the global ones and prints the throughput.
+ */
+void concurrent_replay(const char *tracefile, unsigned n) {
+	struct timespec start, end;
+	int waits = 0;
+	double secs;
+	unsigned i;
+	FILE *fp;
+
+	nthreads = n;
+	if ((threads = calloc(n, sizeof(struct mt_thread))) == NULL) {
+		perror("Failed to allocate threads");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		char name[MAXLINE];
+		int per_thread = strstr(tracefile, "%d") != NULL;
+
+		if (per_thread) {
+			snprintf(name, sizeof(name), tracefile, i);
+		} else if (i > 0) {
+			break;
+		} else {
+			snprintf(name, sizeof(name), "%s", tracefile);
+		}
+		if ((fp = fopen(name, "r")) == NULL) {
+			perror(name);
+			exit(1);
+		}
+		if (load_trace(fp, &threads[i]) != 0) {
+			fprintf(stderr, "Error: %s has process events, which -T does "
+				"not support\n", name);
+			exit(1);
+		}
+		fclose(fp);
+	}
+	if (strstr(tracefile, "%d") == NULL) {
+		deal_chunks(n);
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, n + 1);
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&threads[i].tid, NULL, mt_run, &threads[i]) != 0) {
+			fprintf(stderr, "Error: could not create thread %u\n", i);
+			exit(1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i].tid, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&start_barrier);
+
+	for (i = 0; i < n; i++) {
+		struct mt_thread *t = &threads[i];
+		hit_count += t->hits;
+		miss_count += t->misses;
+		ref_count += t->nrefs;
+		minor_faults += t->minor;
+		evict_clean_count += t->evict_clean;
+		evict_dirty_count += t->evict_dirty;
+		waits += t->waits;
+		free(t->refs);
+	}
+	free(threads);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Concurrent replay: %u threads, %.3f ms, %.0f references/s, "
+	       "%.0f faults/s, %d waits for another thread's fault\n", n,
+	       secs * 1000, secs > 0 ? ref_count / secs : 0.0,
+	       secs > 0 ? miss_count / secs : 0.0, waits);
+}
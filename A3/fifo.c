@@ -4,15 +4,14 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include "pagetable.h"
+#include "sim.h"
 
 
-extern int memsize;
-
 extern int debug;
 
-extern struct frame *coremap;
+extern struct coremap coremap;
 
-int head; // Contains the last evicted index
+static int head; // Contains the last evicted index
 
 /* Page to evict is chosen using the fifo algorithm.
  * Returns the page frame number (which is also the index in the coremap)
@@ -38,3 +37,13 @@ void fifo_ref(pgtbl_entry_t *p) {
 void fifo_init() {
 	head = -1;
 }
+
+void fifo_save(FILE *fp) {
+	ckpt_write(fp, &head, sizeof(int));
+}
+
+void fifo_restore(FILE *fp) {
+	ckpt_read(fp, &head, sizeof(int));
+}
+
+SIM_DEFINE_PLUGIN("fifo", fifo)
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include "pagetable.h"
+#include "sim.h"
+
+extern int debug;
+
+extern struct coremap coremap;
+
+// GreedyDual-Size (and GreedyDual-Size-Frequency) replacement. Every page
+// in memory has a priority H = L + cost, where cost is what evicting the
+// page would cost: a page-in to bring it back, plus a page-out if it is
+// dirty. The page with the smallest H is evicted, and L is raised to its
+// H, so pages that have not been referenced for a while age towards
+// eviction while costly ones take longer to get there. Pages are all the
+// same size, so the size term of GreedyDual-Size drops out. With gdsf the
+// cost is also multiplied by the number of references to the page.
+//
+// Frames are kept in a binary min-heap on H, so references and evictions
+// take O(log memsize).
+static int *heap;      // Frames in the heap, smallest H first
+static int heap_len;
+static int *heap_pos;  // Index of each frame in heap, or -1
+static double *prio;   // H of each frame
+static unsigned *freq; // References to the page in each frame
+static double inflation; // L
+static int use_freq;   // Set for gdsf
+
+/* Returns the cost of evicting the page that p maps. */
+static double evict_cost(pgtbl_entry_t *p) {
+	double cost = latency.fault + latency.pagein;
+
+	if (p->frame & PG_DIRTY) {
+		cost += latency.pageout;
+	}
+	return cost;
+}
+
+static void heap_set(int i, int frame) {
+	heap[i] = frame;
+	heap_pos[frame] = i;
+}
+
+static void sift_up(int i) {
+	int frame = heap[i];
+
+	while (i > 0 && prio[heap[(i - 1) / 2]] > prio[frame]) {
+		heap_set(i, heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(i, frame);
+}
+
+static void sift_down(int i) {
+	int frame = heap[i];
+
+	while (2 * i + 1 < heap_len) {
+		int c = 2 * i + 1;
+		if (c + 1 < heap_len && prio[heap[c + 1]] < prio[heap[c]]) {
+			c++;
+		}
+		if (prio[heap[c]] >= prio[frame]) {
+			break;
+		}
+		heap_set(i, heap[c]);
+		i = c;
+	}
+	heap_set(i, frame);
+}
+
+/* Page to evict is the one with the lowest priority.
+ * Returns the page frame number (which is also the index in the coremap)
+ * for the page that is to be evicted.
+ */
+int gds_evict() {
+	int frame;
+
+	assert(heap_len > 0);
+	frame = heap[0];
+	inflation = prio[frame];
+	heap_pos[frame] = -1;
+	if (--heap_len > 0) {
+		heap_set(0, heap[heap_len]);
+		sift_down(0);
+	}
+	return frame;
+}
+
+/* This function is called on each access to a page to update any information
+ * needed by the gds algorithm.
+ * Input: The page table entry for the page that is being accessed.
+ */
+void gds_ref(pgtbl_entry_t *p) {
+	int frame = p->frame >> PAGE_SHIFT;
+	int i = heap_pos[frame];
+
+	if (i < 0) {
+		freq[frame] = 1;
+		prio[frame] = inflation + evict_cost(p);
+		heap_set(heap_len++, frame);
+		sift_up(heap_len - 1);
+		return;
+	}
+
+	// H never drops on a reference: L and the page's reference count only
+	// grow, and a page only becomes clean again when it is evicted
+	freq[frame]++;
+	prio[frame] = inflation + evict_cost(p) * (use_freq ? freq[frame] : 1);
+	sift_down(i);
+}
+
+/* Initialize any data structures needed for this
+ * replacement algorithm
+ */
+void gds_init() {
+	int i;
+
+	heap = malloc(memsize * sizeof(int));
+	heap_pos = malloc(memsize * sizeof(int));
+	prio = calloc(memsize, sizeof(double));
+	freq = calloc(memsize, sizeof(unsigned));
+	if (!heap || !heap_pos || !prio || !freq) {
+		perror("Failed to allocate gds tables");
+		exit(1);
+	}
+	for (i = 0; i < memsize; i++) {
+		heap_pos[i] = -1;
+	}
+	heap_len = 0;
+	inflation = 0;
+	use_freq = 0;
+}
+
+void gdsf_init() {
+	gds_init();
+	use_freq = 1;
+}
+
+/* The heap is saved as it is, so ties between equal priorities are broken
+ * the same way after a restore.
+ */
+void gds_save(FILE *fp) {
+	int i;
+
+	ckpt_write(fp, &inflation, sizeof(double));
+	ckpt_write(fp, &heap_len, sizeof(int));
+	ckpt_write(fp, heap, heap_len * sizeof(int));
+	for (i = 0; i < heap_len; i++) {
+		ckpt_write(fp, &prio[heap[i]], sizeof(double));
+		ckpt_write(fp, &freq[heap[i]], sizeof(unsigned));
+	}
+}
+
+void gds_restore(FILE *fp) {
+	int i;
+
+	ckpt_read(fp, &inflation, sizeof(double));
+	ckpt_read(fp, &heap_len, sizeof(int));
+	if (heap_len < 0 || heap_len > memsize) {
+		fprintf(stderr, "Error: bad gds heap size %d in checkpoint\n", heap_len);
+		exit(1);
+	}
+	ckpt_read(fp, heap, heap_len * sizeof(int));
+	for (i = 0; i < heap_len; i++) {
+		heap_pos[heap[i]] = i;
+		ckpt_read(fp, &prio[heap[i]], sizeof(double));
+		ckpt_read(fp, &freq[heap[i]], sizeof(unsigned));
+	}
+}
+
+SIM_DEFINE_PLUGIN("gds", gds)
@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <math.h>
+#include "pagetable.h"
+#include "sim.h"
+
+extern int debug;
+
+extern struct coremap coremap;
+
+// LeCaR: an online-learning mix of two experts, LRU and LFU. Each eviction
+// follows one of them, picked at random in proportion to its weight, and
+// the evicted page goes into that expert's history. A miss on a page in a
+// history means its expert was wrong to evict it, so the other expert's
+// weight grows, by more the sooner the page came back (regret discounted
+// over time).
+//
+// Both experts share one node per frame, holding its links in the LRU list
+// and in its LFU frequency bucket. Buckets are kept in a list ordered by
+// frequency, and a reference only ever moves a frame to the next bucket,
+// so references and evictions are O(1). A page coming back from history
+// starts again at frequency 1, since finding the bucket for its old count
+// would not be O(1).
+
+#define LEARNING_RATE 0.45
+
+typedef struct bucket {
+	unsigned freq;
+	struct node *head;  // Most recently referenced frame at this frequency
+	struct node *tail;
+	struct bucket *prev; // Buckets are ordered by increasing frequency
+	struct bucket *next;
+} bucket_t;
+
+typedef struct node {
+	int frame;
+	struct node *prev; // LRU list, most recently used at the head
+	struct node *next;
+	struct node *bprev; // Frames in the same frequency bucket
+	struct node *bnext;
+	bucket_t *bucket;
+} node_t;
+
+static node_t *nodes;        // One node per frame
+static char *tracked;        // Set for frames in the lists
+static node_t *head, *tail;  // LRU list
+static bucket_t *lowest;     // Bucket with the lowest frequency
+static struct pool *buckets; // At most one bucket per frame
+
+// The two histories, each a ring of the last memsize pages its expert
+// evicted, with the time of the eviction. Entries are found by vaddr
+// through a hash table chained through hist_next; a page that comes back
+// is unlinked from the table but keeps its ring slot until overwritten.
+#define HIST_LRU 0
+#define HIST_LFU 1
+#define NO_ENTRY -1
+
+static addr_t *hist_vaddr;  // 2 * memsize entries, LRU history first
+static int *hist_time;
+static char *hist_valid;
+static int *hist_next;
+static int hist_pos[2];     // Next slot to fill in each ring
+static int *hist_table;
+static unsigned table_mask;
+
+static double weight[2];    // Weights of the LRU and LFU experts
+static double discount;     // Regret decays by this much per reference
+static unsigned long draws; // Calls to random() so far, as in rand.c
+
+static unsigned hash_vaddr(addr_t vaddr) {
+	return (unsigned)((vaddr >> PAGE_SHIFT) * 0x9E3779B97F4A7C15ull >> 32)
+		& table_mask;
+}
+
+/* Removes history entry e from the hash table. */
+static void hist_unlink(int e) {
+	int *link = &hist_table[hash_vaddr(hist_vaddr[e])];
+
+	while (*link != e) {
+		assert(*link != NO_ENTRY);
+		link = &hist_next[*link];
+	}
+	*link = hist_next[e];
+	hist_valid[e] = 0;
+}
+
+/* Records that expert h evicted the page at vaddr. */
+static void hist_add(int h, addr_t vaddr) {
+	int e = h * memsize + hist_pos[h];
+	unsigned b;
+
+	if (hist_valid[e]) {
+		hist_unlink(e);
+	}
+	hist_pos[h] = (hist_pos[h] + 1) % memsize;
+	hist_vaddr[e] = vaddr;
+	hist_time[e] = ref_count;
+	hist_valid[e] = 1;
+	b = hash_vaddr(vaddr);
+	hist_next[e] = hist_table[b];
+	hist_table[b] = e;
+}
+
+/* Returns the history entry for vaddr, or NO_ENTRY. */
+static int hist_find(addr_t vaddr) {
+	int e;
+
+	for (e = hist_table[hash_vaddr(vaddr)]; e != NO_ENTRY; e = hist_next[e]) {
+		if (hist_vaddr[e] == vaddr) {
+			return e;
+		}
+	}
+	return NO_ENTRY;
+}
+
+/* Unlinks a node from the LRU list. */
+static void lru_unlink(node_t *node) {
+	if (node->prev) {
+		node->prev->next = node->next;
+	} else {
+		head = node->next;
+	}
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		tail = node->prev;
+	}
+}
+
+/* Links a node in at the head of the LRU list. */
+static void lru_push(node_t *node) {
+	node->prev = NULL;
+	node->next = head;
+	if (head) {
+		head->prev = node;
+	} else {
+		tail = node;
+	}
+	head = node;
+}
+
+/* Takes a node out of its frequency bucket, freeing the bucket if that
+ * leaves it empty.
+ */
+static void bucket_unlink(node_t *node) {
+	bucket_t *b = node->bucket;
+
+	if (node->bprev) {
+		node->bprev->bnext = node->bnext;
+	} else {
+		b->head = node->bnext;
+	}
+	if (node->bnext) {
+		node->bnext->bprev = node->bprev;
+	} else {
+		b->tail = node->bprev;
+	}
+	if (b->head == NULL) {
+		if (b->prev) {
+			b->prev->next = b->next;
+		} else {
+			lowest = b->next;
+		}
+		if (b->next) {
+			b->next->prev = b->prev;
+		}
+		pool_free(buckets, b);
+	}
+}
+
+/* Returns the bucket for freq, which must come right after prev (or be
+ * the lowest if prev is NULL), creating it if needed.
+ */
+static bucket_t *bucket_after(bucket_t *prev, unsigned freq) {
+	bucket_t *next = prev ? prev->next : lowest;
+	bucket_t *b;
+
+	if (next && next->freq == freq) {
+		return next;
+	}
+	b = pool_alloc(buckets);
+	assert(b != NULL);
+	b->freq = freq;
+	b->head = b->tail = NULL;
+	b->prev = prev;
+	b->next = next;
+	if (next) {
+		next->prev = b;
+	}
+	if (prev) {
+		prev->next = b;
+	} else {
+		lowest = b;
+	}
+	return b;
+}
+
+/* Puts a node at the head of bucket b. */
+static void bucket_push(bucket_t *b, node_t *node) {
+	node->bucket = b;
+	node->bprev = NULL;
+	node->bnext = b->head;
+	if (b->head) {
+		b->head->bprev = node;
+	} else {
+		b->tail = node;
+	}
+	b->head = node;
+}
+
+/* Moves a node up to the bucket for one more reference. */
+static void bucket_bump(node_t *node) {
+	bucket_t *b = node->bucket;
+	bucket_t *next;
+
+	// Find or make the next bucket before b can be freed
+	next = bucket_after(b, b->freq + 1);
+	bucket_unlink(node);
+	bucket_push(next, node);
+}
+
+/* Returns a uniform random number in [0, 1). */
+static double uniform() {
+	draws++;
+	return random() / 2147483648.0;
+}
+
+/* Page to evict is the one chosen by the LRU or the LFU expert, picked at
+ * random according to their weights.
+ * Returns the page frame number (which is also the index in the coremap)
+ * for the page that is to be evicted.
+ */
+int lecar_evict() {
+	node_t *victim;
+	int h;
+
+	assert(tail != NULL && lowest != NULL);
+	if (uniform() < weight[HIST_LRU]) {
+		victim = tail;
+		h = HIST_LRU;
+	} else {
+		victim = lowest->tail;
+		h = HIST_LFU;
+	}
+
+	hist_add(h, coremap.vaddr[victim->frame]);
+	lru_unlink(victim);
+	bucket_unlink(victim);
+	tracked[victim->frame] = 0;
+	return victim->frame;
+}
+
+/* This function is called on each access to a page to update any information
+ * needed by the lecar algorithm.
+ * Input: The page table entry for the page that is being accessed.
+ */
+void lecar_ref(pgtbl_entry_t *p) {
+	int frame = p->frame >> PAGE_SHIFT;
+	node_t *node = &nodes[frame];
+	int e;
+
+	if (tracked[frame]) {
+		if (node != head) {
+			lru_unlink(node);
+			lru_push(node);
+		}
+		bucket_bump(node);
+		return;
+	}
+
+	// A miss. If an expert evicted this page, it regrets that: the
+	// other expert gains weight, the more so the sooner the page came back
+	if ((e = hist_find(coremap.vaddr[frame])) != NO_ENTRY) {
+		int wrong = e < memsize ? HIST_LRU : HIST_LFU;
+		double regret = pow(discount, ref_count - hist_time[e]);
+
+		weight[!wrong] *= exp(LEARNING_RATE * regret);
+		weight[HIST_LFU] /= weight[HIST_LRU] + weight[HIST_LFU];
+		weight[HIST_LRU] = 1.0 - weight[HIST_LFU];
+		hist_unlink(e);
+	}
+
+	node->frame = frame;
+	tracked[frame] = 1;
+	lru_push(node);
+	bucket_push(bucket_after(NULL, 1), node);
+}
+
+/* Initialize any data structures needed for this
+ * replacement algorithm
+ */
+void lecar_init() {
+	unsigned size = 1;
+	int i;
+
+	while (size < 2 * memsize) {
+		size *= 2;
+	}
+	table_mask = size - 1;
+
+	nodes = calloc(memsize, sizeof(node_t));
+	tracked = calloc(memsize, sizeof(char));
+	// A bump makes the next bucket before it can free the old one
+	buckets = pool_create(sizeof(bucket_t), memsize + 1);
+	hist_vaddr = calloc(2 * memsize, sizeof(addr_t));
+	hist_time = calloc(2 * memsize, sizeof(int));
+	hist_valid = calloc(2 * memsize, sizeof(char));
+	hist_next = calloc(2 * memsize, sizeof(int));
+	hist_table = malloc(size * sizeof(int));
+	if (!nodes || !tracked || !hist_vaddr || !hist_time || !hist_valid
+	    || !hist_next || !hist_table) {
+		perror("Failed to allocate lecar tables");
+		exit(1);
+	}
+	for (i = 0; i < size; i++) {
+		hist_table[i] = NO_ENTRY;
+	}
+
+	head = tail = NULL;
+	lowest = NULL;
+	hist_pos[HIST_LRU] = hist_pos[HIST_LFU] = 0;
+	weight[HIST_LRU] = weight[HIST_LFU] = 0.5;
+	discount = pow(0.005, 1.0 / memsize);
+	draws = 0;
+}
+
+/* The LRU list is saved most recent first, and the frequency buckets
+ * lowest first, each most recent first, so that both orders (and the
+ * ties LFU breaks by recency) come back the same.
+ */
+void lecar_save(FILE *fp) {
+	int len = 0;
+	node_t *node;
+	bucket_t *b;
+
+	ckpt_write(fp, weight, sizeof(weight));
+	ckpt_write(fp, &draws, sizeof(draws));
+
+	for (node = head; node; node = node->next) {
+		len++;
+	}
+	ckpt_write(fp, &len, sizeof(int));
+	for (node = head; node; node = node->next) {
+		ckpt_write(fp, &node->frame, sizeof(int));
+	}
+	for (b = lowest; b; b = b->next) {
+		for (node = b->head; node; node = node->bnext) {
+			ckpt_write(fp, &node->frame, sizeof(int));
+			ckpt_write(fp, &b->freq, sizeof(unsigned));
+		}
+	}
+
+	ckpt_write(fp, hist_pos, sizeof(hist_pos));
+	ckpt_write(fp, hist_vaddr, 2 * memsize * sizeof(addr_t));
+	ckpt_write(fp, hist_time, 2 * memsize * sizeof(int));
+	ckpt_write(fp, hist_valid, 2 * memsize * sizeof(char));
+}
+
+void lecar_restore(FILE *fp) {
+	bucket_t *b = NULL;
+	unsigned long i;
+	int len, frame, e;
+	unsigned freq;
+
+	ckpt_read(fp, weight, sizeof(weight));
+	ckpt_read(fp, &draws, sizeof(draws));
+	for (i = 0; i < draws; i++) {
+		random();
+	}
+
+	ckpt_read(fp, &len, sizeof(int));
+	for (i = 0; i < len; i++) {
+		ckpt_read(fp, &frame, sizeof(int));
+		nodes[frame].frame = frame;
+		tracked[frame] = 1;
+
+		// Frames were saved head first, so each one is appended
+		nodes[frame].prev = tail;
+		nodes[frame].next = NULL;
+		if (tail) {
+			tail->next = &nodes[frame];
+		} else {
+			head = &nodes[frame];
+		}
+		tail = &nodes[frame];
+	}
+	for (i = 0; i < len; i++) {
+		node_t *node;
+
+		ckpt_read(fp, &frame, sizeof(int));
+		ckpt_read(fp, &freq, sizeof(unsigned));
+		node = &nodes[frame];
+		if (b == NULL || b->freq != freq) {
+			b = bucket_after(b, freq);
+		}
+
+		// Append, since buckets were also saved most recent first
+		node->bucket = b;
+		node->bprev = b->tail;
+		node->bnext = NULL;
+		if (b->tail) {
+			b->tail->bnext = node;
+		} else {
+			b->head = node;
+		}
+		b->tail = node;
+	}
+
+	ckpt_read(fp, hist_pos, sizeof(hist_pos));
+	ckpt_read(fp, hist_vaddr, 2 * memsize * sizeof(addr_t));
+	ckpt_read(fp, hist_time, 2 * memsize * sizeof(int));
+	ckpt_read(fp, hist_valid, 2 * memsize * sizeof(char));
+
+	// Rebuild the hash chains. Entries are linked in ring order, which
+	// only changes the order of entries within a chain.
+	for (e = 0; e < 2 * memsize; e++) {
+		if (hist_valid[e]) {
+			unsigned h = hash_vaddr(hist_vaddr[e]);
+			hist_next[e] = hist_table[h];
+			hist_table[h] = e;
+		}
+	}
+}
+
+SIM_DEFINE_PLUGIN("lecar", lecar)
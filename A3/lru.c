@@ -4,52 +4,54 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include "pagetable.h"
-
-extern int memsize;
+#include "sim.h"
 
 extern int debug;
 
-extern struct frame *coremap;
+extern struct coremap coremap;
 
-// A simple linked list structure that the algorithm uses to
-// keep track of frames that have been recently used.
+// A doubly linked list that the algorithm uses to keep track of frames
+// that have been recently used. Nodes come from a pool with one node per
+// frame, so references never allocate or free heap memory.
 typedef struct node {
 	int frame;
+	struct node *prev;
 	struct node *next;
 } node_t;
 
-node_t *head; // The head contains the most recently used frame
-node_t *tail; // The tail of the list is the least recently used
+static node_t *head; // The head contains the most recently used frame
+static node_t *tail; // The tail of the list is the least recently used
+
+static struct pool *nodes; // Pool the list nodes are taken from
+static node_t **frame_node; // The list node for each frame, or NULL
 
 /*
- * Removes a frame from the list, if present. This method
- * will properly update the head and tail variables accordingly.
+ * Unlinks a node from the list, updating the head and tail variables
+ * accordingly.
  */
-void remove_if_present(int frame) {
-	node_t *curr = head;
-	node_t *prev = NULL;
-
-	while (curr) {
-		// Check if the current iterated node is the
-		// correct frame - remove if so.
-		if (curr->frame == frame) {
-			if (curr == head) {
-				head = curr->next; // Update head of list
-			} else {
-				if (curr == tail) {
-					tail = prev; // Update tail of list
-				}
-				prev->next = curr->next;
-			}
-
-			free(curr);
-			break;
-		}
+static void unlink_node(node_t *node) {
+	if (node->prev) {
+		node->prev->next = node->next;
+	} else {
+		head = node->next;
+	}
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		tail = node->prev;
+	}
+}
 
-		// Move to the next node
-		prev = curr;
-		curr = curr->next;
+/* Links a node in at the tail of the list. */
+static void append_node(node_t *node) {
+	node->prev = tail;
+	node->next = NULL;
+	if (tail) {
+		tail->next = node;
+	} else {
+		head = node;
 	}
+	tail = node;
 }
 
 /* Page to evict is chosen using the accurate LRU algorithm.
@@ -58,8 +60,12 @@ void remove_if_present(int frame) {
  */
 int lru_evict() {
 	assert(tail != NULL);
-	int frame = tail->frame;
-	remove_if_present(frame);
+	node_t *victim = tail;
+	int frame = victim->frame;
+
+	unlink_node(victim);
+	frame_node[frame] = NULL;
+	pool_free(nodes, victim);
 	return frame;
 }
 
@@ -69,19 +75,32 @@ int lru_evict() {
  */
 void lru_ref(pgtbl_entry_t *p) {
 	int frame = p->frame >> PAGE_SHIFT;
+	node_t *node = frame_node[frame];
 
-	// Remove the frame from the list if present (prevent duplicates)
-	remove_if_present(frame);
+	if (node) {
+		// Already in the list, take it out so it can be moved to the head
+		if (node == head) {
+			return;
+		}
+		unlink_node(node);
+	} else {
+		node = pool_alloc(nodes);
+		assert(node != NULL);
+		node->frame = frame;
+		frame_node[frame] = node;
+	}
 
 	// Insert the frame as the head (most recently referenced)
-	node_t *new_head = (node_t*) malloc(sizeof(node_t));
-	new_head->frame = frame;
-	new_head->next = head;
-	head = new_head;
+	node->prev = NULL;
+	node->next = head;
+	if (head) {
+		head->prev = node;
+	}
+	head = node;
 
 	// Update the tail if it hasn't been set yet
 	if (!tail) {
-		tail = new_head;
+		tail = node;
 	}
 }
 
@@ -92,4 +111,42 @@ void lru_ref(pgtbl_entry_t *p) {
 void lru_init() {
 	head = NULL;
 	tail = NULL;
+	nodes = pool_create(sizeof(node_t), memsize);
+	if ((frame_node = calloc(memsize, sizeof(node_t *))) == NULL) {
+		perror("Failed to allocate lru frame table");
+		exit(1);
+	}
 }
+
+/* Saves the list as its length followed by the frames from most to least
+ * recently used.
+ */
+void lru_save(FILE *fp) {
+	int len = 0;
+	node_t *curr;
+
+	for (curr = head; curr; curr = curr->next) {
+		len++;
+	}
+	ckpt_write(fp, &len, sizeof(int));
+	for (curr = head; curr; curr = curr->next) {
+		ckpt_write(fp, &curr->frame, sizeof(int));
+	}
+}
+
+void lru_restore(FILE *fp) {
+	int len, i;
+
+	ckpt_read(fp, &len, sizeof(int));
+	for (i = 0; i < len; i++) {
+		node_t *node = pool_alloc(nodes);
+		assert(node != NULL);
+		ckpt_read(fp, &node->frame, sizeof(int));
+		frame_node[node->frame] = node;
+
+		// Frames were saved head first, so each one is appended
+		append_node(node);
+	}
+}
+
+SIM_DEFINE_PLUGIN("lru", lru)
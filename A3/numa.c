@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "pagetable.h"
+
+/*
+ * Tiered physical memory (-N). Memory is split into up to NUMA_MAXTIERS
+ * tiers, fastest first, such as local DRAM followed by CXL or persistent
+ * memory, each with its own number of frames and cost per reference.
+ *
+ * Which tier a frame is in is only a label: migrating a page from one
+ * tier to another swaps the labels of its frame and of a frame in the
+ * other tier (which is free, or holds a page that moves the other way).
+ * Frame numbers, and with them the page tables, the coremap and the
+ * replacement algorithm's state, never change, so no algorithm needs to
+ * know about tiers.
+ *
+ * A fault places the page in a free frame, chosen by the placement policy
+ * (-P) among the tiers that have one: the fastest (fast), the slowest
+ * (slow), or each tier in turn (interleave). Once memory is full a fault
+ * takes the frame of whichever page the replacement algorithm evicts.
+ *
+ * Every page has a heat, the number of references to it with older ones
+ * counting for less: each scan halves it. A scan runs every
+ * max(NUMA_SCAN, memsize) references, so it costs O(1) per reference,
+ * and promotes up to NUMA_MIGRATE_MAX of the hottest pages of each tier
+ * to the tier above. They go into free frames there first, and then trade
+ * places with its coldest pages, as long as they are more than twice as
+ * hot, so that pages of about the same heat do not keep trading places.
+ */
+
+#define NUMA_SCAN        4096
+#define NUMA_MIGRATE_MAX 32
+#define NUMA_PROMOTE_MIN 2   // Heat a page needs to be promoted at all
+#define HEAT_MAX         255
+
+struct tier {
+	unsigned frames;
+	double cost;      // Microseconds per reference
+	int *free;        // Stack of free frames in this tier
+	unsigned nfree;
+	long refs;        // References to pages in this tier
+	int placements;   // Faults that placed a page in this tier
+	int promotions;   // Pages promoted into this tier
+	int demotions;    // Pages demoted out of this tier
+};
+
+unsigned numa_tiers = 0;
+int numa_placement = NUMA_PLACE_FAST;
+int numa_migrations = 0;
+
+static struct tier tiers[NUMA_MAXTIERS];
+static unsigned char *frame_tier;
+static unsigned char *heat;
+static int next_scan;
+static unsigned interleave_next;
+
+/*
+ * Parses the -N argument, "frames:cost[,frames:cost...]" with one entry
+ * per tier, fastest first, and the cost of a reference in microseconds.
+ * Returns 0 on success, -1 if it is malformed.
+ */
+int numa_parse(const char *spec) {
+	char *end;
+
+	numa_tiers = 0;
+	while (*spec) {
+		struct tier *t = &tiers[numa_tiers];
+
+		if (numa_tiers == NUMA_MAXTIERS) {
+			return -1;
+		}
+		t->frames = (unsigned)strtoul(spec, &end, 10);
+		if (end == spec || *end != ':' || t->frames == 0) {
+			return -1;
+		}
+		spec = end + 1;
+		t->cost = strtod(spec, &end);
+		if (end == spec || t->cost < 0) {
+			return -1;
+		}
+		numa_tiers++;
+		spec = end;
+		if (*spec == ',') {
+			spec++;
+		} else if (*spec) {
+			return -1;
+		}
+	}
+	return numa_tiers > 0 ? 0 : -1;
+}
+
+/* Sets the placement policy from the -P argument. Returns 0 on success,
+ * -1 if it names no policy.
+ */
+int numa_set_placement(const char *name) {
+	if (strcmp(name, "fast") == 0) {
+		numa_placement = NUMA_PLACE_FAST;
+	} else if (strcmp(name, "slow") == 0) {
+		numa_placement = NUMA_PLACE_SLOW;
+	} else if (strcmp(name, "interleave") == 0) {
+		numa_placement = NUMA_PLACE_INTERLEAVE;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Labels the frames with their tiers, the first tiers[0].frames frames
+ * being in tier 0 and so on. The tiers must add up to memsize. Must be
+ * called before init_pagetable, which fills the free frame stacks.
+ */
+void numa_init() {
+	unsigned total = 0, t, i, f = 0;
+
+	for (t = 0; t < numa_tiers; t++) {
+		total += tiers[t].frames;
+	}
+	if (total != memsize) {
+		fprintf(stderr, "Error: the tiers have %u frames in all, but "
+			"memsize is %u\n", total, memsize);
+		exit(1);
+	}
+
+	frame_tier = malloc(memsize * sizeof(unsigned char));
+	heat = calloc(memsize, sizeof(unsigned char));
+	if (frame_tier == NULL || heat == NULL) {
+		perror("Failed to allocate tier tables");
+		exit(1);
+	}
+	for (t = 0; t < numa_tiers; t++) {
+		if ((tiers[t].free = malloc(tiers[t].frames * sizeof(int))) == NULL) {
+			perror("Failed to allocate tier tables");
+			exit(1);
+		}
+		for (i = 0; i < tiers[t].frames; i++) {
+			frame_tier[f++] = t;
+		}
+	}
+	next_scan = memsize > NUMA_SCAN ? memsize : NUMA_SCAN;
+}
+
+/*
+ * Rebuilds the free frame stacks of the tiers from coremap.in_use, with
+ * the lowest frame of each tier on top. Called by init_free_frames.
+ */
+void numa_free_init() {
+	int i;
+	unsigned t;
+
+	for (t = 0; t < numa_tiers; t++) {
+		tiers[t].nfree = 0;
+	}
+	for (i = memsize - 1; i >= 0; i--) {
+		if (!coremap.in_use[i]) {
+			struct tier *tr = &tiers[frame_tier[i]];
+			tr->free[tr->nfree++] = i;
+		}
+	}
+}
+
+/* Returns a free frame to the stack of its tier. */
+void numa_put_free(int frame) {
+	struct tier *t = &tiers[frame_tier[frame]];
+	t->free[t->nfree++] = frame;
+}
+
+/*
+ * Takes a free frame for a page being faulted in, from the tier the
+ * placement policy picks. There must be a free frame in some tier.
+ */
+int numa_take_free() {
+	unsigned i, t = 0;
+	int frame;
+
+	for (i = 0; i < numa_tiers; i++) {
+		switch (numa_placement) {
+		case NUMA_PLACE_SLOW:
+			t = numa_tiers - 1 - i;
+			break;
+		case NUMA_PLACE_INTERLEAVE:
+			t = (interleave_next + i) % numa_tiers;
+			break;
+		default:
+			t = i;
+			break;
+		}
+		if (tiers[t].nfree > 0) {
+			break;
+		}
+	}
+	assert(tiers[t].nfree > 0);
+	interleave_next = (t + 1) % numa_tiers;
+
+	frame = tiers[t].free[--tiers[t].nfree];
+	tiers[t].placements++;
+	heat[frame] = 0;
+	return frame;
+}
+
+/* Moves the page in frame a (tier t + 1) and frame b (tier t) to each
+ * other's tier. Frame b may be free.
+ */
+static void swap_tiers(int a, int b) {
+	unsigned char t = frame_tier[b];
+
+	frame_tier[b] = frame_tier[a];
+	frame_tier[a] = t;
+	tiers[t].promotions++;
+	tiers[t + 1].demotions += coremap.in_use[b];
+	numa_migrations += 1 + coremap.in_use[b];
+}
+
+/*
+ * Collects into out up to max in-use frames of tier t: the hottest ones
+ * (with at least NUMA_PROMOTE_MIN heat) if hot is set, otherwise the
+ * coldest. A histogram of the heat finds the cutoff in one pass over the
+ * frames; ties at the cutoff go to the lowest frames. Returns the number
+ * of frames collected.
+ */
+static int collect(unsigned t, int hot, int *out, int max) {
+	unsigned hist[HEAT_MAX + 1];
+	int cut, n = 0, i, taken = 0;
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < memsize; i++) {
+		if (frame_tier[i] == t && coremap.in_use[i]) {
+			hist[heat[i]]++;
+		}
+	}
+	if (hot) {
+		for (cut = HEAT_MAX; cut >= NUMA_PROMOTE_MIN && taken < max; cut--) {
+			taken += hist[cut];
+		}
+		cut++;
+	} else {
+		for (cut = 0; cut <= HEAT_MAX && taken < max; cut++) {
+			taken += hist[cut];
+		}
+		cut--;
+	}
+	if (taken == 0) {
+		return 0;
+	}
+	// Frames past the cutoff all fit, so they go first, and frames at the
+	// cutoff fill what is left
+	for (i = 0; i < memsize; i++) {
+		if (frame_tier[i] == t && coremap.in_use[i]
+		    && (hot ? heat[i] > cut : heat[i] < cut)) {
+			out[n++] = i;
+		}
+	}
+	for (i = 0; i < memsize && n < max; i++) {
+		if (frame_tier[i] == t && coremap.in_use[i] && heat[i] == cut) {
+			out[n++] = i;
+		}
+	}
+	return n;
+}
+
+static int by_heat(const void *a, const void *b) {
+	return heat[*(const int *)a] - heat[*(const int *)b];
+}
+
+/* Promotes the hottest pages of each tier below the first, then ages the
+ * heat of every page.
+ */
+static void numa_scan() {
+	int hot[NUMA_MIGRATE_MAX], cold[NUMA_MIGRATE_MAX];
+	int nhot, ncold, i, j;
+	unsigned t;
+
+	for (t = 1; t < numa_tiers; t++) {
+		struct tier *up = &tiers[t - 1];
+
+		nhot = collect(t, 1, hot, NUMA_MIGRATE_MAX);
+		qsort(hot, nhot, sizeof(int), by_heat);
+
+		// Hottest first into the free frames of the tier above
+		while (nhot > 0 && up->nfree > 0) {
+			int frame = up->free[--up->nfree];
+			swap_tiers(hot[--nhot], frame);
+			numa_put_free(frame);
+		}
+
+		// Then trade places with its coldest pages
+		ncold = collect(t - 1, 0, cold, nhot);
+		qsort(cold, ncold, sizeof(int), by_heat);
+		for (i = nhot - 1, j = 0; i >= 0 && j < ncold; i--, j++) {
+			if (heat[hot[i]] <= 2 * heat[cold[j]]) {
+				break;
+			}
+			swap_tiers(hot[i], cold[j]);
+		}
+	}
+
+	for (i = 0; i < memsize; i++) {
+		heat[i] >>= 1;
+	}
+	next_scan = ref_count + (memsize > NUMA_SCAN ? memsize : NUMA_SCAN);
+}
+
+/* Counts a reference to the page in frame. */
+void numa_ref(int frame) {
+	tiers[frame_tier[frame]].refs++;
+	if (heat[frame] < HEAT_MAX) {
+		heat[frame]++;
+	}
+	if (ref_count >= next_scan) {
+		numa_scan();
+	}
+}
+
+/* Returns the estimated time spent on references, in microseconds, at the
+ * cost of the tier each one went to.
+ */
+double numa_access_time() {
+	double time = 0;
+	unsigned t;
+
+	for (t = 0; t < numa_tiers; t++) {
+		time += tiers[t].refs * tiers[t].cost;
+	}
+	return time;
+}
+
+void numa_report() {
+	unsigned resident[NUMA_MAXTIERS];
+	unsigned t;
+	int i;
+
+	memset(resident, 0, sizeof(resident));
+	for (i = 0; i < memsize; i++) {
+		resident[frame_tier[i]] += coremap.in_use[i];
+	}
+	printf("Page migrations: %d (placement %s)\n", numa_migrations,
+	       numa_placement == NUMA_PLACE_FAST ? "fast" :
+	       numa_placement == NUMA_PLACE_SLOW ? "slow" : "interleave");
+	for (t = 0; t < numa_tiers; t++) {
+		printf("Tier %u: %u frames at %g us, %ld references (%.2f%%), "
+		       "%d placed, %d promoted in, %d demoted out, %u resident\n",
+		       t, tiers[t].frames, tiers[t].cost, tiers[t].refs,
+		       ref_count ? 100.0 * tiers[t].refs / ref_count : 0.0,
+		       tiers[t].placements, tiers[t].promotions,
+		       tiers[t].demotions, resident[t]);
+	}
+}
+
+/*
+ * Saves and restores the tier configuration, which must match, and the
+ * tier of every frame, the heat of every page and the counters. The free
+ * frame stacks are saved by free_frames_save.
+ */
+void numa_save(FILE *fp) {
+	unsigned t;
+
+	ckpt_write(fp, &numa_tiers, sizeof(unsigned));
+	for (t = 0; t < numa_tiers; t++) {
+		ckpt_write(fp, &tiers[t].frames, sizeof(unsigned));
+	}
+	if (numa_tiers == 0) {
+		return;
+	}
+	ckpt_write(fp, frame_tier, memsize);
+	ckpt_write(fp, heat, memsize);
+	ckpt_write(fp, &next_scan, sizeof(int));
+	ckpt_write(fp, &interleave_next, sizeof(unsigned));
+	ckpt_write(fp, &numa_migrations, sizeof(int));
+	for (t = 0; t < numa_tiers; t++) {
+		ckpt_write(fp, &tiers[t].refs, sizeof(long));
+		ckpt_write(fp, &tiers[t].placements, sizeof(int));
+		ckpt_write(fp, &tiers[t].promotions, sizeof(int));
+		ckpt_write(fp, &tiers[t].demotions, sizeof(int));
+	}
+}
+
+void numa_restore(FILE *fp) {
+	unsigned n, frames, t;
+
+	ckpt_read(fp, &n, sizeof(unsigned));
+	if (n != numa_tiers) {
+		fprintf(stderr, "Error: checkpoint was taken with %u memory tiers\n", n);
+		exit(1);
+	}
+	for (t = 0; t < numa_tiers; t++) {
+		ckpt_read(fp, &frames, sizeof(unsigned));
+		if (frames != tiers[t].frames) {
+			fprintf(stderr, "Error: checkpoint has %u frames in tier %u\n",
+				frames, t);
+			exit(1);
+		}
+	}
+	if (numa_tiers == 0) {
+		return;
+	}
+	ckpt_read(fp, frame_tier, memsize);
+	ckpt_read(fp, heat, memsize);
+	ckpt_read(fp, &next_scan, sizeof(int));
+	ckpt_read(fp, &interleave_next, sizeof(unsigned));
+	ckpt_read(fp, &numa_migrations, sizeof(int));
+	for (t = 0; t < numa_tiers; t++) {
+		ckpt_read(fp, &tiers[t].refs, sizeof(long));
+		ckpt_read(fp, &tiers[t].placements, sizeof(int));
+		ckpt_read(fp, &tiers[t].promotions, sizeof(int));
+		ckpt_read(fp, &tiers[t].demotions, sizeof(int));
+	}
+}
+
+/* The free frame stacks of the tiers, in tier order. */
+void numa_free_save(FILE *fp) {
+	unsigned t;
+
+	for (t = 0; t < numa_tiers; t++) {
+		ckpt_write(fp, &tiers[t].nfree, sizeof(unsigned));
+		ckpt_write(fp, tiers[t].free, tiers[t].nfree * sizeof(int));
+	}
+}
+
+void numa_free_restore(FILE *fp) {
+	unsigned t;
+
+	for (t = 0; t < numa_tiers; t++) {
+		ckpt_read(fp, &tiers[t].nfree, sizeof(unsigned));
+		if (tiers[t].nfree > tiers[t].frames) {
+			fprintf(stderr, "Error: bad free frame count in checkpoint\n");
+			exit(1);
+		}
+		ckpt_read(fp, tiers[t].free, tiers[t].nfree * sizeof(int));
+	}
+}
@@ -8,38 +8,53 @@
 
 extern int debug;
 
-extern struct frame *coremap;
+extern struct coremap coremap;
 
-// Linked list structure to track the order in which
-// virtual addresses are called
-typedef struct node {
-	addr_t vaddr;
-	struct node *next;
-} node_t;
-
-node_t *next_trace; // The next trace that will be referenced
+// The virtual addresses of the whole trace, in the order in which they
+// are referenced. Loaded once by opt_init, so that replaying the trace
+// only has to move next_trace forward.
+static addr_t *trace;
+static int trace_len;
+static int next_trace; // Index of the next trace that will be referenced
 
 /*
  * Returns the distance, or number of frame references, until the
- * frame will be referenced.
+ * page at vaddr will be referenced.
  *
  * Returns -1 if the frame will never be referenced again.
  */
-int calculate_frame_distance(struct frame f) {
-	int distance = 0;
-	node_t *curr = next_trace;
+int calculate_frame_distance(addr_t vaddr) {
+	int i;
 
-	while (curr) {
-		if (curr->vaddr == f.vaddr) {
-			return distance;
+	for (i = next_trace; i < trace_len; i++) {
+		if (trace[i] == vaddr) {
+			return i - next_trace;
 		}
-		distance++;
-		curr = curr->next;
 	}
 
 	return -1;
 }
 
+/*
+ * Returns the distance until the page in frame will be referenced by any
+ * of the processes that share it, or -1 if none of them will.
+ */
+static int frame_distance(int frame) {
+	uint64_t m = coremap.mappers[frame];
+	addr_t vaddr = VADDR_ADDR(coremap.vaddr[frame]);
+	int min = -1;
+
+	while (m) {
+		unsigned pid = __builtin_ctzll(m);
+		int d = calculate_frame_distance(VADDR_TAG(pid, vaddr));
+		if (d != -1 && (min == -1 || d < min)) {
+			min = d;
+		}
+		m &= m - 1;
+	}
+	return min;
+}
+
 /* Page to evict is chosen using the optimal (aka MIN) algorithm.
  * Returns the page frame number (which is also the index in the coremap)
  * for the page that is to be evicted.
@@ -50,7 +65,11 @@ int opt_evict() {
 	int max = -1;
 
 	for (i = 0 ; i < memsize ; i++) {
-		int distance = calculate_frame_distance(coremap[i]);
+		// Skip frames the page-out daemon has already freed
+		if (!coremap.in_use[i]) {
+			continue;
+		}
+		int distance = frame_distance(i);
 
 		// If the frame will never appear again, just return it
 		if (distance == -1) {
@@ -69,9 +88,7 @@ int opt_evict() {
  * Input: The page table entry for the page that is being accessed.
  */
 void opt_ref(pgtbl_entry_t *p) {
-	node_t *curr_head = next_trace;
-	next_trace = next_trace->next;
-	free(curr_head);
+	next_trace++;
 }
 
 /* Initializes any data structures needed for this
@@ -82,33 +99,62 @@ void opt_init() {
 	addr_t vaddr = 0;
 	char type;
 	FILE* tfp;
+	int capacity = 1024;
+	unsigned pid = 0;
 
 	if((tfp = fopen(tracefile, "r")) == NULL) {
 		perror("Error opening tracefile:");
 		exit(1);
 	}
 
-	node_t *prev;
+	trace_len = 0;
+	next_trace = 0;
+	if ((trace = malloc(capacity * sizeof(addr_t))) == NULL) {
+		perror("Failed to allocate trace for opt");
+		exit(1);
+	}
 
 	// Load in the tracefile using modified same code via sim.c
 	while(fgets(buf, MAXLINE, tfp) != NULL) {
 		if(buf[0] != '=') {
+			// Forks are not references. Switches only change
+			// the process whose addresses follow, so addresses
+			// are stored tagged with the pid like in the coremap.
+			if (buf[0] == 'F') {
+				continue;
+			}
+			if (buf[0] == 'X') {
+				sscanf(buf, "%c %u", &type, &pid);
+				continue;
+			}
 			sscanf(buf, "%c %lx", &type, &vaddr);
 
-			node_t *trace = (node_t*) malloc(sizeof(node_t));
-			trace->vaddr = vaddr;
-			trace->next = NULL;
-
-			// If it's the first trace read, it's now the head of LL
-			if (!next_trace) {
-				next_trace = trace;
-			} else {
-				prev->next = trace;
+			// Grow the array as needed while loading, so it is
+			// never resized once the trace is being replayed
+			if (trace_len == capacity) {
+				capacity *= 2;
+				if ((trace = realloc(trace, capacity * sizeof(addr_t))) == NULL) {
+					perror("Failed to allocate trace for opt");
+					exit(1);
+				}
 			}
-
-			prev = trace;
+			trace[trace_len++] = VADDR_TAG(pid, vaddr);
 		} else {
 			continue;
 		}
 	}
+	fclose(tfp);
 }
+
+void opt_save(FILE *fp) {
+	ckpt_write(fp, &next_trace, sizeof(int));
+}
+
+/* The trace itself was already loaded by opt_init, so restoring only has
+ * to skip over the references that were replayed before the checkpoint.
+ */
+void opt_restore(FILE *fp) {
+	ckpt_read(fp, &next_trace, sizeof(int));
+}
+
+SIM_DEFINE_PLUGIN("opt", opt)
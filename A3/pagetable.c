@@ -3,8 +3,12 @@
 #include "sim.h"
 #include "pagetable.h"
 
-// The top-level page table (also known as the 'page directory')
-pgdir_entry_t pgdir[PTRS_PER_PGDIR];
+// The page directory of each process, and of the current process.
+// Process 0 always exists; fork allocates the directories of the others.
+static pgdir_entry_t pgdir0[PTRS_PER_PGDIR];
+pgdir_entry_t *proc_pgdir[MAXPROCS] = { pgdir0 };
+pgdir_entry_t *pgdir = pgdir0;
+unsigned cur_pid = 0;
 
 // Counters for various events.
 // Your code must increment these when the related events occur.
@@ -14,67 +18,295 @@ int ref_count = 0;
 int evict_clean_count = 0;
 int evict_dirty_count = 0;
 
+// Number of frames that hold a page
+unsigned frames_in_use = 0;
+
+// Number of faults that were given a free frame without evicting a page
+int free_frame_faults = 0;
+
+// Number of minor faults: faults on the first use of a page, which only
+// zero-fill a frame
+int minor_faults = 0;
+
+// Number of page tables allocated: second-level page tables, and the
+// page directories of processes created by fork
+unsigned pgtbl_count = 0;
+
+// Stores to a page shared with another process, which had to copy it
+int cow_faults = 0;
+
+// Faults on a page on swap that another process had already read back
+// in, so the frame it was read into could be shared
+int shared_swapins = 0;
+
+// Frames saved by sharing: the number of mappings of resident pages,
+// less the number of frames they use. Also the most this has been.
+unsigned frames_shared = 0;
+unsigned frames_shared_peak = 0;
+
+// Stack of free frame numbers. It starts out holding every frame with
+// frame 0 on top, so frames are first handed out in order. With memory
+// tiers (-N) each tier has its own stack in numa.c instead, and free_count
+// is their total.
+static int *free_frames;
+static unsigned free_count;
+
+static void put_free_frame(int frame) {
+	if (numa_tiers > 0) {
+		numa_put_free(frame);
+	} else {
+		free_frames[free_count] = frame;
+	}
+	free_count++;
+}
+
+static int take_free_frame() {
+	free_count--;
+	return numa_tiers > 0 ? numa_take_free() : free_frames[free_count];
+}
+
 /*
- * Allocates a frame to be used for the virtual page represented by p.
- * If all frames are in use, calls the replacement algorithm's evict_fcn to
- * select a victim frame.  Writes victim to swap if needed, and updates
- * pagetable entry for victim to indicate that virtual page is no longer in
- * (simulated) physical memory.
- *
- * Counters for evictions should be updated appropriately in this function.
+ * Rebuilds the free frame stack from coremap.in_use, and recounts
+ * frames_in_use. Called at startup and after restoring a checkpoint.
  */
-int allocate_frame(pgtbl_entry_t *p) {
+void init_free_frames() {
 	int i;
-	int frame = -1;
-	for(i = 0; i < memsize; i++) {
-		if(!coremap[i].in_use) {
-			frame = i;
-			break;
+
+	if (free_frames == NULL
+	    && (free_frames = malloc(memsize * sizeof(int))) == NULL) {
+		perror("Failed to allocate free frame list");
+		exit(1);
+	}
+
+	free_count = 0;
+	frames_in_use = 0;
+	for (i = memsize - 1; i >= 0; i--) {
+		if (coremap.in_use[i]) {
+			frames_in_use++;
+		} else {
+			free_frames[free_count++] = i;
 		}
 	}
-	if(frame == -1) { // Didn't find a free page.
-		// Call replacement algorithm's evict function to select victim
-		frame = evict_fcn();
+	if (numa_tiers > 0) {
+		numa_free_init();
+	}
+}
+
+/*
+ * Saves and restores the free frame stack, so that frames freed by the
+ * page-out daemon are handed out in the same order after a restore. The
+ * coremap must already have been restored when free_frames_restore is
+ * called.
+ */
+void free_frames_save(FILE *fp) {
+	ckpt_write(fp, &free_count, sizeof(unsigned));
+	if (numa_tiers > 0) {
+		numa_free_save(fp);
+	} else {
+		ckpt_write(fp, free_frames, free_count * sizeof(int));
+	}
+}
 
-		struct frame victim = coremap[frame];
+void free_frames_restore(FILE *fp) {
+	init_free_frames();
+	ckpt_read(fp, &free_count, sizeof(unsigned));
+	if (free_count != memsize - frames_in_use) {
+		fprintf(stderr, "Error: checkpoint has %u free frames, not %u\n",
+			free_count, memsize - frames_in_use);
+		exit(1);
+	}
+	if (numa_tiers > 0) {
+		numa_free_restore(fp);
+	} else {
+		ckpt_read(fp, free_frames, free_count * sizeof(int));
+	}
+}
 
-		// All frames were in use, so victim frame must hold some page
-		// Write victim page to swap, if needed, and update pagetable
-		if (victim.pte->frame & PG_DIRTY) {
-			// Write to SWAP
-			int off = swap_pageout(frame, victim.pte->swap_off);
+/* Returns the number of frames that are not holding a page. */
+unsigned free_frame_count() {
+	return free_count;
+}
 
-			assert(off != INVALID_SWAP); // Verify the swap succeeded and the offset is not invalid
+/* Counts the processes other than coremap.pte's that map frame. */
+static int other_mappers(int frame) {
+	return __builtin_popcountll(coremap.mappers[frame]) - 1;
+}
 
-			victim.pte->swap_off = off;
-			victim.pte->frame |= PG_ONSWAP;
-			victim.pte->frame &= ~PG_DIRTY;
+/* Returns the pte of process pid for the page in frame. */
+static pgtbl_entry_t *mapper_pte(int frame, unsigned pid) {
+	return find_pte(VADDR_TAG(pid, VADDR_ADDR(coremap.vaddr[frame])));
+}
 
-			evict_dirty_count++;
-		} else {
-			// Clean page
-			evict_clean_count++;
+/*
+ * Takes the page held in frame out of (simulated) physical memory: marks
+ * its pagetable entry invalid (in every process that maps it) and puts the
+ * frame on the free list.
+ *
+ * A dirty page still has to be written to swap with writeback_page before
+ * the frame is reused, so its pagetable entry is returned. For a clean
+ * page this returns NULL. coremap.vaddr and mappers are left as they are
+ * until the frame is allocated again, for writeback_page to use.
+ */
+pgtbl_entry_t *unmap_frame(int frame) {
+	pgtbl_entry_t *victim = coremap.pte[frame];
+	int dirty = coremap.flags[frame] & PG_DIRTY;
+	uint64_t others = coremap.mappers[frame] & ~PID_BIT(VADDR_PID(coremap.vaddr[frame]));
+
+	assert(coremap.in_use[frame]);
+
+	// Unmap the page from the other processes sharing it
+	frames_shared -= other_mappers(frame);
+	while (others) {
+		pgtbl_entry_t *pte = mapper_pte(frame, __builtin_ctzll(others));
+		dirty |= pte->frame & PG_DIRTY;
+		pte->frame &= ~PG_VALID;
+		others &= others - 1;
+	}
+
+	if (!dirty) {
+		// Clean page
+		evict_clean_count++;
+	}
+
+	// Mark victim invalid
+	victim->frame &= ~PG_VALID;
+
+	coremap.in_use[frame] = 0;
+	coremap.pte[frame] = NULL;
+	coremap.flags[frame] = 0;
+	swapcache_drop_frame(frame);
+	put_free_frame(frame);
+	frames_in_use--;
+
+	return dirty ? victim : NULL;
+}
+
+/*
+ * Writes the dirty page that was unmapped from frame to the compressed
+ * pool or, if that is off or the page does not compress, to swap. Marks
+ * its pagetable entry as in the pool or on swap, and not dirty. A page
+ * that was shared is written once, to a slot all its ptes then refer to.
+ */
+void writeback_page(int frame, pgtbl_entry_t *victim) {
+	uint64_t others = coremap.mappers[frame] & ~PID_BIT(VADDR_PID(coremap.vaddr[frame]));
+
+	if (zswap_percent > 0 && others == 0
+	    && zswap_store(frame, victim, coremap.vaddr[frame]) == 0) {
+		victim->frame |= PG_INZPOOL;
+		victim->frame &= ~PG_DIRTY;
+		evict_dirty_count++;
+		return;
+	}
+
+	// Write to SWAP
+	int off = swap_pageout(frame, victim->swap_off, coremap.vaddr[frame]);
+
+	assert(off != INVALID_SWAP); // Verify the swap succeeded and the offset is not invalid
+
+	victim->swap_off = off;
+	victim->frame |= PG_ONSWAP;
+	victim->frame &= ~PG_DIRTY;
+
+	while (others) {
+		pgtbl_entry_t *pte = mapper_pte(frame, __builtin_ctzll(others));
+		if (pte->swap_off != INVALID_SWAP) {
+			swap_release(pte->swap_off);
 		}
+		swap_dup(off);
+		pte->swap_off = off;
+		pte->frame |= PG_ONSWAP;
+		pte->frame &= ~PG_DIRTY;
+		others &= others - 1;
+	}
+
+	evict_dirty_count++;
+}
 
-		// Mark victim invalid, on swap, not dirty
-		victim.pte->frame &= ~PG_VALID;
+/*
+ * Evicts the page held in frame, writing it to swap first if it is dirty,
+ * and puts the frame on the free list.
+ *
+ * Counters for evictions are updated here.
+ */
+void evict_frame(int frame) {
+	pgtbl_entry_t *victim = unmap_frame(frame);
+	if (victim) {
+		writeback_page(frame, victim);
 	}
+}
+
+/*
+ * Allocates a frame to be used for the virtual page represented by p.
+ * If all frames are in use, calls the replacement algorithm's evict_fcn to
+ * select a victim frame and evicts the page in it.
+ */
+int allocate_frame(pgtbl_entry_t *p) {
+	int frame;
+	if (free_count > 0) {
+		free_frame_faults++;
+	} else { // Didn't find a free page.
+		// Call replacement algorithm's evict function to select victim
+		frame = evict_fcn();
+		if (verify) {
+			verify_evict(frame);
+		}
+		evict_frame(frame);
+	}
+	frame = take_free_frame();
+	frames_in_use++;
 
 	// Record information for virtual page that will now be stored in frame
-	coremap[frame].in_use = 1;
-	coremap[frame].pte = p;
+	coremap.in_use[frame] = 1;
+	coremap.pte[frame] = p;
+	coremap.flags[frame] = 0;
+	coremap.mappers[frame] = PID_BIT(cur_pid);
+	return frame;
+}
+
+/* Adds a mapping of the page in frame by the current process. */
+static void share_frame(int frame) {
+	coremap.mappers[frame] |= PID_BIT(cur_pid);
+	if (++frames_shared > frames_shared_peak) {
+		frames_shared_peak = frames_shared;
+	}
+}
+
+/*
+ * Handles a store by the current process to the page in frame, which
+ * another process also maps: copies the page to a new frame that only
+ * the current process maps. Returns the new frame.
+ */
+static int copy_on_write(pgtbl_entry_t *p, addr_t vaddr) {
+	static char copy[SIMPAGESIZE];
+	int old = p->frame >> PAGE_SHIFT;
+	int frame;
+
+	// Take the page out of the shared frame before allocating, since the
+	// shared frame may itself be picked for eviction
+	memcpy(copy, &physmem[old * SIMPAGESIZE], SIMPAGESIZE);
+	coremap.mappers[old] &= ~PID_BIT(cur_pid);
+	frames_shared--;
+	if (coremap.pte[old] == p) {
+		coremap.vaddr[old] = VADDR_TAG(__builtin_ctzll(coremap.mappers[old]),
+					       VADDR_ADDR(vaddr));
+		coremap.pte[old] = find_pte(coremap.vaddr[old]);
+	}
+	p->frame &= ~PG_VALID;
+
+	frame = allocate_frame(p);
+	memcpy(&physmem[frame * SIMPAGESIZE], copy, SIMPAGESIZE);
+	p->frame = (frame << PAGE_SHIFT) | (p->frame & PG_ONSWAP) | PG_DIRTY;
+	coremap.vaddr[frame] = vaddr;
+	cow_faults++;
 	return frame;
 }
 
 /*
- * Initializes the top-level pagetable.
+ * Initializes the top-level pagetable of process 0.
  * This function is called once at the start of the simulation.
- * For the simulation, there is a single "process" whose reference trace is
- * being simulated, so there is just one top-level page table (page directory).
- * To keep things simple, we use a global array of 'page directory entries'.
- *
- * In a real OS, each process would have its own page directory, which would
- * need to be allocated and initialized as part of process creation.
+ * The trace starts in process 0, whose page directory is a global array of
+ * 'page directory entries'. Fork events in the trace create more
+ * processes, each with its own page directory (see proc.c).
  */
 void init_pagetable() {
 	int i;
@@ -83,6 +315,7 @@ void init_pagetable() {
 	for (i=0; i < PTRS_PER_PGDIR; i++) {
 		pgdir[i].pde = 0;
 	}
+	init_free_frames();
 }
 
 // For simulation, we get second-level pagetables from ordinary memory
@@ -98,10 +331,12 @@ pgdir_entry_t init_second_level() {
 		perror("Failed to allocate aligned memory for page table");
 		exit(1);
 	}
+	pgtbl_count++;
 
 	// Initialize all entries in second-level pagetable
 	for (i=0; i < PTRS_PER_PGTBL; i++) {
 		pgtbl[i].frame = 0; // sets all bits, including valid, to zero
+		pgtbl[i].zhandle = 0;
 		pgtbl[i].swap_off = INVALID_SWAP;
 	}
 
@@ -133,6 +368,19 @@ void init_frame(int frame, addr_t vaddr) {
 	return;
 }
 
+/*
+ * Returns the pagetable entry for the tagged vaddr, whose second-level page
+ * table must already exist. Used to find the other ptes that map a shared
+ * frame, and to rebuild pointers to entries when restoring a checkpoint.
+ */
+pgtbl_entry_t *find_pte(addr_t vaddr) {
+	pgdir_entry_t *dir = proc_pgdir[VADDR_PID(vaddr)];
+	unsigned idx = PGDIR_INDEX(VADDR_ADDR(vaddr));
+
+	assert(dir != NULL && (dir[idx].pde & PG_VALID));
+	return (pgtbl_entry_t *)(dir[idx].pde & PAGE_MASK) + PGTBL_INDEX(vaddr);
+}
+
 /*
  * Locate the physical frame number for the given vaddr using the page table.
  *
@@ -143,12 +391,23 @@ void init_frame(int frame, addr_t vaddr) {
  * If the entry is invalid and on swap, then a (simulated) physical frame
  * should be allocated and filled by reading the page data from swap.
  *
+ * Pages of the current process that another process also maps are shared
+ * copy-on-write: a store to one gets a private copy of it first.
+ *
  * Counters for hit, miss and reference events should be incremented in
  * this function.
  */
 char *find_physpage(addr_t vaddr, char type) {
 	pgtbl_entry_t *p=NULL; // pointer to the full page table entry for vaddr
 	unsigned idx = PGDIR_INDEX(vaddr); // get index into page directory
+	addr_t tagged = VADDR_TAG(cur_pid, vaddr);
+	int frame;
+
+	if (idx >= PTRS_PER_PGDIR) {
+		fprintf(stderr, "Error: address %lx is outside the simulated "
+			"address space\n", vaddr);
+		exit(1);
+	}
 
 	// Check if the pde at index has been initialized
 	// (initially set to 0 in init_pagetable)
@@ -167,23 +426,47 @@ char *find_physpage(addr_t vaddr, char type) {
 	// Check if p is valid or not, on swap or not, and handle appropriately
 	if (p->frame & PG_VALID) {
 		hit_count++;
+		frame = p->frame >> PAGE_SHIFT;
+		if ((type == 'S' || type == 'M') && other_mappers(frame) > 0) {
+			frame = copy_on_write(p, tagged);
+		}
+	} else if ((p->frame & (PG_ONSWAP | PG_INZPOOL)) == PG_ONSWAP
+		   && (frame = swapcache_lookup(p->swap_off)) >= 0) {
+		// Another process sharing the page has already read it back
+		// in from swap, so map the same frame
+		share_frame(frame);
+		p->frame = (frame << PAGE_SHIFT) | PG_ONSWAP;
+		shared_swapins++;
+		miss_count++;
+		// A store still needs its own copy, as on a hit
+		if ((type == 'S' || type == 'M') && other_mappers(frame) > 0) {
+			frame = copy_on_write(p, tagged);
+		}
 	} else {
-		int frame = allocate_frame(p);
-
-		// Check if the frame is in swap or not
-		if (p->frame & PG_ONSWAP) {
+		frame = allocate_frame(p);
+
+		// Check if the page is in the compressed pool, in swap or not.
+		// Taking a page out of the pool frees its compressed copy, so
+		// it is dirty again (any copy on swap is older).
+		if (p->frame & PG_INZPOOL) {
+			zswap_load(frame, p);
+			p->frame = (frame << PAGE_SHIFT) | (p->frame & PG_ONSWAP);
+			p->frame |= PG_DIRTY;
+		} else if (p->frame & PG_ONSWAP) {
 			assert(swap_pagein(frame, p->swap_off) == 0);
+			swapcache_add(p->swap_off, frame);
 			p->frame = frame << PAGE_SHIFT;
 			p->frame &= ~PG_DIRTY;
 			p->frame |= PG_ONSWAP;
 		} else {
 			// First use, initialize the frame
 			init_frame(frame, vaddr);
+			minor_faults++;
 			p->frame = frame << PAGE_SHIFT;
 			p->frame |= PG_DIRTY;
 		}
 
-		coremap[frame].vaddr = vaddr; // Set vaddr for OPT algorithm
+		coremap.vaddr[frame] = tagged; // Set vaddr for OPT algorithm
 		miss_count++;
 	}
 
@@ -193,14 +476,29 @@ char *find_physpage(addr_t vaddr, char type) {
 	p->frame |= PG_REF;
 
 	// Check if the access type is data store or data modify, mark frame
-	// as dirty in this case
+	// as dirty in this case. The frame no longer matches its copy on swap.
 	if (type == 'S' || type == 'M') {
 		p->frame |= PG_DIRTY;
+		swapcache_drop_frame(frame);
 	}
 
+	// Mirror the bits into the coremap for the replacement algorithm
+	coremap.flags[frame] = p->frame & (PG_REF | PG_DIRTY);
+
 	// Call replacement algorithm's ref_fcn for this page
 	ref_fcn(p);
 	ref_count++;
+	if (verify) {
+		verify_ref(frame);
+	}
+	if (numa_tiers > 0) {
+		numa_ref(frame);
+	}
+
+	// Write out interval statistics once every stats_interval references
+	if (ref_count == stats_next) {
+		stats_flush();
+	}
 
 	// Return pointer into (simulated) physical memory at start of frame
 	return  &physmem[(p->frame >> PAGE_SHIFT)*SIMPAGESIZE];
@@ -212,8 +510,7 @@ void print_pagetbl(pgtbl_entry_t *pgtbl) {
 	first_invalid = last_invalid = -1;
 
 	for (i=0; i < PTRS_PER_PGTBL; i++) {
-		if (!(pgtbl[i].frame & PG_VALID) &&
-		    !(pgtbl[i].frame & PG_ONSWAP)) {
+		if (!(pgtbl[i].frame & (PG_VALID | PG_ONSWAP | PG_INZPOOL))) {
 			if (first_invalid == -1) {
 				first_invalid = i;
 			}
@@ -231,6 +528,8 @@ void print_pagetbl(pgtbl_entry_t *pgtbl) {
 					printf("DIRTY, ");
 				}
 				printf("in frame %d\n",pgtbl[i].frame >> PAGE_SHIFT);
+			} else if (pgtbl[i].frame & PG_INZPOOL) {
+				printf("INZPOOL, handle %u\n", pgtbl[i].zhandle);
 			} else {
 				assert(pgtbl[i].frame & PG_ONSWAP);
 				printf("ONSWAP, at offset %lu\n",pgtbl[i].swap_off);
@@ -243,7 +542,7 @@ void print_pagetbl(pgtbl_entry_t *pgtbl) {
 	}
 }
 
-void print_pagedirectory() {
+static void print_pgdir(pgdir_entry_t *pgdir) {
 	int i; // index into pgdir
 	int first_invalid,last_invalid;
 	first_invalid = last_invalid = -1;
@@ -268,3 +567,21 @@ void print_pagedirectory() {
 		}
 	}
 }
+
+/* Prints the page directory of every process, with a heading for each
+ * once the trace has forked.
+ */
+void print_pagedirectory() {
+	unsigned pid;
+
+	if (fork_count == 0) {
+		print_pgdir(pgdir0);
+		return;
+	}
+	for (pid = 0; pid < MAXPROCS; pid++) {
+		if (proc_pgdir[pid] != NULL) {
+			printf("Process %u:\n", pid);
+			print_pgdir(proc_pgdir[pid]);
+		}
+	}
+}
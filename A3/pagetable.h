@@ -14,6 +14,9 @@
 #define PG_DIRTY        (0x2) // Dirty bit in pgd or pte, set if modified
 #define PG_REF          (0x4) // Reference bit, set if page has been referenced
 #define PG_ONSWAP       (0x8) // Set if page has been evicted to swap
+#define PG_INZPOOL      (0x10) // Set if page is in the compressed pool
+#define PG_LOCKED       (0x20) // Set while a thread faults in or evicts the
+                               // page, in concurrent replay (-T)
 #define INVALID_SWAP    -1
 
 #ifdef TRACE_64
@@ -53,39 +56,124 @@ typedef struct {
 // Page table entry (2nd-level).
 typedef struct {
 	unsigned int frame; // if valid bit == 1, physical frame holding vpage
+	unsigned int zhandle; // handle of vpage in the compressed pool, if any
 	off_t swap_off;       // offset in swap file of vpage, if any
 } pgtbl_entry_t;
 
+// Processes. Each has its own top-level page table (also known as the
+// 'page directory'), and pgdir points at the one of the process whose
+// references are being replayed. Process 0 is the one the trace starts
+// in; the others are created by fork events in the trace.
+#define MAXPROCS 64
+
+extern pgdir_entry_t *pgdir;
+extern pgdir_entry_t *proc_pgdir[MAXPROCS];
+extern unsigned cur_pid;
+
+// Pages are named by their vaddr tagged with the process they belong to,
+// in the bits above the 36-bit user address. Process 0 pages have a tag
+// of 0, so their tagged vaddr is just the vaddr.
+#define VADDR_PID_SHIFT    48
+#define VADDR_TAG(pid, va) (((addr_t)(pid) << VADDR_PID_SHIFT) | (va))
+#define VADDR_PID(x)       ((unsigned)((x) >> VADDR_PID_SHIFT))
+#define VADDR_ADDR(x)      ((x) & (((addr_t)1 << VADDR_PID_SHIFT) - 1))
+#define PID_BIT(pid)       ((uint64_t)1 << (pid))
+
+extern int fork_count;
+extern int cow_faults;
+extern int shared_swapins;
+extern unsigned frames_shared;
+extern unsigned frames_shared_peak;
+extern void proc_fork(unsigned child);
+extern void proc_switch(unsigned pid);
+extern void proc_save(FILE *fp);
+extern void proc_restore(FILE *fp);
+
+// With -V, access_mem passes every page version it finds to verify_data,
+// and proc_fork tells verify_fork about new processes (see verify.c)
+extern void verify_data(addr_t vaddr, int version, char type);
+extern void verify_fork(unsigned child);
+
 extern void init_pagetable();
+extern pgdir_entry_t init_second_level();
 extern char *find_physpage(addr_t vaddr, char type);
+extern pgtbl_entry_t *find_pte(addr_t vaddr);
+extern void init_frame(int frame, addr_t vaddr);
 
-extern void print_pagedirectory(void);
+extern void init_free_frames();
+extern void free_frames_save(FILE *fp);
+extern void free_frames_restore(FILE *fp);
+extern unsigned free_frame_count();
+extern pgtbl_entry_t *unmap_frame(int frame);
+extern void writeback_page(int frame, pgtbl_entry_t *victim);
+extern void evict_frame(int frame);
 
-struct frame {
-	char in_use;       // True if frame is allocated, False if frame is free
-	pgtbl_entry_t *pte;// Pointer back to pagetable entry (pte) for page
-	                   // stored in this frame
-	addr_t vaddr;      // Used in OPT algorithm
-};
+extern void print_pagedirectory(void);
 
 /* The coremap holds information about physical memory.
- * The index into coremap is the physical page frame number stored
+ * It is kept as one array per field, rather than an array of structs, so
+ * that eviction scans which only look at one field sweep contiguous memory.
+ * The index into each array is the physical page frame number stored
  * in the page table entry (pgtbl_entry_t).
  */
-extern struct frame *coremap;
+struct coremap {
+	unsigned char *flags; // PG_REF and PG_DIRTY of the page in each frame
+	char *in_use;         // True if frame is allocated, False if frame is free
+	pgtbl_entry_t **pte;  // Pointer back to pagetable entry (pte) for page
+	                      // stored in this frame
+	addr_t *vaddr;        // Tagged vaddr of the page, as seen by the
+	                      // process that pte belongs to
+	uint64_t *mappers;    // Bit p is set if process p maps the page
+};
+
+/* A page that is shared after a fork is mapped by every process whose bit
+ * is set in mappers, at the same vaddr, so the ptes that map a frame are
+ * found through the page tables of those processes (see unmap_frame).
+ * pte and vaddr name one of them. A store to a page that more than one
+ * process maps copies it first (copy-on-write).
+ */
+
+/* The flags array mirrors the PG_REF and PG_DIRTY bits of the pte of each
+ * resident page, one byte per frame. It is set by find_physpage on every
+ * reference; replacement algorithms clear PG_REF here (not in the pte)
+ * when they want to track use since their last sweep.
+ */
+extern struct coremap coremap;
 
 
 // Swap functions for use in other files
 extern int swap_init(unsigned swapsize);
 extern void swap_destroy(void);
 extern int swap_pagein(unsigned frame, int swap_offset);
-extern int swap_pageout(unsigned frame, int swap_offset);
+extern int swap_pageout(unsigned frame, int swap_offset, addr_t vaddr);
+extern int swap_pageout_page(char *page, int swap_offset, addr_t vaddr);
+extern void swap_save(FILE *fp);
+extern void swap_restore(FILE *fp);
+
+// Swap slots shared after a fork are reference counted, and the swap cache
+// finds the frame a shared slot was last read into
+extern void swap_dup(int swap_offset);
+extern void swap_release(int swap_offset);
+extern int swapcache_lookup(int swap_offset);
+extern void swapcache_add(int swap_offset, int frame);
+extern void swapcache_drop_frame(int frame);
+
+// Compressed pool functions (zswap.c)
+extern void zswap_init(void);
+extern int zswap_store(int frame, pgtbl_entry_t *pte, addr_t vaddr);
+extern void zswap_load(int frame, pgtbl_entry_t *pte);
+extern void zswap_save(FILE *fp);
+extern void zswap_writeback_pte(pgtbl_entry_t *pte);
+extern void zswap_restore(FILE *fp);
 
 extern void rand_init();
 extern void lru_init();
 extern void clock_init();
 extern void fifo_init();
 extern void opt_init();
+extern void gds_init();
+extern void gdsf_init();
+extern void lecar_init();
 
 // These may not need to do anything for some algorithms
 extern void rand_ref(pgtbl_entry_t *);
@@ -93,11 +181,31 @@ extern void lru_ref(pgtbl_entry_t *);
 extern void clock_ref(pgtbl_entry_t *);
 extern void fifo_ref(pgtbl_entry_t *);
 extern void opt_ref(pgtbl_entry_t *);
+extern void gds_ref(pgtbl_entry_t *);
+extern void lecar_ref(pgtbl_entry_t *);
 
 extern int rand_evict();
 extern int lru_evict();
 extern int clock_evict();
 extern int fifo_evict();
 extern int opt_evict();
+extern int gds_evict();
+extern int lecar_evict();
+
+extern void rand_save(FILE *);
+extern void lru_save(FILE *);
+extern void clock_save(FILE *);
+extern void fifo_save(FILE *);
+extern void opt_save(FILE *);
+extern void gds_save(FILE *);
+extern void lecar_save(FILE *);
+
+extern void rand_restore(FILE *);
+extern void lru_restore(FILE *);
+extern void clock_restore(FILE *);
+extern void fifo_restore(FILE *);
+extern void opt_restore(FILE *);
+extern void gds_restore(FILE *);
+extern void lecar_restore(FILE *);
 
 #endif /* PAGETABLE_H */
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim.h"
+
+/* A fixed-capacity pool of equally sized objects. All of the memory is
+ * allocated up front by pool_create, and free objects are kept on a list
+ * threaded through the objects themselves, so pool_alloc and pool_free
+ * never call into the heap.
+ */
+struct pool {
+	size_t objsize;
+	unsigned count;
+	char *mem;
+	void *free_list;
+};
+
+struct pool *pool_create(size_t objsize, unsigned count) {
+	struct pool *pool;
+	unsigned i;
+
+	// Every object must be able to hold the free list link
+	if (objsize < sizeof(void *)) {
+		objsize = sizeof(void *);
+	}
+	objsize = (objsize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if ((pool = malloc(sizeof(struct pool))) == NULL
+	    || (pool->mem = malloc(objsize * count)) == NULL) {
+		perror("Failed to allocate object pool");
+		exit(1);
+	}
+	pool->objsize = objsize;
+	pool->count = count;
+	pool->free_list = NULL;
+
+	// Push the objects in reverse, so they are handed out in address order
+	for (i = count; i > 0; i--) {
+		void **obj = (void **)(pool->mem + (i - 1) * objsize);
+		*obj = pool->free_list;
+		pool->free_list = obj;
+	}
+	return pool;
+}
+
+/* Returns a free object from the pool, or NULL if all are in use. */
+void *pool_alloc(struct pool *pool) {
+	void **obj = pool->free_list;
+	if (obj != NULL) {
+		pool->free_list = *obj;
+	}
+	return obj;
+}
+
+void pool_free(struct pool *pool, void *obj) {
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+}
+
+void pool_destroy(struct pool *pool) {
+	free(pool->mem);
+	free(pool);
+}
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "pagetable.h"
+
+// Number of fork events replayed
+int fork_count = 0;
+
+/* Allocates an empty page directory for process pid. */
+static pgdir_entry_t *proc_create(unsigned pid) {
+	pgdir_entry_t *dir;
+
+	if ((dir = calloc(PTRS_PER_PGDIR, sizeof(pgdir_entry_t))) == NULL) {
+		perror("Failed to allocate page directory");
+		exit(1);
+	}
+	pgtbl_count++;
+	proc_pgdir[pid] = dir;
+	return dir;
+}
+
+/*
+ * Creates process child as a copy of the current process, the way fork
+ * does: the child gets its own page tables, holding copies of the
+ * current process's ptes. The pages are not copied. Resident pages become
+ * shared, copy-on-write, and pages on swap share their swap slots.
+ *
+ * Entries in the compressed pool belong to a single pte, so the current
+ * process's pages in the pool are written back to swap first.
+ */
+void proc_fork(unsigned child) {
+	pgdir_entry_t *dir;
+	int i, j;
+
+	if (child >= MAXPROCS || proc_pgdir[child] != NULL) {
+		fprintf(stderr, "Error: fork to process %u, which is in use or "
+			"more than %d\n", child, MAXPROCS - 1);
+		exit(1);
+	}
+	dir = proc_create(child);
+
+	for (i = 0; i < PTRS_PER_PGDIR; i++) {
+		pgtbl_entry_t *src, *dst;
+
+		if (!(pgdir[i].pde & PG_VALID)) {
+			continue;
+		}
+		src = (pgtbl_entry_t *)(pgdir[i].pde & PAGE_MASK);
+		dir[i] = init_second_level();
+		dst = (pgtbl_entry_t *)(dir[i].pde & PAGE_MASK);
+
+		for (j = 0; j < PTRS_PER_PGTBL; j++) {
+			if (src[j].frame & PG_INZPOOL) {
+				zswap_writeback_pte(&src[j]);
+			}
+			dst[j] = src[j];
+			if (src[j].frame & PG_VALID) {
+				coremap.mappers[src[j].frame >> PAGE_SHIFT] |= PID_BIT(child);
+				frames_shared++;
+			}
+			if (src[j].swap_off != INVALID_SWAP) {
+				swap_dup(src[j].swap_off);
+			}
+		}
+	}
+	if (frames_shared > frames_shared_peak) {
+		frames_shared_peak = frames_shared;
+	}
+	if (verify) {
+		verify_fork(child);
+	}
+	fork_count++;
+}
+
+/* Makes pid the process whose references are replayed. */
+void proc_switch(unsigned pid) {
+	if (pid >= MAXPROCS || proc_pgdir[pid] == NULL) {
+		fprintf(stderr, "Error: switch to process %u, which does not exist\n",
+			pid);
+		exit(1);
+	}
+	cur_pid = pid;
+	pgdir = proc_pgdir[pid];
+}
+
+/*
+ * Writes the page tables of every process to a checkpoint file: for each
+ * process, its pid followed by the index of each valid page directory
+ * entry and the second-level table it points to, terminated by -1. The
+ * list of processes is also terminated by -1.
+ */
+void proc_save(FILE *fp) {
+	int pid, i;
+	int end = -1;
+
+	ckpt_write(fp, &fork_count, sizeof(int));
+	ckpt_write(fp, &cow_faults, sizeof(int));
+	ckpt_write(fp, &shared_swapins, sizeof(int));
+	ckpt_write(fp, &frames_shared, sizeof(unsigned));
+	ckpt_write(fp, &frames_shared_peak, sizeof(unsigned));
+
+	for (pid = 0; pid < MAXPROCS; pid++) {
+		pgdir_entry_t *dir = proc_pgdir[pid];
+		if (dir == NULL) {
+			continue;
+		}
+		ckpt_write(fp, &pid, sizeof(int));
+		for (i = 0; i < PTRS_PER_PGDIR; i++) {
+			if (dir[i].pde & PG_VALID) {
+				pgtbl_entry_t *pgtbl = (pgtbl_entry_t *)(dir[i].pde & PAGE_MASK);
+				ckpt_write(fp, &i, sizeof(int));
+				ckpt_write(fp, pgtbl, PTRS_PER_PGTBL*sizeof(pgtbl_entry_t));
+			}
+		}
+		ckpt_write(fp, &end, sizeof(int));
+	}
+	ckpt_write(fp, &end, sizeof(int));
+	ckpt_write(fp, &cur_pid, sizeof(unsigned));
+}
+
+/* Reads back the page tables written by proc_save, creating the
+ * processes that do not exist yet.
+ */
+void proc_restore(FILE *fp) {
+	unsigned pid;
+	int p, i;
+
+	ckpt_read(fp, &fork_count, sizeof(int));
+	ckpt_read(fp, &cow_faults, sizeof(int));
+	ckpt_read(fp, &shared_swapins, sizeof(int));
+	ckpt_read(fp, &frames_shared, sizeof(unsigned));
+	ckpt_read(fp, &frames_shared_peak, sizeof(unsigned));
+
+	while (1) {
+		pgdir_entry_t *dir;
+
+		ckpt_read(fp, &p, sizeof(int));
+		if (p == -1) {
+			break;
+		}
+		if (p < 0 || p >= MAXPROCS) {
+			fprintf(stderr, "Error: bad process %d in checkpoint\n", p);
+			exit(1);
+		}
+		dir = proc_pgdir[p] != NULL ? proc_pgdir[p] : proc_create(p);
+
+		while (1) {
+			ckpt_read(fp, &i, sizeof(int));
+			if (i == -1) {
+				break;
+			}
+			if (i < 0 || i >= PTRS_PER_PGDIR) {
+				fprintf(stderr, "Error: bad page directory index %d in checkpoint\n", i);
+				exit(1);
+			}
+			if (dir[i].pde == 0) {
+				dir[i] = init_second_level();
+			}
+			ckpt_read(fp, (pgtbl_entry_t *)(dir[i].pde & PAGE_MASK),
+				  PTRS_PER_PGTBL*sizeof(pgtbl_entry_t));
+		}
+	}
+	ckpt_read(fp, &pid, sizeof(unsigned));
+	proc_switch(pid);
+}
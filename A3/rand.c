@@ -8,7 +8,11 @@
 
 
 
-extern struct frame *coremap;
+extern struct coremap coremap;
+
+// Number of victims chosen so far, so that a restored checkpoint can
+// bring random() back to the same point in its sequence.
+static unsigned long evictions;
 
 /* Page to evict is chosen using the rand algorithm.
  * Returns the page frame number (which is also the index in the coremap)
@@ -17,6 +21,7 @@ extern struct frame *coremap;
 int rand_evict() {
 	// choose index in coremap to evict a page from
 	int idx = (int)(random() % memsize);
+	evictions++;
 	
 	return idx;
 }
@@ -31,4 +36,19 @@ void rand_ref(pgtbl_entry_t *p) {
 }
 
 void rand_init() {
+	evictions = 0;
+}
+
+void rand_save(FILE *fp) {
+	ckpt_write(fp, &evictions, sizeof(evictions));
 }
+
+void rand_restore(FILE *fp) {
+	unsigned long i;
+	ckpt_read(fp, &evictions, sizeof(evictions));
+	for (i = 0; i < evictions; i++) {
+		random();
+	}
+}
+
+SIM_DEFINE_PLUGIN("rand", rand)
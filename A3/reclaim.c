@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "sim.h"
+#include "pagetable.h"
+
+// Free frame watermarks. The daemon is off while reclaim_high is 0.
+unsigned reclaim_low = 0;
+unsigned reclaim_high = 0;
+
+// Number of times the daemon ran, and the number of pages it evicted
+int reclaim_batches = 0;
+int reclaim_pages = 0;
+
+// A dirty page that has been unmapped but not yet written to swap. Its
+// frame is already on the free list, but nothing can allocate it until
+// reclaim returns.
+struct writeback {
+	int frame;
+	pgtbl_entry_t *pte;
+};
+
+static struct writeback *dirty_batch;
+
+/*
+ * Prepares the page-out daemon. Must be called after the watermarks are
+ * set, and before the trace is replayed.
+ */
+void reclaim_init() {
+	if (reclaim_high > memsize) {
+		reclaim_high = memsize;
+	}
+	if (reclaim_low > reclaim_high) {
+		reclaim_low = reclaim_high;
+	}
+	if ((dirty_batch = malloc(memsize * sizeof(struct writeback))) == NULL) {
+		perror("Failed to allocate reclaim batch");
+		exit(1);
+	}
+}
+
+/* Orders dirty pages by virtual address. They are written to swap in this
+ * order, so pages that are next to each other in memory end up next to
+ * each other in the same swap cluster, where page-in can read them back
+ * together.
+ */
+static int cmp_vaddr(const void *a, const void *b) {
+	addr_t va = coremap.vaddr[((const struct writeback *)a)->frame];
+	addr_t vb = coremap.vaddr[((const struct writeback *)b)->frame];
+	return (va > vb) - (va < vb);
+}
+
+/*
+ * Runs the page-out daemon. If fewer than reclaim_low frames are free, asks
+ * the replacement algorithm for victims until reclaim_high frames are
+ * free. Every victim is unmapped straight away; the dirty ones are then
+ * written to swap as one batch, in virtual address order.
+ */
+void reclaim() {
+	int ndirty = 0;
+	int i;
+
+	if (free_frame_count() >= reclaim_low) {
+		return;
+	}
+	reclaim_batches++;
+
+	while (free_frame_count() < reclaim_high && frames_in_use > 0) {
+		int frame = evict_fcn();
+
+		// Algorithms are not told about frames the daemon frees, so they
+		// may hand back one that is already free. Mark it referenced so
+		// scanning algorithms like clock move past it, and ask again.
+		if (!coremap.in_use[frame]) {
+			coremap.flags[frame] |= PG_REF;
+			continue;
+		}
+
+		dirty_batch[ndirty].pte = unmap_frame(frame);
+		if (dirty_batch[ndirty].pte != NULL) {
+			dirty_batch[ndirty++].frame = frame;
+		}
+		reclaim_pages++;
+	}
+
+	qsort(dirty_batch, ndirty, sizeof(struct writeback), cmp_vaddr);
+	for (i = 0; i < ndirty; i++) {
+		writeback_page(dirty_batch[i].frame, dirty_batch[i].pte);
+	}
+}
@@ -0,0 +1,28 @@
+#!/bin/bash
+# Measures how fault throughput scales with the number of threads in
+# concurrent replay (sim -T), from 1 thread up to one per core.
+#
+# Usage: ./scale.sh tracefile [memsize] [maxthreads]
+#
+# The threads split the trace into contiguous chunks, one each, or use one
+# file each if tracefile has a %d in it. Prints one line per thread count,
+# doubling up to maxthreads (default: the number of cores), with the
+# throughput and the speedup over one thread.
+#
+# This has only ever been run on a single core, where it shows the cost of
+# the locking rather than any speedup; no numbers from more than one core
+# have been measured yet.
+
+trace=$1
+m=${2:-1000}
+max=${3:-$(nproc)}
+
+t=1
+while :; do
+	./sim -f "$trace" -m $m -s 1000000 -a clock -T $t | awk -v t=$t '
+		/^Concurrent replay/ { ms = $5; refs = $7; faults = $9; waits = $11 }
+		END { printf("%3d threads: %10.3f ms, %12.0f refs/s, %12.0f faults/s, %8d waits\n",
+			     t, ms, refs, faults, waits) }'
+	[ $t -ge $max ] && break
+	t=$((t * 2 > max ? max : t * 2))
+done | awk '{ if (NR == 1) base = $5; printf("%s, speedup %.2fx\n", $0, $5 / base) }'
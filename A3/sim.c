@@ -4,6 +4,7 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dlfcn.h>
 #include "sim.h"
 #include "pagetable.h"
 
@@ -11,27 +12,163 @@
 unsigned memsize = 0;
 int debug = 0;
 char *physmem = NULL;
-struct frame *coremap = NULL;
+struct coremap coremap;
 char *tracefile = NULL;
 
+// Checkpoint to write once ckpt_index references have been replayed
+static char *ckpt_file = NULL;
+static int ckpt_index = -1;
+static char *alg_name = NULL; // Name of the algorithm, as stored in checkpoints
+
+// Default latencies: a fast SSD behind a few microseconds of fault
+// handling, 100ns DRAM references, and about 1us to clear or copy a page
+struct latency latency = { 2.0, 100.0, 100.0, 0.1, 1.0 };
+
+/* Returns the estimated time spent paging so far, in microseconds. A
+ * copy-on-write fault is not a miss, so it pays for its own trap.
+ */
+double paging_time() {
+	return miss_count * latency.fault
+		+ (swap_pageins - swap_cache_hits) * latency.pagein
+		+ swap_writes * latency.pageout
+		+ minor_faults * latency.minor
+		+ cow_faults * (latency.fault + latency.minor);
+}
+
+/* Returns the estimated run time so far, in microseconds. */
+double run_time() {
+	if (numa_tiers > 0) {
+		return numa_access_time() + numa_migrations * latency.minor
+			+ paging_time();
+	}
+	return ref_count * latency.hit + paging_time();
+}
+
+/* Parses the -t argument "fault,pagein,pageout,hit,minor" into latency.
+ * Fields left out keep their defaults. Returns 0 on success, -1 if it is
+ * malformed.
+ */
+static int parse_latency(char *arg) {
+	double *fields[] = { &latency.fault, &latency.pagein, &latency.pageout,
+			     &latency.hit, &latency.minor };
+	char *end;
+	int i;
+
+	for (i = 0; i < 5 && *arg; i++) {
+		if (*arg != ',') {
+			*fields[i] = strtod(arg, &end);
+			if (end == arg || *fields[i] < 0) {
+				return -1;
+			}
+			arg = end;
+		}
+		if (*arg == ',') {
+			arg++;
+		} else if (*arg) {
+			return -1;
+		}
+	}
+	return *arg ? -1 : 0;
+}
+
 /* The algs array gives us a mapping between the name of an eviction
  * algorithm as given in a command line argument, and the function to
  * call to select the victim page.
  */
 struct functions algs[] = {
-	{"rand", rand_init, rand_ref, rand_evict}, 
-	{"lru", lru_init, lru_ref, lru_evict},
-	{"fifo", fifo_init, fifo_ref, fifo_evict},
-	{"clock",clock_init, clock_ref, clock_evict},
-	{"opt", opt_init, opt_ref, opt_evict}
+	{"rand", rand_init, rand_ref, rand_evict, rand_save, rand_restore}, 
+	{"lru", lru_init, lru_ref, lru_evict, lru_save, lru_restore},
+	{"fifo", fifo_init, fifo_ref, fifo_evict, fifo_save, fifo_restore},
+	{"clock",clock_init, clock_ref, clock_evict, clock_save, clock_restore},
+	{"opt", opt_init, opt_ref, opt_evict, opt_save, opt_restore},
+	{"gds", gds_init, gds_ref, gds_evict, gds_save, gds_restore},
+	{"gdsf", gdsf_init, gds_ref, gds_evict, gds_save, gds_restore},
+	{"lecar", lecar_init, lecar_ref, lecar_evict, lecar_save, lecar_restore}
 };
-int num_algs = 5;
+int num_algs = 8;
 
 void (*init_fcn)() = NULL;
 void (*ref_fcn)(pgtbl_entry_t *) = NULL;
 int (*evict_fcn)() = NULL;
+void (*save_fcn)(FILE *) = NULL;
+void (*restore_fcn)(FILE *) = NULL;
+
+
+/* Loads a replacement algorithm built as a plugin (see sim.h) from the
+ * shared object at path, and returns its functions. Exits if the file
+ * cannot be loaded or was built against a different plugin ABI.
+ */
+struct functions *load_plugin(const char *path) {
+	char buf[MAXLINE];
+	void *handle;
+	struct sim_plugin *plugin;
+
+	// Without a slash dlopen would search the library path instead
+	if (strchr(path, '/') == NULL) {
+		snprintf(buf, MAXLINE, "./%s", path);
+		path = buf;
+	}
+	if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		fprintf(stderr, "Error: could not load plugin - %s\n", dlerror());
+		exit(1);
+	}
+	if ((plugin = dlsym(handle, "sim_plugin")) == NULL) {
+		fprintf(stderr, "Error: %s does not define sim_plugin\n", path);
+		exit(1);
+	}
+	if (plugin->abi_version != SIM_PLUGIN_ABI) {
+		fprintf(stderr, "Error: %s was built for plugin ABI %u, sim uses %u\n",
+			path, plugin->abi_version, SIM_PLUGIN_ABI);
+		exit(1);
+	}
+	return &plugin->fns;
+}
 
 
+/*
+ * Fills in page data for a store to the page at vaddr. Traces only give
+ * the page that was written, and one reference stands for a whole run of
+ * accesses to it (see traceprogs/fastslim.py), so each store fills in the
+ * next STORE_BYTES of the page after the ones the last store wrote,
+ * wrapping around once the page is full. Pages that are written often
+ * fill up with data, while the rest stay mostly zero.
+ *
+ * What a word holds depends on where it is in the page, much like the
+ * fields of a real data structure: half hold small counts, a quarter hold
+ * pointers into the same page, and the rest hold values with no pattern
+ * to them. Pages only have room for data beyond the version and vaddr
+ * once SIMPAGESIZE is larger than 16.
+ */
+#define STORE_BYTES 64
+
+static void store_data(char *memptr, addr_t vaddr, int version) {
+	unsigned lines = (SIMPAGESIZE - 16) / STORE_BYTES;
+	unsigned off, i;
+	uint64_t h, word;
+
+	if (lines == 0) {
+		return;
+	}
+	off = 16 + (version - 1) % lines * STORE_BYTES;
+
+	for (i = 0; i < STORE_BYTES; i += 8, off += 8) {
+		h = ((vaddr >> PAGE_SHIFT) * 4096 + off) * 0x9E3779B97F4A7C15ull;
+		switch (h >> 62) {
+		case 0:
+		case 1:
+			word = version;
+			break;
+		case 2:
+			word = vaddr + ((h >> 32) & (SIMPAGESIZE - 8));
+			break;
+		default:
+			word = h ^ ((uint64_t)version * 0xBF58476D1CE4E5B9ull);
+			break;
+		}
+		memcpy(memptr + off, &word, sizeof(word));
+	}
+}
+
 /* An actual memory access based on the vaddr from the trace file.
  *
  * The find_physpage() function is called to translate the virtual address
@@ -54,27 +191,68 @@ void access_mem(char type, addr_t vaddr) {
 	if (*checkaddr != vaddr) {
 		fprintf(stderr,"Error, simulated page returned by pagetable lookup doese not have expected value.\n");
 	}
+	if (verify) {
+		verify_data(vaddr, *versionptr, type);
+	}
 	
 	if (type == 'S' || type == 'M') {
 		// write access to page, increment version number
 		(*versionptr)++;
+		store_data(memptr, vaddr, *versionptr);
+	}
+
+	// Let the page-out daemon free frames ahead of the next faults. This
+	// runs once the access is done, as the frame it used may be picked.
+	if (reclaim_high > 0) {
+		reclaim();
 	}
 
 }
 
 
-void replay_trace(FILE *infp) {
+/* Replays the trace, skipping the first 'skip' references (which were
+ * already replayed when resuming from a checkpoint).
+ *
+ * Besides references, a trace may hold process events: "F pid" forks the
+ * current process into process pid, and "X pid" switches to process pid,
+ * whose references follow. Events are not references, so they are neither
+ * counted nor replayed while skipping; the checkpoint already holds the
+ * processes they created.
+ */
+void replay_trace(FILE *infp, int skip) {
 	char buf[MAXLINE];
 	addr_t vaddr = 0;
 	char type;
 
 	while(fgets(buf, MAXLINE, infp) != NULL) {
 		if(buf[0] != '=') {
+			if (buf[0] == 'F' || buf[0] == 'X') {
+				if (skip > 0) {
+					continue;
+				}
+				sscanf(buf, "%c %lu", &type, &vaddr);
+				if (type == 'F') {
+					proc_fork(vaddr);
+				} else {
+					proc_switch(vaddr);
+				}
+				continue;
+			}
+			if (skip > 0) {
+				skip--;
+				continue;
+			}
 			sscanf(buf, "%c %lx", &type, &vaddr);
 			if(debug)  {
 				printf("%c %lx\n", type, vaddr);
 			}
 			access_mem(type, vaddr);
+
+			if (ref_count == ckpt_index) {
+				if (checkpoint_save(ckpt_file, alg_name) != 0) {
+					exit(1);
+				}
+			}
 		} else {
 			continue;
 		}
@@ -88,9 +266,20 @@ int main(int argc, char *argv[]) {
 	unsigned swapsize = 4096;
 	FILE *tfp = stdin;
 	char *replacement_alg = NULL;
-	char *usage = "USAGE: sim -f tracefile -m memorysize -s swapsize -a algorithm\n";
+	struct functions *alg = NULL;
+	char *resume_file = NULL;
+	char *stats_file = NULL;
+	unsigned stats_interval = 10000;
+	unsigned nthreads = 0;
+	char *usage = "USAGE: sim -f tracefile -m memorysize -s swapsize "
+		"-a algorithm|plugin.so "
+		"[-c checkpointfile -n refindex] [-r checkpointfile] "
+		"[-o statsfile [-i interval]] [-L lowwatermark -H highwatermark] "
+		"[-z poolpercent] [-t fault,pagein,pageout,hit,minor] "
+		"[-N frames:cost[,frames:cost...] [-P fast|slow|interleave]] "
+		"[-T threads] [-V]\n";
 
-	while ((opt = getopt(argc, argv, "f:m:a:s:")) != -1) {
+	while ((opt = getopt(argc, argv, "f:m:a:s:c:n:r:o:i:L:H:z:t:N:P:T:V")) != -1) {
 		switch (opt) {
 		case 'f':
 			tracefile = optarg;
@@ -104,12 +293,80 @@ int main(int argc, char *argv[]) {
 		case 's':
 			swapsize = (unsigned)strtoul(optarg, NULL, 10);
 			break;
+		case 'c':
+			ckpt_file = optarg;
+			break;
+		case 'n':
+			ckpt_index = (int)strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			resume_file = optarg;
+			break;
+		case 'o':
+			stats_file = optarg;
+			break;
+		case 'i':
+			stats_interval = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 'L':
+			reclaim_low = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+			reclaim_high = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 'z':
+			zswap_percent = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			if (parse_latency(optarg) != 0) {
+				fprintf(stderr, "%s", usage);
+				exit(1);
+			}
+			break;
+		case 'N':
+			if (numa_parse(optarg) != 0) {
+				fprintf(stderr, "%s", usage);
+				exit(1);
+			}
+			break;
+		case 'P':
+			if (numa_set_placement(optarg) != 0) {
+				fprintf(stderr, "%s", usage);
+				exit(1);
+			}
+			break;
+		case 'T':
+			nthreads = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 'V':
+			verify = 1;
+			break;
 		default:
 			fprintf(stderr, "%s", usage);
 			exit(1);
 		}
 	}
-	if(tracefile != NULL) {
+	if ((ckpt_file == NULL) != (ckpt_index < 0) || stats_interval == 0) {
+		fprintf(stderr, "%s", usage);
+		exit(1);
+	}
+	// Concurrent replay has its own clock and does not support the
+	// features that keep single-threaded state as the trace is replayed
+	if (nthreads > 0
+	    && (replacement_alg == NULL || strcmp(replacement_alg, "clock") != 0
+		|| ckpt_file != NULL || resume_file != NULL || stats_file != NULL
+		|| reclaim_high > 0 || zswap_percent > 0 || numa_tiers > 0
+		|| tracefile == NULL)) {
+		fprintf(stderr, "Error: -T needs -a clock and a tracefile, and "
+			"cannot be used with -c, -r, -o, -H, -z or -N\n");
+		exit(1);
+	}
+	// The reference algorithms and page versions start with the trace
+	if (verify && (resume_file != NULL || nthreads > 0)) {
+		fprintf(stderr, "Error: -V cannot be used with -r or -T\n");
+		exit(1);
+	}
+	if(tracefile != NULL && nthreads == 0) {
 		if((tfp = fopen(tracefile, "r")) == NULL) {
 			perror("Error opening tracefile:");
 			exit(1);
@@ -119,35 +376,98 @@ int main(int argc, char *argv[]) {
 	// Initialize main data structures for simulation.
 	// This happens before calling the replacement algorithm init function
 	// so that the init_fcn can refer to the coremap if needed.
-	coremap = calloc(memsize, sizeof(struct frame));
+	coremap.flags = calloc(memsize, sizeof(unsigned char));
+	coremap.in_use = calloc(memsize, sizeof(char));
+	coremap.pte = calloc(memsize, sizeof(pgtbl_entry_t *));
+	coremap.vaddr = calloc(memsize, sizeof(addr_t));
+	coremap.mappers = calloc(memsize, sizeof(uint64_t));
+	if (!coremap.flags || !coremap.in_use || !coremap.pte || !coremap.vaddr
+	    || !coremap.mappers) {
+		perror("Failed to allocate coremap");
+		exit(1);
+	}
 	physmem = malloc(memsize * SIMPAGESIZE);
 	swap_init(swapsize);
+	if (numa_tiers > 0) {
+		numa_init();
+	}
 	init_pagetable();
+	if (zswap_percent > 0) {
+		zswap_init();
+	}
 
 	// Initialize replacement algorithm functions.
 	if(replacement_alg == NULL) {
 		fprintf(stderr, "%s", usage);
 		exit(1);
 	} else {
+		size_t len = strlen(replacement_alg);
 		int i;
-		for (i = 0; i < num_algs; i++) {
+		if (len > 3 && strcmp(replacement_alg + len - 3, ".so") == 0) {
+			alg = load_plugin(replacement_alg);
+		}
+		for (i = 0; alg == NULL && i < num_algs; i++) {
 			if(strcmp(algs[i].name, replacement_alg) == 0) {
-				init_fcn = algs[i].init;
-				ref_fcn = algs[i].ref;
-				evict_fcn = algs[i].evict;
-				break;
+				alg = &algs[i];
 			}
 		}
-		if(evict_fcn == NULL) {
+		if(alg == NULL) {
 			fprintf(stderr, "Error: invalid replacement algorithm - %s\n", 
 					replacement_alg);
 			exit(1);
 		}
+		init_fcn = alg->init;
+		ref_fcn = alg->ref;
+		evict_fcn = alg->evict;
+		save_fcn = alg->save;
+		restore_fcn = alg->restore;
+		alg_name = alg->name;
 	}
 	// Call replacement algorithm's init_fcn before replaying trace.
 	init_fcn();
+	// The reference algorithms only see frames freed by evictions, so
+	// with the page-out daemon only page contents are checked
+	if (verify && reclaim_high == 0 && verify_init(alg_name) != 0) {
+		fprintf(stderr, "Error: -V has no reference version of %s "
+			"(lru, fifo, clock, or opt with -f)\n", alg_name);
+		exit(1);
+	}
+	if (reclaim_high > 0) {
+		reclaim_init();
+	}
+
+	// Pick up the state of an earlier run, then skip over the part of the
+	// trace that run had already replayed.
+	if (resume_file != NULL) {
+		if (checkpoint_restore(resume_file, alg_name) != 0) {
+			exit(1);
+		}
+	}
 
-	replay_trace(tfp);
+	if (stats_file != NULL) {
+		if (stats_init(stats_file, stats_interval) != 0) {
+			exit(1);
+		}
+	}
+
+#ifdef COUNT_ALLOCS
+	unsigned long init_allocs = alloc_count;
+	unsigned init_pgtbls = pgtbl_count;
+#endif
+
+	if (nthreads > 0) {
+		concurrent_replay(tracefile, nthreads);
+	} else {
+		replay_trace(tfp, ref_count);
+	}
+	stats_finish();
+
+#ifdef COUNT_ALLOCS
+	// Second-level page tables are the only thing allowed to be allocated
+	// during the replay: there are at most PTRS_PER_PGDIR of them.
+	fprintf(stderr, "Allocations after init: %lu (page tables: %u)\n",
+		alloc_count - init_allocs, pgtbl_count - init_pgtbls);
+#endif
 	print_pagedirectory();
 
 	// Cleanup - removes temporary swapfile.
@@ -158,9 +478,54 @@ int main(int argc, char *argv[]) {
 	printf("Miss count: %d\n", miss_count);
 	printf("Clean evictions: %d\n",evict_clean_count);
 	printf("Dirty evictions: %d\n",evict_dirty_count); 
+	printf("Swap writes: %d (%d sequential)\n", swap_writes, swap_seq_writes);
+	if (zswap_percent > 0) {
+		printf("Compressed pool: %d pages stored, %d rejected, ratio %.2f\n",
+		       zswap_stores, zswap_rejects,
+		       zswap_comp_bytes ? (double)zswap_raw_bytes/zswap_comp_bytes : 0.0);
+		printf("Pool hits: %d of %d page-ins (%.2f%%), %d written back to swap\n",
+		       zswap_loads, zswap_loads + swap_pageins,
+		       zswap_loads + swap_pageins ?
+		       100.0*zswap_loads/(zswap_loads + swap_pageins) : 0.0,
+		       zswap_writebacks);
+		printf("Swap I/O avoided: %d page writes, %d page reads\n",
+		       zswap_stores - zswap_writebacks, zswap_loads);
+	}
+	printf("Swap I/O: %d reads of %.1f bytes, %d writes of %.1f bytes, "
+	       "%d page-ins from cache\n",
+	       swap_read_ops, swap_read_ops ? (double)swap_read_bytes/swap_read_ops : 0.0,
+	       swap_write_ops, swap_write_ops ? (double)swap_write_bytes/swap_write_ops : 0.0,
+	       swap_cache_hits);
+	if (reclaim_high > 0) {
+		printf("Reclaim batches: %d (%d pages)\n", reclaim_batches, reclaim_pages);
+		printf("Faults with a free frame: %d of %d\n", free_frame_faults, miss_count);
+	}
+	if (fork_count > 0) {
+		printf("Forks: %d, COW faults: %d (%.4f%% of references), "
+		       "shared swap-ins: %d\n", fork_count, cow_faults,
+		       (double)cow_faults/ref_count * 100, shared_swapins);
+		printf("Frames saved by sharing: %u at exit, %u at peak\n",
+		       frames_shared, frames_shared_peak);
+	}
+	if (numa_tiers > 0) {
+		numa_report();
+	}
+	if (verify && reclaim_high > 0) {
+		printf("Verified: page contents of %d references\n", ref_count);
+	} else if (verify) {
+		printf("Verified: %d evictions match the reference %s\n",
+		       verify_count, alg_name);
+	}
 	printf("Total references : %d\n", ref_count);
 	printf("Hit rate: %.4f\n", (double)hit_count/ref_count * 100);
 	printf("Miss rate: %.4f\n", (double)miss_count/ref_count *100);
+	printf("Estimated paging time: %.3f ms (fault %g us, page-in %g us, "
+	       "page-out %g us)\n", paging_time() / 1000, latency.fault,
+	       latency.pagein, latency.pageout);
+	printf("Estimated run time: %.3f ms, AMAT %.4f us (hit %g us, "
+	       "minor fault %g us, %d minor faults)\n", run_time() / 1000,
+	       ref_count ? run_time() / ref_count : 0.0, latency.hit,
+	       latency.minor, minor_faults);
 		
 	return(0);
 }
@@ -3,7 +3,17 @@
 
 #include "pagetable.h"
 #define MAXLINE 256
-#define SIMPAGESIZE 16  /* Simulated physical memory page frame size */
+/* Simulated physical memory page frame size. Pages hold a version count
+ * and their vaddr in the first 16 bytes, and the data written by stores in
+ * the rest, so build with a larger size (e.g. make SIMPAGESIZE=4096) for
+ * page contents that are worth compressing.
+ */
+#ifndef SIMPAGESIZE
+#define SIMPAGESIZE 16
+#endif
+#if SIMPAGESIZE < 16 || SIMPAGESIZE > 4096
+#error "SIMPAGESIZE must be between 16 and 4096"
+#endif
 
 extern unsigned memsize;
 extern int debug;
@@ -13,6 +23,47 @@ extern int miss_count;
 extern int ref_count;
 extern int evict_clean_count;
 extern int evict_dirty_count;
+extern unsigned frames_in_use;
+extern int free_frame_faults;
+extern int minor_faults;
+extern unsigned swap_used;
+extern int swap_writes;
+extern int swap_seq_writes;
+extern int swap_read_ops;
+extern int swap_write_ops;
+extern long swap_read_bytes;
+extern long swap_write_bytes;
+extern int swap_cache_hits;
+extern int swap_pageins;
+extern unsigned zswap_percent;
+extern int zswap_stores;
+extern int zswap_rejects;
+extern int zswap_loads;
+extern int zswap_writebacks;
+extern long zswap_raw_bytes;
+extern long zswap_comp_bytes;
+extern unsigned pgtbl_count;
+
+/* Latency model, in microseconds, set with -t. The time spent paging is
+ * estimated from the event counters as a fault cost for every miss, a
+ * page-in for every page read from swap (not from a cache), a page-out for
+ * every page written, and a minor fault cost for every page that is
+ * zero-filled on first use or copied on write. Adding the hit cost of
+ * every reference (the cost of its tier, with -N, plus a minor fault cost
+ * for every page migrated between tiers) gives the run time, and dividing
+ * that by the number of references the average memory access time (AMAT).
+ * Cost-aware replacement algorithms weigh victims with the same costs.
+ */
+struct latency {
+	double fault;   // Trap and fault handling, paid on every miss
+	double pagein;  // Reading a page from swap
+	double pageout; // Writing a page to swap
+	double hit;     // A reference to a page in memory
+	double minor;   // Zero-filling or copying a page
+};
+extern struct latency latency;
+extern double paging_time(void);
+extern double run_time(void);
 
 /* We simulate physical memory with a large array of bytes */
 extern char *physmem;
@@ -24,16 +75,146 @@ extern char *physmem;
 extern char *tracefile;
 
 // Each eviction algorithm is represented by a structure with its name
-// and three functions.
+// and five functions.
 struct functions {
 	char *name;                  // String name of eviction algorithm
 	void (*init)(void);          // Initialize any data needed by alg
 	void (*ref)(pgtbl_entry_t *);    // Called on each reference
 	int (*evict)();              // Called to choose victim for eviction
+	void (*save)(FILE *);        // Write alg state to a checkpoint
+	void (*restore)(FILE *);     // Read alg state back from a checkpoint
 };
 
+/* Replacement algorithms can also be built as plugins: shared objects that
+ * sim loads at run time with "sim -a path/to/policy.so". A plugin defines
+ * a struct sim_plugin named sim_plugin (SIM_DEFINE_PLUGIN does this), and
+ * is loaded only if its abi_version matches SIM_PLUGIN_ABI, which changes
+ * whenever struct functions or anything else a plugin can see changes.
+ *
+ * Plugins are linked against the sim executable itself, so they have the
+ * same access as built-in algorithms to the coremap, memsize, tracefile,
+ * the pagetable entries and PG_* flags, and the pool and checkpoint
+ * helpers declared in this file. sim calls them through the same function
+ * pointers as a built-in algorithm.
+ */
+#define SIM_PLUGIN_ABI 3
+
+struct sim_plugin {
+	unsigned abi_version;
+	struct functions fns;
+};
+
+/* Each algorithm ends with SIM_DEFINE_PLUGIN(name, prefix), naming its
+ * functions prefix_init, prefix_ref and so on. This only has an effect
+ * when the file is compiled as a plugin, with -DSIM_PLUGIN.
+ */
+#ifdef SIM_PLUGIN
+#define SIM_DEFINE_PLUGIN(name, prefix)                               \
+	__attribute__((visibility("default")))                        \
+	struct sim_plugin sim_plugin = { SIM_PLUGIN_ABI,              \
+		{ name, prefix##_init, prefix##_ref, prefix##_evict,  \
+		  prefix##_save, prefix##_restore } };
+#else
+#define SIM_DEFINE_PLUGIN(name, prefix)
+#endif
+
 extern void (*init_fcn)();
 extern void (*ref_fcn)(pgtbl_entry_t *);
 extern int (*evict_fcn)();
+extern void (*save_fcn)(FILE *);
+extern void (*restore_fcn)(FILE *);
+
+/* Checkpoints hold the full simulator state (page directory, coremap,
+ * physmem, swap and counters, plus the algorithm's own state) at some
+ * reference index, so a long trace can be resumed from that point.
+ */
+extern int checkpoint_save(const char *path, const char *alg);
+extern int checkpoint_restore(const char *path, const char *alg);
+
+/* The page-out daemon. When reclaim_high is non-zero, reclaim runs after
+ * every reference and, once fewer than reclaim_low frames are free, evicts
+ * pages in one batch until reclaim_high frames are free. Dirty pages in a
+ * batch are written to swap together, after the clean ones are dropped.
+ */
+extern unsigned reclaim_low;
+extern unsigned reclaim_high;
+extern int reclaim_batches;
+extern int reclaim_pages;
+extern void reclaim_init(void);
+extern void reclaim(void);
+
+/* Fixed-capacity object pools. Replacement algorithms create these in
+ * their init function, sized from memsize, and take their per-frame
+ * bookkeeping from them so that replaying the trace makes no heap
+ * allocations.
+ */
+struct pool;
+extern struct pool *pool_create(size_t objsize, unsigned count);
+extern void *pool_alloc(struct pool *pool);
+extern void pool_free(struct pool *pool, void *obj);
+extern void pool_destroy(struct pool *pool);
+
+#ifdef COUNT_ALLOCS
+// Heap allocations made so far (see allocs.c)
+extern unsigned long alloc_count;
+#endif
+
+/* Interval statistics are written as one CSV row every stats_interval
+ * references. find_physpage only compares ref_count against stats_next;
+ * all the per-interval arithmetic happens in stats_flush.
+ */
+extern int stats_next;
+extern int stats_init(const char *path, unsigned interval);
+extern void stats_flush(void);
+extern void stats_finish(void);
+
+/* Tiered memory (see numa.c). numa_tiers is 0 unless -N splits memory
+ * into tiers with their own reference costs, in which case numa_init
+ * labels the frames before init_pagetable, and pagetable.c takes free
+ * frames from the tiers and reports every reference to numa_ref.
+ */
+#define NUMA_MAXTIERS 8
+#define NUMA_PLACE_FAST       0 // Faults fill the fastest tier with room
+#define NUMA_PLACE_SLOW       1 // ...the slowest, leaving promotion to sort
+#define NUMA_PLACE_INTERLEAVE 2 // ...each tier with room in turn
+extern unsigned numa_tiers;
+extern int numa_placement;
+extern int numa_migrations;
+extern int numa_parse(const char *spec);
+extern int numa_set_placement(const char *name);
+extern void numa_init(void);
+extern void numa_free_init(void);
+extern void numa_put_free(int frame);
+extern int numa_take_free(void);
+extern void numa_ref(int frame);
+extern double numa_access_time(void);
+extern void numa_report(void);
+extern void numa_save(FILE *fp);
+extern void numa_restore(FILE *fp);
+extern void numa_free_save(FILE *fp);
+extern void numa_free_restore(FILE *fp);
+
+/* Reference replacement algorithms (see verify.c). With -V, pagetable.c
+ * reports every reference to verify_ref and every victim the real
+ * algorithm picks to verify_evict, which exits if the reference version
+ * of the algorithm would have picked another. Page contents are checked
+ * as well (verify_data, in pagetable.h), and are all that is checked with
+ * -H, as the page-out daemon frees frames the reference algorithms are not
+ * told about.
+ */
+extern int verify;
+extern int verify_count;
+extern int verify_init(const char *alg);
+extern void verify_ref(int frame);
+extern void verify_evict(int frame);
+
+/* Replays tracefile with n threads sharing one address space, under a
+ * concurrent page table and clock (see concurrent.c).
+ */
+extern void concurrent_replay(const char *tracefile, unsigned n);
+
+// Read or write raw bytes of a checkpoint, exiting on a short read/write.
+extern void ckpt_write(FILE *fp, const void *buf, size_t len);
+extern void ckpt_read(FILE *fp, void *buf, size_t len);
 
 #endif // __SIM_H 
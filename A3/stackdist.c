@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "stackdist.h"
+
+/* Returns the bucket of stack distance d. */
+int bucket(uint64_t d) {
+	int k;
+
+	if (d < EXACT_BUCKETS) {
+		return d;
+	}
+	k = 63 - __builtin_clzll(d);
+	return EXACT_BUCKETS + (k - 5) * 8 + ((d >> (k - 3)) & 7);
+}
+
+/* Returns the smallest stack distance in bucket b, and in *width how many
+ * distances it covers.
+ */
+uint64_t bucket_low(int b, uint64_t *width) {
+	int k, sub;
+
+	if (b < EXACT_BUCKETS) {
+		*width = 1;
+		return b;
+	}
+	k = (b - EXACT_BUCKETS) / 8 + 5;
+	sub = (b - EXACT_BUCKETS) % 8;
+	*width = (uint64_t)1 << (k - 3);
+	return (uint64_t)(8 + sub) << (k - 3);
+}
+
+void *xcalloc(size_t n, size_t size) {
+	void *p = calloc(n, size);
+	if (p == NULL) {
+		perror("out of memory");
+		exit(1);
+	}
+	return p;
+}
+
+void lru_init(struct lru *s) {
+	memset(s, 0, sizeof(*s));
+	s->hash_mask = (1 << 16) - 1;
+	s->keys = xcalloc(s->hash_mask + 1, sizeof(uint64_t));
+	s->when = xcalloc(s->hash_mask + 1, sizeof(uint64_t));
+	s->count = xcalloc(s->hash_mask + 1, sizeof(uint64_t));
+	s->cap = 1 << 16;
+	s->tree = xcalloc(s->cap + 1, sizeof(uint64_t));
+	s->owner = xcalloc(s->cap, sizeof(uint64_t));
+	s->stamp = xcalloc(s->cap, sizeof(uint64_t));
+}
+
+void lru_free(struct lru *s) {
+	free(s->keys);
+	free(s->when);
+	free(s->count);
+	free(s->tree);
+	free(s->owner);
+	free(s->stamp);
+}
+
+static void tree_add(struct lru *s, uint64_t t, int64_t v) {
+	for (t++; t <= s->cap; t += t & -t) {
+		s->tree[t] += v;
+	}
+}
+
+/* Number of marked times up to and including t. */
+static uint64_t tree_sum(struct lru *s, uint64_t t) {
+	uint64_t sum = 0;
+
+	for (t++; t > 0; t -= t & -t) {
+		sum += s->tree[t];
+	}
+	return sum;
+}
+
+/* The kth marked time (k counts from 1). */
+static uint64_t tree_find(struct lru *s, uint64_t k) {
+	uint64_t pos = 0, step;
+
+	for (step = (uint64_t)1 << (63 - __builtin_clzll(s->cap)); step; step >>= 1) {
+		if (pos + step <= s->cap && s->tree[pos + step] < k) {
+			pos += step;
+			k -= s->tree[pos];
+		}
+	}
+	return pos;
+}
+
+static uint64_t hash_home(struct lru *s, uint64_t key) {
+	return ((key * 0x9e3779b97f4a7c15ULL) >> 20) & s->hash_mask;
+}
+
+static uint64_t hash_slot(struct lru *s, uint64_t page) {
+	uint64_t i = hash_home(s, page + 1);
+
+	while (s->keys[i] != 0 && s->keys[i] != page + 1) {
+		i = (i + 1) & s->hash_mask;
+	}
+	return i;
+}
+
+/* Renumbers the last reference times in order from 0, growing the tree
+ * if more than half of it would be in use.
+ */
+static void lru_compact(struct lru *s) {
+	uint64_t *owner = s->owner, *stamp = s->stamp;
+	uint64_t t, next = 0, old_cap = s->cap;
+
+	if (s->npages * 2 > s->cap) {
+		s->cap *= 2;
+	}
+	s->owner = xcalloc(s->cap, sizeof(uint64_t));
+	s->stamp = xcalloc(s->cap, sizeof(uint64_t));
+	free(s->tree);
+	s->tree = xcalloc(s->cap + 1, sizeof(uint64_t));
+	for (t = 0; t < old_cap; t++) {
+		uint64_t i = owner[t];
+		if (s->keys[i] != 0 && s->when[i] == t) {
+			s->when[i] = next;
+			s->owner[next] = i;
+			s->stamp[next] = stamp[t];
+			tree_add(s, next, 1);
+			next++;
+		}
+	}
+	free(owner);
+	free(stamp);
+	s->now = next;
+}
+
+/* Doubles the hash table, which is then rebuilt, with the times. */
+static void lru_rehash(struct lru *s) {
+	uint64_t *keys = s->keys, *when = s->when, *count = s->count;
+	uint64_t i, n = s->hash_mask + 1;
+
+	s->hash_mask = 2 * n - 1;
+	s->keys = xcalloc(2 * n, sizeof(uint64_t));
+	s->when = xcalloc(2 * n, sizeof(uint64_t));
+	s->count = xcalloc(2 * n, sizeof(uint64_t));
+	for (i = 0; i < n; i++) {
+		if (keys[i] != 0) {
+			uint64_t j = hash_slot(s, keys[i] - 1);
+			s->keys[j] = keys[i];
+			s->when[j] = when[i];
+			s->count[j] = count[i];
+			s->owner[when[i]] = j;
+		}
+	}
+	free(keys);
+	free(when);
+	free(count);
+}
+
+/* Returns 1 if page is on the stack. */
+int lru_contains(struct lru *s, uint64_t page) {
+	return s->keys[hash_slot(s, page)] != 0;
+}
+
+/*
+ * References page at the caller's clock (which must not go backwards),
+ * making it the most recent. Returns its stack distance before the
+ * reference, or UINT64_MAX if it was not on the stack. If since is not
+ * NULL, it is set to the clock ticks since the page's last reference
+ * (UINT64_MAX if none).
+ */
+uint64_t lru_ref(struct lru *s, uint64_t page, uint64_t clock, uint64_t *since) {
+	uint64_t i, d = UINT64_MAX, gap = UINT64_MAX;
+
+	if (s->now == s->cap) {
+		lru_compact(s);
+	}
+	i = hash_slot(s, page);
+	if (s->keys[i] != 0) {
+		d = s->npages - tree_sum(s, s->when[i]);
+		gap = clock - s->stamp[s->when[i]];
+		tree_add(s, s->when[i], -1);
+	} else {
+		if (2 * (s->npages + 1) > s->hash_mask + 1) {
+			lru_rehash(s);
+			i = hash_slot(s, page);
+		}
+		s->keys[i] = page + 1;
+		s->count[i] = 0;
+		s->npages++;
+	}
+	s->when[i] = s->now;
+	s->count[i]++;
+	s->owner[s->now] = i;
+	s->stamp[s->now] = clock;
+	tree_add(s, s->now, 1);
+	s->now++;
+	if (since != NULL) {
+		*since = gap;
+	}
+	return d;
+}
+
+/* Returns the page at stack distance d, which must be less than npages. */
+uint64_t lru_at(struct lru *s, uint64_t d) {
+	uint64_t t = tree_find(s, s->npages - d);
+	return s->keys[s->owner[t]] - 1;
+}
+
+/* Takes page off the stack, if it is on it. */
+void lru_remove(struct lru *s, uint64_t page) {
+	uint64_t i = hash_slot(s, page), j, home;
+
+	if (s->keys[i] == 0) {
+		return;
+	}
+	tree_add(s, s->when[i], -1);
+	s->npages--;
+	// Shift back the entries after it that would no longer be found
+	// (deletion from a linear probing table without tombstones)
+	for (j = (i + 1) & s->hash_mask; s->keys[j] != 0; j = (j + 1) & s->hash_mask) {
+		home = hash_home(s, s->keys[j]);
+		if (((j - home) & s->hash_mask) >= ((j - i) & s->hash_mask)) {
+			s->keys[i] = s->keys[j];
+			s->when[i] = s->when[j];
+			s->count[i] = s->count[j];
+			s->owner[s->when[i]] = i;
+			i = j;
+		}
+	}
+	s->keys[i] = 0;
+}
+
+/* Returns how many pages on the stack were last referenced at or after
+ * the given clock.
+ */
+uint64_t lru_active_since(struct lru *s, uint64_t clock) {
+	uint64_t lo = 0, hi = s->now;
+
+	// Stamps never decrease with time, even those of times no longer in
+	// use, so the first time at or after clock is found by bisection
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (s->stamp[mid] < clock) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo == 0 ? s->npages : s->npages - tree_sum(s, lo - 1);
+}
@@ -0,0 +1,51 @@
+#ifndef __STACKDIST_H__
+#define __STACKDIST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * LRU stack distances, shared by the trace tools (tracegen, traceprof).
+ * They stand alone from sim.
+ */
+
+/* Distances are bucketed exactly up to EXACT_BUCKETS, and in eighths of a
+ * power of two above that.
+ */
+#define EXACT_BUCKETS 32
+#define NBUCKETS      (EXACT_BUCKETS + 8 * 40)
+
+int bucket(uint64_t d);
+uint64_t bucket_low(int b, uint64_t *width);
+
+/*
+ * LRU stack. Every page has the time of its last reference, and a Fenwick
+ * tree over times marks the times that are some page's last reference, so
+ * the stack distance of a page, and the page at a given depth, are found
+ * in O(log n). Times are renumbered from 0 when they run out. Each time
+ * also keeps the caller's clock (stamp), which is never renumbered.
+ */
+struct lru {
+	uint64_t *keys;      // Hash table of pages (page + 1, 0 if empty)...
+	uint64_t *when;      // ...the time of each one's last reference...
+	uint64_t *count;     // ...and how many references it has had
+	uint64_t hash_mask;
+	uint64_t npages;
+	uint64_t *tree;      // Fenwick tree over times
+	uint64_t *owner;     // Hash slot of the page referenced at each time
+	uint64_t *stamp;     // Caller's clock at each time
+	uint64_t cap;        // Number of times
+	uint64_t now;
+};
+
+void *xcalloc(size_t n, size_t size);
+
+void lru_init(struct lru *s);
+void lru_free(struct lru *s);
+int lru_contains(struct lru *s, uint64_t page);
+uint64_t lru_ref(struct lru *s, uint64_t page, uint64_t clock, uint64_t *since);
+uint64_t lru_at(struct lru *s, uint64_t d);
+void lru_remove(struct lru *s, uint64_t page);
+uint64_t lru_active_since(struct lru *s, uint64_t clock);
+
+#endif
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim.h"
+#include "pagetable.h"
+
+// Reference index at which the next row is written. Stays at -1 (which
+// ref_count never equals) when interval statistics are turned off.
+int stats_next = -1;
+
+static FILE *stats_fp = NULL;
+static unsigned stats_interval;
+
+// Cumulative counters as of the last row written
+static int last_ref;
+static int last_hit;
+static int last_miss;
+static int last_clean;
+static int last_dirty;
+static double last_time;
+
+/*
+ * Opens the CSV file that interval statistics are written to, and starts
+ * the first interval at the current reference (which is not 0 when
+ * resuming from a checkpoint).
+ *
+ * Returns 0 on success, -1 if the file could not be opened.
+ */
+int stats_init(const char *path, unsigned interval) {
+	if ((stats_fp = fopen(path, "w")) == NULL) {
+		perror("Error opening statistics file");
+		return -1;
+	}
+	stats_interval = interval;
+
+	fprintf(stats_fp, "refs,hits,misses,miss_rate,clean_evictions,"
+		"dirty_evictions,dirty_evict_rate,resident,swap_used,"
+		"time_ms,amat_us\n");
+
+	last_ref = ref_count;
+	last_hit = hit_count;
+	last_miss = miss_count;
+	last_clean = evict_clean_count;
+	last_dirty = evict_dirty_count;
+	last_time = run_time();
+	stats_next = ref_count + stats_interval;
+	return 0;
+}
+
+/*
+ * Writes one row covering the references since the last row. The rates are
+ * for this interval only, while resident and swap_used are snapshots of the
+ * frames and swap slots in use at the end of it. time_ms and amat_us are
+ * the estimated run time of the interval and its average memory access
+ * time (see struct latency).
+ */
+void stats_flush() {
+	int refs = ref_count - last_ref;
+	int misses = miss_count - last_miss;
+	int clean = evict_clean_count - last_clean;
+	int dirty = evict_dirty_count - last_dirty;
+	double time = run_time() - last_time;
+
+	if (refs > 0) {
+		fprintf(stats_fp, "%d,%d,%d,%.4f,%d,%d,%.4f,%u,%u,%.3f,%.4f\n",
+			ref_count, hit_count - last_hit, misses, (double)misses/refs,
+			clean, dirty, clean + dirty ? (double)dirty/(clean + dirty) : 0.0,
+			frames_in_use, swap_used, time / 1000, time / refs);
+	}
+
+	last_ref = ref_count;
+	last_hit = hit_count;
+	last_miss = miss_count;
+	last_clean = evict_clean_count;
+	last_dirty = evict_dirty_count;
+	last_time += time;
+	stats_next = ref_count + stats_interval;
+}
+
+/* Writes the final (possibly partial) interval and closes the file. */
+void stats_finish() {
+	if (stats_fp == NULL) {
+		return;
+	}
+	stats_flush();
+	fclose(stats_fp);
+	stats_fp = NULL;
+	stats_next = -1;
+}
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include "pagetable.h"
 #include "sim.h"
 
@@ -86,6 +87,51 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return 1;
 }
 
+/*
+ * Finds n consecutive free bits, marks them, and returns the first one in
+ * *index. The search starts at bit 'start' and wraps around to the start
+ * of the bitmap; full words are skipped a word at a time. Returns 1 if
+ * there is no run of that length.
+ */
+int
+bitmap_alloc_run(struct bitmap *b, unsigned n, unsigned start, unsigned *index)
+{
+        unsigned bit = start < b->nbits ? start : 0;
+        unsigned end = b->nbits;
+        unsigned run = 0;
+        int wrapped = (bit == 0);
+        unsigned i;
+
+        while (1) {
+                if (bit >= end) {
+                        // Runs do not wrap: search up to start from scratch
+                        if (wrapped) {
+                                return 1;
+                        }
+                        wrapped = 1;
+                        end = start + n - 1 < b->nbits ? start + n - 1 : b->nbits;
+                        bit = 0;
+                        run = 0;
+                        continue;
+                }
+                if (run == 0 && bit % BITS_PER_WORD == 0
+                    && b->v[bit / BITS_PER_WORD] == WORD_ALLBITS) {
+                        bit += BITS_PER_WORD;
+                        continue;
+                }
+                if (b->v[bit / BITS_PER_WORD] & ((unsigned)1 << (bit % BITS_PER_WORD))) {
+                        run = 0;
+                } else if (++run == n) {
+                        *index = bit + 1 - n;
+                        for (i = *index; i <= bit; i++) {
+                                b->v[i / BITS_PER_WORD] |= (unsigned)1 << (i % BITS_PER_WORD);
+                        }
+                        return 0;
+                }
+                bit++;
+        }
+}
+
 static
 inline
 void
@@ -143,11 +189,93 @@ bitmap_destroy(struct bitmap *b)
 
 //---------------------------------------------------------------------
 // Swap definitions and functions.
+//
+// Dirty pages are not written to the swapfile one at a time. Each one is
+// copied into the open cluster: a run of SWAP_CLUSTER contiguous swap
+// slots, reserved up front, whose pages are written with a single pwrite
+// once the run is full. Pages are given a new slot in the open cluster
+// each time they are written out, so the pages evicted together end up
+// next to each other in the swapfile.
+//
+// Page-in reads up to SWAP_READAROUND slots at once: the slot asked for,
+// and the slots around it that hold the neighbouring virtual pages. The
+// extra pages are kept in the read-around cache, so a fault on one of them
+// does not need another read.
+//
+// Build with -DSWAP_CLUSTER=1 -DSWAP_READAROUND=1 to go back to reading and
+// writing a single page per system call.
+
+#ifndef SWAP_CLUSTER
+#define SWAP_CLUSTER    16
+#endif
+#ifndef SWAP_READAROUND
+#define SWAP_READAROUND 8
+#endif
 
 static int swapfd;
 static struct bitmap *swapmap;
 static char *fname;
 
+// Virtual address of the page in each allocated swap slot, used to find
+// the slots that hold neighbouring pages.
+static addr_t *slot_vaddr;
+
+// Number of pagetable entries that refer to each slot. This is only ever
+// more than 1 for the pages of a process that were shared by a fork.
+static unsigned short *slot_refs;
+
+// Swap cache: the frame a slot was last read into, and the slot each frame
+// holds a clean copy of (-1 if none), so that the other processes sharing
+// a slot can map the same frame instead of reading it again.
+static int *slot_frame;
+static int *frame_slot;
+
+// The open cluster: slots [clus_base, clus_base + clus_len) are reserved,
+// and the first clus_next of them hold pages waiting in clus_buf.
+static unsigned clus_base;
+static unsigned clus_len;
+static unsigned clus_next;
+static char clus_buf[SWAP_CLUSTER * SIMPAGESIZE];
+
+// Read-around cache: copies of slots [ra_base, ra_base + ra_len)
+static unsigned ra_base;
+static unsigned ra_len;
+static char ra_buf[SWAP_READAROUND * SIMPAGESIZE];
+
+// Number of swap slots currently allocated
+unsigned swap_used = 0;
+
+// Number of pages written to swap, and how many of those were written
+// just after the page before them in the swapfile
+int swap_writes = 0;
+int swap_seq_writes = 0;
+static off_t last_write_end = -1;
+
+// System calls made to read or write the swapfile, the bytes they moved,
+// and the page-ins that were served without one
+int swap_read_ops = 0;
+int swap_write_ops = 0;
+long swap_read_bytes = 0;
+long swap_write_bytes = 0;
+int swap_cache_hits = 0;
+
+// Pages read back from swap, whether or not that took a system call
+int swap_pageins = 0;
+
+#define SLOT_VPN(slot)  (slot_vaddr[slot] >> PAGE_SHIFT)
+
+static int in_cluster(unsigned slot) {
+	return slot >= clus_base && slot < clus_base + clus_next;
+}
+
+static int in_reserved(unsigned slot) {
+	return slot >= clus_base && slot < clus_base + clus_len;
+}
+
+static int in_readaround(unsigned slot) {
+	return slot >= ra_base && slot < ra_base + ra_len;
+}
+
 int swap_init(unsigned swapsize) {
 
 	// Initialize the swap file
@@ -159,27 +287,138 @@ int swap_init(unsigned swapsize) {
 	}
 
 	// Initialize the bitmap
-	if ((swapmap = bitmap_create(swapsize)) == NULL) {
+	if ((swapmap = bitmap_create(swapsize)) == NULL
+	    || (slot_vaddr = calloc(swapsize, sizeof(addr_t))) == NULL
+	    || (slot_refs = calloc(swapsize, sizeof(unsigned short))) == NULL
+	    || (slot_frame = malloc(swapsize * sizeof(int))) == NULL
+	    || (frame_slot = malloc(memsize * sizeof(int))) == NULL) {
 		fprintf(stderr,"Failed to create bitmap for swap\n");
 		exit(1);
 	}
+	memset(slot_frame, -1, swapsize * sizeof(int));
+	memset(frame_slot, -1, memsize * sizeof(int));
 
+	clus_base = clus_len = clus_next = 0;
+	ra_base = ra_len = 0;
 	return 0;
 }
 
+/*
+ * Writes the pages in the open cluster to the swapfile with one system
+ * call, and gives back any slots that are not used (reserved slots are
+ * only left over at exit, since clusters are otherwise written once they
+ * are full).
+ */
+static void swap_flush_cluster() {
+	size_t len = clus_next * SIMPAGESIZE;
+	off_t pos = (off_t)clus_base * SIMPAGESIZE;
+	unsigned i;
+
+	if (clus_next > 0) {
+		if (pwrite(swapfd, clus_buf, len, pos) != (ssize_t)len) {
+			perror("swap_pageout: failed to write swap cluster");
+			exit(1);
+		}
+		swap_write_ops++;
+		swap_write_bytes += len;
+		swap_writes += clus_next;
+		swap_seq_writes += clus_next - (pos != last_write_end);
+		last_write_end = pos + len;
+	}
+
+	// Pages released while they waited in the cluster are written
+	// anyway, but their slots are freed now
+	for (i = 0; i < clus_len; i++) {
+		if (i >= clus_next || slot_refs[clus_base + i] == 0) {
+			bitmap_unmark(swapmap, clus_base + i);
+		}
+	}
+
+	// Leave clus_base just past this cluster, where the next one starts
+	// looking for free slots
+	clus_base += clus_len;
+	clus_len = clus_next = 0;
+}
+
+/*
+ * Reserves the slots for a new cluster. Takes the next run of SWAP_CLUSTER
+ * free slots after the last cluster, so the whole swapfile is swept before
+ * slots near the start are reused and freed slots have time to join up.
+ * Takes a shorter run if swap is too fragmented for that. Returns 1 if
+ * swap is full.
+ */
+static int swap_open_cluster() {
+	unsigned len;
+
+	for (len = SWAP_CLUSTER; len > 0; len /= 2) {
+		if (bitmap_alloc_run(swapmap, len, clus_base, &clus_base) == 0) {
+			clus_len = len;
+			return 0;
+		}
+	}
+	return 1;
+}
+
 void swap_destroy() {
 
+	// Write out the last cluster, so that every dirty eviction is counted
+	swap_flush_cluster();
+
 	// Close and remove swapfile
 	close(swapfd);
 	unlink(fname);
 
 	// Destroy bitmap
 	bitmap_destroy(swapmap);
+	free(slot_vaddr);
+	free(slot_refs);
+	free(slot_frame);
+	free(frame_slot);
 	return;
 }
 
+/*
+ * Fills the read-around cache with the slot at 'slot' and the slots next
+ * to it whose pages follow on (or lead up to) its virtual page, with a
+ * single read. Slots reserved for the open cluster are not on disk yet,
+ * so the window stops at them.
+ */
+static int swap_readaround(unsigned slot) {
+	unsigned lo = slot, hi = slot;
+	addr_t vpn = SLOT_VPN(slot);
+	ssize_t len;
+
+	while (hi - lo + 1 < SWAP_READAROUND && hi + 1 < swapmap->nbits
+	       && bitmap_isset(swapmap, hi + 1) && !in_reserved(hi + 1)
+	       && SLOT_VPN(hi + 1) == vpn + (hi + 1 - slot)) {
+		hi++;
+	}
+	while (hi - lo + 1 < SWAP_READAROUND && lo > 0
+	       && bitmap_isset(swapmap, lo - 1) && !in_reserved(lo - 1)
+	       && SLOT_VPN(lo - 1) == vpn - (slot - lo + 1)) {
+		lo--;
+	}
+
+	len = pread(swapfd, ra_buf, (hi - lo + 1) * SIMPAGESIZE, (off_t)lo * SIMPAGESIZE);
+	if (len != (hi - lo + 1) * SIMPAGESIZE) {
+		ra_len = 0;
+		if (len < 0) {
+			perror("swap_pagein: failed to read swap");
+			return -errno;
+		}
+		fprintf(stderr,"swap_pagein: did not read whole page\n");
+		return len;
+	}
+	swap_read_ops++;
+	swap_read_bytes += len;
+	ra_base = lo;
+	ra_len = hi - lo + 1;
+	return 0;
+}
+
 // Read data into (simulated) physical memory 'frame' from 'swap_offset'
-// in swap file.
+// in swap file. The page comes from the open cluster or the read-around
+// cache if it is there, and is otherwise read along with its neighbours.
 // Input:  frame - the physical frame number (not byte offset) in physmem
 //         swap_offset - the byte position in the swap file.
 // Return: 0 on success, 
@@ -187,70 +426,256 @@ void swap_destroy() {
 // 
 int swap_pagein(unsigned frame, int swap_offset) {
 	char *frame_ptr;
-	off_t pos;
-	ssize_t bytes_read;
+	unsigned slot;
+	int ret;
 	
 	assert(swap_offset != INVALID_SWAP);
+	slot = swap_offset / SIMPAGESIZE;
 
 	// Get pointer to page data in (simulated) physical memory
 	frame_ptr = &physmem[frame * SIMPAGESIZE];
+	swap_pageins++;
 
-	// Seek to position in swap file where this page was stored
-	pos = lseek(swapfd, swap_offset, SEEK_SET);
-	if (pos != swap_offset) {
-		assert(pos == (off_t)-1);
-		perror("swap_pagein: failed to set read position");
-		return -errno;
+	if (in_cluster(slot)) {
+		memcpy(frame_ptr, &clus_buf[(slot - clus_base) * SIMPAGESIZE], SIMPAGESIZE);
+		swap_cache_hits++;
+		return 0;
 	}
-
-	// Read page data from swapfile into memory
-	bytes_read = read(swapfd, frame_ptr, SIMPAGESIZE);
-	if (bytes_read != SIMPAGESIZE) {
-		fprintf(stderr,"swap_pagein: did not read whole page\n");
-		return bytes_read;
+	if (in_readaround(slot)) {
+		swap_cache_hits++;
+	} else if ((ret = swap_readaround(slot)) != 0) {
+		return ret;
 	}
+	memcpy(frame_ptr, &ra_buf[(slot - ra_base) * SIMPAGESIZE], SIMPAGESIZE);
 	return 0;
 }
 
-// Write data from (simulated) physical memory 'frame' to 'swap_offset'
-// in swap file. Allocates space in swap file for virtual page if needed.
-// Input:  frame - the physical frame number (not byte offset in physmem)
+// Write the page at 'page' to swap, for the virtual page at 'vaddr'. The page is copied into the open cluster, and
+// reaches the swap file when the cluster is written out. Its old slot at
+// 'swap_offset' (if any) is freed, unless that slot is still in the open
+// cluster, in which case the page is updated there.
+// Input:  page - the SIMPAGESIZE bytes of page data
 //         swap_offset - the byte position in the swap file.
-// Return: the swap_offset where the data was written on success,
+//         vaddr - the virtual address of the page
+// Return: the swap_offset where the data will be written on success,
 //         or INVALID_SWAP on failure
 // 
-int swap_pageout(unsigned frame, int swap_offset) {
-	char *frame_ptr;
-	off_t pos;
-	unsigned idx;
-	ssize_t bytes_written;
-
-	// Check if swap has already been allocated for this page 
-	if (swap_offset == INVALID_SWAP) {
-		if (bitmap_alloc(swapmap, &idx) != 0) {
-			fprintf(stderr,"swap_pageout: Could not allocate space in swapfile. Try running again with a larger swapsize.\n");
-			return INVALID_SWAP;
+int swap_pageout_page(char *page, int swap_offset, addr_t vaddr) {
+	unsigned slot;
+
+	if (swap_offset != INVALID_SWAP) {
+		slot = swap_offset / SIMPAGESIZE;
+		if (in_cluster(slot) && slot_refs[slot] == 1) {
+			memcpy(&clus_buf[(slot - clus_base) * SIMPAGESIZE], page,
+			       SIMPAGESIZE);
+			return swap_offset;
 		}
-		swap_offset = idx*SIMPAGESIZE;
+		swap_release(swap_offset);
 	}
-	assert(swap_offset != INVALID_SWAP);
-
-	// Get pointer to page data in (simulated) physical memory
-	frame_ptr = &physmem[frame * SIMPAGESIZE];
 
-	// Seek to position in swap file where this page will be stored
-	pos = lseek(swapfd, swap_offset, SEEK_SET);
-	if (pos != swap_offset) {
-		assert(pos == (off_t)-1);
-		perror("swap_pageout: failed to set write position");
+	if (clus_len == 0 && swap_open_cluster() != 0) {
+		fprintf(stderr,"swap_pageout: Could not allocate space in swapfile. Try running again with a larger swapsize.\n");
 		return INVALID_SWAP;
 	}
+	slot = clus_base + clus_next;
+	memcpy(&clus_buf[clus_next * SIMPAGESIZE], page, SIMPAGESIZE);
+	slot_vaddr[slot] = vaddr;
+	slot_refs[slot] = 1;
+	clus_next++;
+	swap_used++;
+
+	if (clus_next == clus_len) {
+		swap_flush_cluster();
+	}
 
-	// Read page data from swapfile into memory
-	bytes_written = write(swapfd, frame_ptr, SIMPAGESIZE);
-	if (bytes_written != SIMPAGESIZE) {
-		fprintf(stderr,"swap_pageout: did not write whole page\n");
-		return INVALID_SWAP;
+	return slot * SIMPAGESIZE;
+}
+
+/* Adds a reference to the slot at swap_offset, for a pte copied by fork. */
+void swap_dup(int swap_offset) {
+	unsigned slot = swap_offset / SIMPAGESIZE;
+
+	assert(bitmap_isset(swapmap, slot) && slot_refs[slot] > 0);
+	if (slot_refs[slot] == USHRT_MAX) {
+		fprintf(stderr, "swap_dup: too many references to swap slot %u\n", slot);
+		exit(1);
+	}
+	slot_refs[slot]++;
+}
+
+/*
+ * Drops a reference to the slot at swap_offset, and frees the slot once
+ * nothing refers to it. A slot in the open cluster stays reserved until
+ * the cluster is written, but is no longer counted as used.
+ */
+void swap_release(int swap_offset) {
+	unsigned slot = swap_offset / SIMPAGESIZE;
+
+	assert(slot_refs[slot] > 0);
+	if (--slot_refs[slot] > 0) {
+		return;
+	}
+	swap_used--;
+	if (slot_frame[slot] >= 0) {
+		frame_slot[slot_frame[slot]] = -1;
+		slot_frame[slot] = -1;
+	}
+	if (in_reserved(slot)) {
+		return;
+	}
+	bitmap_unmark(swapmap, slot);
+	if (in_readaround(slot)) {
+		ra_len = 0;
+	}
+}
+
+/*
+ * Returns the frame that holds a clean copy of the slot at swap_offset,
+ * or -1 if there is none.
+ */
+int swapcache_lookup(int swap_offset) {
+	return slot_frame[swap_offset / SIMPAGESIZE];
+}
+
+/* Records that frame holds a clean copy of the slot at swap_offset. Only
+ * slots that more than one pte refers to are worth remembering.
+ */
+void swapcache_add(int swap_offset, int frame) {
+	unsigned slot = swap_offset / SIMPAGESIZE;
+
+	swapcache_drop_frame(frame);
+	if (slot_refs[slot] > 1) {
+		slot_frame[slot] = frame;
+		frame_slot[frame] = slot;
+	}
+}
+
+/* Forgets the slot held in frame, once it is written to or reused. */
+void swapcache_drop_frame(int frame) {
+	if (frame_slot[frame] >= 0) {
+		slot_frame[frame_slot[frame]] = -1;
+		frame_slot[frame] = -1;
+	}
+}
+
+// Write data from (simulated) physical memory 'frame' to swap.
+// Input:  frame - the physical frame number (not byte offset in physmem)
+//         swap_offset, vaddr - as for swap_pageout_page
+int swap_pageout(unsigned frame, int swap_offset, addr_t vaddr) {
+	return swap_pageout_page(&physmem[frame * SIMPAGESIZE], swap_offset, vaddr);
+}
+
+/* Reads the slots [first, first + n) into buf, for the caches. */
+static void swap_fill(char *buf, unsigned first, unsigned n) {
+	size_t len = n * SIMPAGESIZE;
+	if (n > 0 && pread(swapfd, buf, len, (off_t)first * SIMPAGESIZE) != (ssize_t)len) {
+		fprintf(stderr, "swap_restore: could not read swap slots %u-%u\n",
+			first, first + n - 1);
+		exit(1);
+	}
+}
+
+// Write the swap bitmap, the state of the open cluster and read-around
+// cache, and the contents of every allocated swap slot to a checkpoint
+// file. Pages still in the open cluster are saved from clus_buf, so
+// taking a checkpoint does not change when clusters are written.
+void swap_save(FILE *fp) {
+	unsigned words = DIVROUNDUP(swapmap->nbits, BITS_PER_WORD);
+	char page[SIMPAGESIZE];
+	unsigned i;
+
+	ckpt_write(fp, &swapmap->nbits, sizeof(unsigned));
+	ckpt_write(fp, swapmap->v, words*sizeof(unsigned));
+	ckpt_write(fp, slot_vaddr, swapmap->nbits*sizeof(addr_t));
+	ckpt_write(fp, slot_refs, swapmap->nbits*sizeof(unsigned short));
+	ckpt_write(fp, slot_frame, swapmap->nbits*sizeof(int));
+	ckpt_write(fp, frame_slot, memsize*sizeof(int));
+	ckpt_write(fp, &clus_base, sizeof(unsigned));
+	ckpt_write(fp, &clus_len, sizeof(unsigned));
+	ckpt_write(fp, &clus_next, sizeof(unsigned));
+	ckpt_write(fp, &ra_base, sizeof(unsigned));
+	ckpt_write(fp, &ra_len, sizeof(unsigned));
+	ckpt_write(fp, &swap_writes, sizeof(int));
+	ckpt_write(fp, &swap_seq_writes, sizeof(int));
+	ckpt_write(fp, &last_write_end, sizeof(off_t));
+	ckpt_write(fp, &swap_read_ops, sizeof(int));
+	ckpt_write(fp, &swap_write_ops, sizeof(int));
+	ckpt_write(fp, &swap_read_bytes, sizeof(long));
+	ckpt_write(fp, &swap_write_bytes, sizeof(long));
+	ckpt_write(fp, &swap_cache_hits, sizeof(int));
+	ckpt_write(fp, &swap_pageins, sizeof(int));
+
+	for (i = 0; i < swapmap->nbits; i++) {
+		if (!bitmap_isset(swapmap, i)) {
+			continue;
+		}
+		if (in_reserved(i)) {
+			ckpt_write(fp, &clus_buf[(i - clus_base) * SIMPAGESIZE], SIMPAGESIZE);
+			continue;
+		}
+		if (pread(swapfd, page, SIMPAGESIZE, i*SIMPAGESIZE) != SIMPAGESIZE) {
+			fprintf(stderr, "swap_save: could not read swap slot %u\n", i);
+			exit(1);
+		}
+		ckpt_write(fp, page, SIMPAGESIZE);
 	}
-	return swap_offset;
+}
+
+// Restore the swap state and swap file contents written by swap_save.
+// The swapfile must have been created by swap_init with the same size.
+void swap_restore(FILE *fp) {
+	unsigned words = DIVROUNDUP(swapmap->nbits, BITS_PER_WORD);
+	char page[SIMPAGESIZE];
+	unsigned nbits, i;
+
+	ckpt_read(fp, &nbits, sizeof(unsigned));
+	if (nbits != swapmap->nbits) {
+		fprintf(stderr, "swap_restore: checkpoint has swapsize %u, not %u\n",
+			nbits, swapmap->nbits);
+		exit(1);
+	}
+	ckpt_read(fp, swapmap->v, words*sizeof(unsigned));
+	ckpt_read(fp, slot_vaddr, swapmap->nbits*sizeof(addr_t));
+	ckpt_read(fp, slot_refs, swapmap->nbits*sizeof(unsigned short));
+	ckpt_read(fp, slot_frame, swapmap->nbits*sizeof(int));
+	ckpt_read(fp, frame_slot, memsize*sizeof(int));
+	ckpt_read(fp, &clus_base, sizeof(unsigned));
+	ckpt_read(fp, &clus_len, sizeof(unsigned));
+	ckpt_read(fp, &clus_next, sizeof(unsigned));
+	ckpt_read(fp, &ra_base, sizeof(unsigned));
+	ckpt_read(fp, &ra_len, sizeof(unsigned));
+	ckpt_read(fp, &swap_writes, sizeof(int));
+	ckpt_read(fp, &swap_seq_writes, sizeof(int));
+	ckpt_read(fp, &last_write_end, sizeof(off_t));
+	ckpt_read(fp, &swap_read_ops, sizeof(int));
+	ckpt_read(fp, &swap_write_ops, sizeof(int));
+	ckpt_read(fp, &swap_read_bytes, sizeof(long));
+	ckpt_read(fp, &swap_write_bytes, sizeof(long));
+	ckpt_read(fp, &swap_cache_hits, sizeof(int));
+	ckpt_read(fp, &swap_pageins, sizeof(int));
+	if (clus_len > SWAP_CLUSTER || ra_len > SWAP_READAROUND) {
+		fprintf(stderr, "swap_restore: checkpoint was taken with larger "
+			"swap clusters\n");
+		exit(1);
+	}
+
+	// Reserved slots in the open cluster that hold no page are not
+	// counted as used
+	swap_used = 0;
+	for (i = 0; i < swapmap->nbits; i++) {
+		if (!bitmap_isset(swapmap, i)) {
+			continue;
+		}
+		if (slot_refs[i] > 0) {
+			swap_used++;
+		}
+		ckpt_read(fp, page, SIMPAGESIZE);
+		if (pwrite(swapfd, page, SIMPAGESIZE, i*SIMPAGESIZE) != SIMPAGESIZE) {
+			fprintf(stderr, "swap_restore: could not write swap slot %u\n", i);
+			exit(1);
+		}
+	}
+
+	swap_fill(clus_buf, clus_base, clus_next);
+	swap_fill(ra_buf, ra_base, ra_len);
 }
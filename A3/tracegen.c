@@ -0,0 +1,765 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include "stackdist.h"
+
+/*
+ * Fits a compact workload model to a trace, and generates synthetic traces
+ * of any length from the model, in the same format as the traces sim
+ * replays.
+ *
+ *   tracegen fit [-w window] [-p threshold] tracefile > model
+ *   tracegen gen [-n refs] [-s seed] model > tracefile
+ *   tracegen compare [-t tolerance] tracefile1 tracefile2
+ *
+ * The model splits the trace into phases. A phase is a run of windows of
+ * the trace whose stack distance distributions are alike: a window joins
+ * the phase before it unless their distributions differ by more than the
+ * threshold in total variation distance. For each phase the model keeps
+ *  - the distribution of LRU stack distances (the number of other pages
+ *    referenced since the last reference to the page), in buckets that are
+ *    exact up to 32 and an eighth of a power of two wide above that, plus
+ *    the number of first references to a page. Loops make many references
+ *    at exactly the same distance, so distances with at least 1 in 1000 of
+ *    the references of a window are also kept exactly (up to NSPIKES);
+ *  - the mix of reference types (I, L, S, M), separately for first
+ *    references and for re-references.
+ * For the whole trace it keeps the most common strides between the pages
+ * of successive first references, and how often a first reference is
+ * anywhere else in the address range instead.
+ *
+ * The generator replays the phases in order, each scaled to the same share
+ * of the references as in the original. It keeps an LRU stack of the
+ * pages it has generated, and for each reference draws a stack distance
+ * and references the page at that depth, or a new page one of the strides
+ * past the last new page. Since a reference misses in an LRU memory of m
+ * frames exactly when its stack distance is at least m, a synthetic trace
+ * of the same length has the same LRU miss ratio curve as the original,
+ * to within the width of the buckets and sampling noise. compare measures
+ * how far apart the curves of two traces are: the largest difference in
+ * miss ratio over memory sizes from 1 frame to the larger footprint, and
+ * fails if it is more than the tolerance (default 0.02). Other replacement
+ * algorithms see much the same reuse, but their curves are not matched
+ * exactly.
+ */
+
+#define PAGE_SHIFT    12
+#define MAXLINE       256
+#define COLD          NBUCKETS // Bucket counting first references
+#define NSPIKES       64
+#define NSTRIDES      16
+#define NTYPES        4
+
+static const char types[NTYPES] = { 'I', 'L', 'S', 'M' };
+
+static int type_index(char type) {
+	const char *p = memchr(types, type, NTYPES);
+	return p ? p - types : 1;
+}
+
+struct phase {
+	uint64_t refs;
+	uint64_t dist[NBUCKETS + 1];    // Stack distances, and COLD
+	uint64_t spike_d[NSPIKES];      // Distances that many of the references
+	uint64_t spike_n[NSPIKES];      // in their bucket are at, and how many
+	int nspikes;
+	uint64_t cold_types[NTYPES];
+	uint64_t warm_types[NTYPES];
+};
+
+struct model {
+	uint64_t refs;
+	uint64_t min_page, max_page;
+	int64_t strides[NSTRIDES];
+	uint64_t stride_count[NSTRIDES + 1]; // The last counts first references
+	                                     // at any other stride (jumps)
+	struct phase *phases;
+	unsigned nphases;
+};
+
+/* Reads the next reference of a trace. Returns 0 at the end of it. */
+static int next_ref(FILE *fp, char *type, uint64_t *page) {
+	char buf[MAXLINE];
+	unsigned long vaddr;
+
+	while (fgets(buf, MAXLINE, fp) != NULL) {
+		if (buf[0] == '=' || buf[0] == 'F' || buf[0] == 'X') {
+			continue;
+		}
+		if (sscanf(buf, "%c %lx", type, &vaddr) == 2) {
+			*page = vaddr >> PAGE_SHIFT;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static FILE *open_or_die(const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	return fp;
+}
+
+/* Total variation distance between the stack distance distributions of
+ * two phases.
+ */
+static double distance(struct phase *a, struct phase *b) {
+	double sum = 0;
+	int i;
+
+	for (i = 0; i <= NBUCKETS; i++) {
+		sum += fabs((double)a->dist[i] / a->refs - (double)b->dist[i] / b->refs);
+	}
+	return sum / 2;
+}
+
+/*
+ * Records that n references of phase ph are at distance d exactly. Only
+ * the NSPIKES largest spikes are kept; the references of one that is
+ * dropped are still counted in its bucket.
+ */
+static void add_spike(struct phase *ph, uint64_t d, uint64_t n) {
+	int i, min = 0;
+
+	for (i = 0; i < ph->nspikes; i++) {
+		if (ph->spike_d[i] == d) {
+			ph->spike_n[i] += n;
+			return;
+		}
+		if (ph->spike_n[i] < ph->spike_n[min]) {
+			min = i;
+		}
+	}
+	if (ph->nspikes < NSPIKES) {
+		min = ph->nspikes++;
+	} else if (ph->spike_n[min] >= n) {
+		return;
+	}
+	ph->spike_d[min] = d;
+	ph->spike_n[min] = n;
+}
+
+static void merge_phase(struct phase *into, struct phase *from) {
+	int i;
+
+	into->refs += from->refs;
+	for (i = 0; i <= NBUCKETS; i++) {
+		into->dist[i] += from->dist[i];
+	}
+	for (i = 0; i < from->nspikes; i++) {
+		add_spike(into, from->spike_d[i], from->spike_n[i]);
+	}
+	for (i = 0; i < NTYPES; i++) {
+		into->cold_types[i] += from->cold_types[i];
+		into->warm_types[i] += from->warm_types[i];
+	}
+}
+
+/* Counts a first reference at stride from the last one. */
+static void add_stride(struct model *m, int64_t stride) {
+	int i, min = 0;
+
+	for (i = 0; i < NSTRIDES; i++) {
+		if (m->stride_count[i] > 0 && m->strides[i] == stride) {
+			m->stride_count[i]++;
+			return;
+		}
+		if (m->stride_count[i] < m->stride_count[min]) {
+			min = i;
+		}
+	}
+	// Keep the most common strides: a new one replaces the rarest, whose
+	// count moves to the jumps (a space-saving top-k count)
+	m->stride_count[NSTRIDES] += m->stride_count[min];
+	m->strides[min] = stride;
+	m->stride_count[min] = 1;
+}
+
+/*
+ * Exact counts of the distances beyond the exact buckets in the current
+ * window, and which of them are non-zero, from which the window's spikes
+ * are taken: distances with at least 1 in 1000 of its references.
+ */
+static uint64_t *exact;
+static uint64_t exact_len;
+static uint64_t *touched;
+static size_t ntouched, touched_cap;
+
+static void count_exact(uint64_t d) {
+	if (d >= exact_len) {
+		uint64_t len = exact_len ? exact_len : 1024;
+		while (len <= d) {
+			len *= 2;
+		}
+		exact = realloc(exact, len * sizeof(uint64_t));
+		assert(exact != NULL);
+		memset(exact + exact_len, 0, (len - exact_len) * sizeof(uint64_t));
+		exact_len = len;
+	}
+	if (exact[d]++ == 0) {
+		if (ntouched == touched_cap) {
+			touched_cap = touched_cap ? 2 * touched_cap : 1024;
+			touched = realloc(touched, touched_cap * sizeof(uint64_t));
+			assert(touched != NULL);
+		}
+		touched[ntouched++] = d;
+	}
+}
+
+static void take_spikes(struct phase *ph) {
+	uint64_t min = ph->refs / 1000 > 8 ? ph->refs / 1000 : 8;
+	size_t i;
+
+	for (i = 0; i < ntouched; i++) {
+		if (exact[touched[i]] >= min) {
+			add_spike(ph, touched[i], exact[touched[i]]);
+		}
+		exact[touched[i]] = 0;
+	}
+	ntouched = 0;
+}
+
+static void fit(FILE *fp, uint64_t window, double threshold) {
+	struct model m;
+	struct phase cur;
+	struct lru s;
+	uint64_t page, last_new = 0, d;
+	unsigned cap = 16, p;
+	char type;
+	int i;
+
+	memset(&m, 0, sizeof(m));
+	memset(&cur, 0, sizeof(cur));
+	m.min_page = UINT64_MAX;
+	m.phases = xcalloc(cap, sizeof(struct phase));
+	lru_init(&s);
+
+	for (;;) {
+		int more = next_ref(fp, &type, &page);
+
+		if (cur.refs == window || (!more && cur.refs > 0)) {
+			take_spikes(&cur);
+			if (m.nphases > 0 && distance(&m.phases[m.nphases - 1], &cur) <= threshold) {
+				merge_phase(&m.phases[m.nphases - 1], &cur);
+			} else {
+				if (m.nphases == cap) {
+					cap *= 2;
+					m.phases = realloc(m.phases, cap * sizeof(struct phase));
+					assert(m.phases != NULL);
+				}
+				m.phases[m.nphases++] = cur;
+			}
+			memset(&cur, 0, sizeof(cur));
+		}
+		if (!more) {
+			break;
+		}
+
+		m.refs++;
+		cur.refs++;
+		d = lru_ref(&s, page, 0, NULL);
+		if (d == UINT64_MAX) {
+			cur.dist[COLD]++;
+			cur.cold_types[type_index(type)]++;
+			if (m.refs > 1) {
+				add_stride(&m, (int64_t)(page - last_new));
+			}
+			last_new = page;
+			if (page < m.min_page) {
+				m.min_page = page;
+			}
+			if (page > m.max_page) {
+				m.max_page = page;
+			}
+		} else {
+			cur.dist[bucket(d)]++;
+			cur.warm_types[type_index(type)]++;
+			if (d >= EXACT_BUCKETS) {
+				count_exact(d);
+			}
+		}
+	}
+	if (m.refs == 0) {
+		fprintf(stderr, "tracegen: the trace has no references\n");
+		exit(1);
+	}
+
+	printf("tracegen-model 1\n");
+	printf("refs %lu pages %lu range %lx %lx\n", (unsigned long)m.refs,
+	       (unsigned long)s.npages, (unsigned long)m.min_page,
+	       (unsigned long)m.max_page);
+	printf("strides");
+	for (i = 0; i < NSTRIDES; i++) {
+		if (m.stride_count[i] > 0) {
+			printf(" %ld:%lu", (long)m.strides[i], (unsigned long)m.stride_count[i]);
+		}
+	}
+	printf(" jump:%lu\n", (unsigned long)m.stride_count[NSTRIDES]);
+	for (p = 0; p < m.nphases; p++) {
+		struct phase *ph = &m.phases[p];
+		printf("phase %lu types", (unsigned long)ph->refs);
+		for (i = 0; i < NTYPES; i++) {
+			printf(" %lu/%lu", (unsigned long)ph->cold_types[i],
+			       (unsigned long)ph->warm_types[i]);
+		}
+		printf("\ndist cold:%lu", (unsigned long)ph->dist[COLD]);
+		for (i = 0; i < NBUCKETS; i++) {
+			if (ph->dist[i] > 0) {
+				printf(" %d:%lu", i, (unsigned long)ph->dist[i]);
+			}
+		}
+		printf("\nspikes");
+		for (i = 0; i < ph->nspikes; i++) {
+			printf(" %lu:%lu", (unsigned long)ph->spike_d[i],
+			       (unsigned long)ph->spike_n[i]);
+		}
+		printf("\n");
+	}
+	lru_free(&s);
+	free(exact);
+	free(touched);
+	free(m.phases);
+}
+
+/* ------------------------------------------------------------------ */
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng() {
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338117ULL;
+}
+
+/* Returns an index into counts[0..n), drawn in proportion to the counts,
+ * whose sum is total.
+ */
+static int draw(uint64_t *counts, int n, uint64_t total) {
+	uint64_t r = rng() % total;
+	int i;
+
+	for (i = 0; i < n - 1; i++) {
+		if (r < counts[i]) {
+			return i;
+		}
+		r -= counts[i];
+	}
+	return n - 1;
+}
+
+static void bad_model(const char *what) {
+	fprintf(stderr, "tracegen: bad model: %s\n", what);
+	exit(1);
+}
+
+static void read_model(FILE *fp, struct model *m) {
+	char *line = NULL, *tok, *save;
+	size_t len = 0;
+	unsigned long refs, pages, lo, hi, a, b;
+	unsigned cap = 16;
+	long stride;
+	int n = 0, i;
+
+	memset(m, 0, sizeof(*m));
+	m->phases = xcalloc(cap, sizeof(struct phase));
+	if (getline(&line, &len, fp) < 0 || strcmp(line, "tracegen-model 1\n") != 0) {
+		bad_model("not a version 1 model");
+	}
+	if (getline(&line, &len, fp) < 0
+	    || sscanf(line, "refs %lu pages %lu range %lx %lx", &refs, &pages, &lo, &hi) != 4) {
+		bad_model("no refs line");
+	}
+	m->refs = refs;
+	m->min_page = lo;
+	m->max_page = hi;
+	if (getline(&line, &len, fp) < 0 || strncmp(line, "strides", 7) != 0) {
+		bad_model("no strides line");
+	}
+	for (tok = strtok_r(line + 7, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save)) {
+		if (sscanf(tok, "jump:%lu", &a) == 1) {
+			m->stride_count[NSTRIDES] = a;
+		} else if (sscanf(tok, "%ld:%lu", &stride, &a) == 2 && n < NSTRIDES) {
+			m->strides[n] = stride;
+			m->stride_count[n++] = a;
+		} else {
+			bad_model("bad stride");
+		}
+	}
+
+	while (getline(&line, &len, fp) >= 0) {
+		struct phase *ph;
+
+		if (m->nphases == cap) {
+			cap *= 2;
+			m->phases = realloc(m->phases, cap * sizeof(struct phase));
+			assert(m->phases != NULL);
+		}
+		ph = &m->phases[m->nphases];
+		memset(ph, 0, sizeof(*ph));
+		if (sscanf(line, "phase %lu", &a) != 1 || a == 0) {
+			bad_model("bad phase line");
+		}
+		ph->refs = a;
+		tok = strstr(line, "types");
+		if (tok == NULL) {
+			bad_model("no types");
+		}
+		tok += 5;
+		for (i = 0; i < NTYPES; i++) {
+			if (sscanf(tok, " %lu/%lu%n", &a, &b, &n) != 2) {
+				bad_model("bad types");
+			}
+			ph->cold_types[i] = a;
+			ph->warm_types[i] = b;
+			tok += n;
+		}
+		if (getline(&line, &len, fp) < 0 || sscanf(line, "dist cold:%lu", &a) != 1) {
+			bad_model("no dist line");
+		}
+		ph->dist[COLD] = a;
+		strtok_r(line, " \n", &save);
+		strtok_r(NULL, " \n", &save);
+		while ((tok = strtok_r(NULL, " \n", &save)) != NULL) {
+			if (sscanf(tok, "%d:%lu", &i, &a) != 2 || i < 0 || i >= NBUCKETS) {
+				bad_model("bad distance bucket");
+			}
+			ph->dist[i] = a;
+		}
+		if (getline(&line, &len, fp) < 0 || strncmp(line, "spikes", 6) != 0) {
+			bad_model("no spikes line");
+		}
+		for (tok = strtok_r(line + 6, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save)) {
+			if (sscanf(tok, "%lu:%lu", &a, &b) != 2 || ph->nspikes == NSPIKES
+			    || a < EXACT_BUCKETS || b > ph->dist[bucket(a)]) {
+				bad_model("bad spike");
+			}
+			ph->spike_d[ph->nspikes] = a;
+			ph->spike_n[ph->nspikes++] = b;
+		}
+		m->nphases++;
+	}
+	free(line);
+	if (m->nphases == 0) {
+		bad_model("no phases");
+	}
+}
+
+/* Picks the page for a first reference: a stride past the last new page,
+ * or anywhere in the range (which a stride also falls back to if it leaves
+ * the range), moving on to the next page not yet used. Once the range is
+ * mostly used, as it will be in a trace longer than the original, the
+ * range grows instead.
+ */
+static uint64_t new_page(struct model *m, struct lru *s, uint64_t last_new,
+			 uint64_t stride_total) {
+	uint64_t page, span = m->max_page - m->min_page + 1;
+	int i = draw(m->stride_count, NSTRIDES + 1, stride_total);
+	int probes;
+
+	page = last_new + m->strides[i < NSTRIDES ? i : 0];
+	if (i == NSTRIDES || page < m->min_page || page > m->max_page) {
+		page = m->min_page + rng() % span;
+	}
+	for (probes = 0; lru_contains(s, page); probes++) {
+		if (probes == 64) {
+			return ++m->max_page;
+		}
+		page++;
+	}
+	return page;
+}
+
+/* Draws a distance in bucket b of phase ph: one of its spikes, or any
+ * distance in the bucket for the references that are not in a spike.
+ */
+static uint64_t draw_distance(struct phase *ph, int b) {
+	uint64_t width, low = bucket_low(b, &width), r;
+	uint64_t rest = ph->dist[b];
+	int i;
+
+	for (i = 0; i < ph->nspikes; i++) {
+		if (bucket(ph->spike_d[i]) == b) {
+			rest -= ph->spike_n[i];
+		}
+	}
+	r = rng() % ph->dist[b];
+	if (r < rest) {
+		return low + rng() % width;
+	}
+	r -= rest;
+	for (i = 0; i < ph->nspikes; i++) {
+		if (bucket(ph->spike_d[i]) == b) {
+			if (r < ph->spike_n[i]) {
+				return ph->spike_d[i];
+			}
+			r -= ph->spike_n[i];
+		}
+	}
+	assert(0);
+	return low;
+}
+
+/*
+ * Re-uses drawn deeper than the stack the generator has built so far,
+ * in a min-heap, to be made when a first reference is drawn once the
+ * stack is deep enough. Early in a phase this keeps both the number of
+ * first references and the distances of re-uses close to the model.
+ */
+struct debts {
+	uint64_t *d;
+	size_t len;
+	size_t cap;
+};
+
+static void owe(struct debts *h, uint64_t d) {
+	size_t i;
+
+	if (h->len == h->cap) {
+		h->cap = h->cap ? 2 * h->cap : 1024;
+		h->d = realloc(h->d, h->cap * sizeof(uint64_t));
+		assert(h->d != NULL);
+	}
+	for (i = h->len++; i > 0 && h->d[(i - 1) / 2] > d; i = (i - 1) / 2) {
+		h->d[i] = h->d[(i - 1) / 2];
+	}
+	h->d[i] = d;
+}
+
+static uint64_t repay(struct debts *h) {
+	uint64_t top = h->d[0], last = h->d[--h->len];
+	size_t i = 0, c;
+
+	while ((c = 2 * i + 1) < h->len) {
+		if (c + 1 < h->len && h->d[c + 1] < h->d[c]) {
+			c++;
+		}
+		if (h->d[c] >= last) {
+			break;
+		}
+		h->d[i] = h->d[c];
+		i = c;
+	}
+	h->d[i] = last;
+	return top;
+}
+
+static void gen(FILE *fp, uint64_t refs) {
+	struct debts debts = { NULL, 0, 0 };
+	struct model m;
+	struct lru s;
+	uint64_t stride_total, last_new, done = 0, used = 0;
+	unsigned p;
+
+	read_model(fp, &m);
+	if (refs == 0) {
+		refs = m.refs;
+	}
+	stride_total = 0;
+	for (p = 0; p <= NSTRIDES; p++) {
+		stride_total += m.stride_count[p];
+	}
+	if (stride_total == 0) {
+		// A single page: any new page will do
+		m.stride_count[NSTRIDES] = stride_total = 1;
+	}
+
+	lru_init(&s);
+	last_new = m.min_page;
+	for (p = 0; p < m.nphases; p++) {
+		struct phase *ph = &m.phases[p];
+		uint64_t n, i, total_cold = 0, total_warm = 0;
+		int t;
+
+		// Scale the phase, carrying rounding over so the phases add up
+		used += ph->refs;
+		n = (uint64_t)((double)used / m.refs * refs + 0.5) - done;
+		done += n;
+		for (t = 0; t < NTYPES; t++) {
+			total_cold += ph->cold_types[t];
+			total_warm += ph->warm_types[t];
+		}
+
+		for (i = 0; i < n; i++) {
+			int b = draw(ph->dist, NBUCKETS + 1, ph->refs);
+			uint64_t page, d = 0;
+			char type;
+
+			if (b != COLD) {
+				d = draw_distance(ph, b);
+			}
+			if (b != COLD && d >= s.npages) {
+				// Deeper than the stack is so far: make this a new
+				// page, and a later new page a re-use at d instead
+				owe(&debts, d);
+				b = COLD;
+			} else if (b == COLD && debts.len > 0 && debts.d[0] < s.npages) {
+				d = repay(&debts);
+				b = 0;
+			}
+			if (b == COLD) {
+				page = new_page(&m, &s, last_new, stride_total);
+				last_new = page;
+			} else {
+				page = lru_at(&s, d);
+			}
+			if (b == COLD ? total_cold : total_warm) {
+				type = types[b == COLD ? draw(ph->cold_types, NTYPES, total_cold)
+					     : draw(ph->warm_types, NTYPES, total_warm)];
+			} else {
+				type = 'L';
+			}
+			lru_ref(&s, page, 0, NULL);
+			printf("%c %lx\n", type, (unsigned long)(page << PAGE_SHIFT));
+		}
+	}
+	lru_free(&s);
+	free(m.phases);
+	free(debts.d);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Fills hist with the number of references at each stack distance below
+ * max (and at max or beyond, or first references, in hist[max]), growing
+ * it as needed. Returns the number of references.
+ */
+static uint64_t stack_distances(FILE *fp, uint64_t **hist, uint64_t *max,
+				uint64_t *pages) {
+	struct lru s;
+	uint64_t page, d, refs = 0;
+	char type;
+
+	*max = 1 << 16;
+	*hist = xcalloc(*max + 1, sizeof(uint64_t));
+	lru_init(&s);
+	while (next_ref(fp, &type, &page)) {
+		d = lru_ref(&s, page, 0, NULL);
+		refs++;
+		if (d == UINT64_MAX) {
+			(*hist)[*max]++;
+			continue;
+		}
+		while (d >= *max) {
+			*hist = realloc(*hist, (2 * *max + 1) * sizeof(uint64_t));
+			assert(*hist != NULL);
+			(*hist)[2 * *max] = (*hist)[*max];
+			memset(*hist + *max, 0, *max * sizeof(uint64_t));
+			*max *= 2;
+		}
+		(*hist)[d]++;
+	}
+	*pages = s.npages;
+	lru_free(&s);
+	return refs;
+}
+
+/* Miss ratio of an LRU memory of m frames: the share of references at a
+ * stack distance of at least m, taken from the running sum below m.
+ */
+static int compare(FILE *fa, FILE *fb, double tolerance) {
+	uint64_t *ha, *hb, maxa, maxb, pa, pb, na, nb, m, hits_a = 0, hits_b = 0;
+	uint64_t worst_m = 1, next = 1;
+	double worst = 0;
+
+	na = stack_distances(fa, &ha, &maxa, &pa);
+	nb = stack_distances(fb, &hb, &maxb, &pb);
+	if (na == 0 || nb == 0) {
+		fprintf(stderr, "tracegen: a trace has no references\n");
+		return 1;
+	}
+	printf("%10s %10s %10s\n", "frames", "miss1", "miss2");
+	for (m = 1; m <= (pa > pb ? pa : pb); m++) {
+		double ra, rb;
+
+		if (m - 1 < maxa) {
+			hits_a += ha[m - 1];
+		}
+		if (m - 1 < maxb) {
+			hits_b += hb[m - 1];
+		}
+		ra = 1 - (double)hits_a / na;
+		rb = 1 - (double)hits_b / nb;
+		if (fabs(ra - rb) > worst) {
+			worst = fabs(ra - rb);
+			worst_m = m;
+		}
+		if (m == next) {
+			printf("%10lu %10.4f %10.4f\n", (unsigned long)m, ra, rb);
+			next = next * 2;
+		}
+	}
+	printf("Largest difference: %.4f at %lu frames (tolerance %.4f): %s\n",
+	       worst, (unsigned long)worst_m, tolerance,
+	       worst <= tolerance ? "OK" : "FAIL");
+	free(ha);
+	free(hb);
+	return worst > tolerance;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"USAGE: tracegen fit [-w window] [-p threshold] tracefile > model\n"
+		"       tracegen gen [-n refs] [-s seed] model > tracefile\n"
+		"       tracegen compare [-t tolerance] tracefile1 tracefile2\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	uint64_t window = 65536, refs = 0;
+	double threshold = 0.1, tolerance = 0.02;
+	char *cmd;
+	int opt;
+
+	if (argc < 2) {
+		usage();
+	}
+	cmd = argv[1];
+	argv++;
+	argc--;
+	while ((opt = getopt(argc, argv, "w:p:n:s:t:")) != -1) {
+		switch (opt) {
+		case 'w':
+			window = strtoull(optarg, NULL, 10);
+			break;
+		case 'p':
+			threshold = strtod(optarg, NULL);
+			break;
+		case 'n':
+			refs = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			rng_state = (strtoull(optarg, NULL, 10) << 1 | 1) * 0x9e3779b97f4a7c15ULL;
+			break;
+		case 't':
+			tolerance = strtod(optarg, NULL);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (window == 0) {
+		usage();
+	}
+
+	if (strcmp(cmd, "fit") == 0 && optind == argc - 1) {
+		fit(open_or_die(argv[optind]), window, threshold);
+	} else if (strcmp(cmd, "gen") == 0 && optind == argc - 1) {
+		gen(open_or_die(argv[optind]), refs);
+	} else if (strcmp(cmd, "compare") == 0 && optind == argc - 2) {
+		return compare(open_or_die(argv[optind]), open_or_die(argv[optind + 1]),
+			       tolerance);
+	} else {
+		usage();
+	}
+	return 0;
+}
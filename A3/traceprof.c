@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "stackdist.h"
+
+/*
+ * Profiles a trace in one streaming pass, in bounded memory, before it is
+ * replayed:
+ *
+ *   traceprof [-o out] [-m pages] [-i interval] [-k top] [-t tau,...] tracefile
+ *
+ * It measures
+ *  - the mix of reference types, and the read/write ratio (loads and
+ *    modifies read; stores and modifies write);
+ *  - the reuse distance of each reference (the LRU stack distance: the
+ *    number of other pages referenced since the last reference to the page)
+ *    and its inter-reference time (the number of references since then);
+ *  - page popularity: how many pages have how many references, and the
+ *    most referenced pages;
+ *  - the working set size W(t, tau), the number of pages referenced in the
+ *    last tau references, every interval references (default 10000) for
+ *    each tau (default 1000, 10000, 100000 and 1000000).
+ *
+ * Memory is bounded by sampling pages by a hash of their number (SHARDS,
+ * Waldspurger et al., FAST '15): a page is tracked if its hash is below a
+ * threshold, and when more than -m pages (default 65536) are tracked the
+ * threshold drops to shed the ones with the largest hashes. All the
+ * references to a tracked page are seen, so at sampling rate R the reuse
+ * distances among tracked pages, scaled by 1/R, estimate the true ones,
+ * and each tracked reference or page stands for 1/R of them. Traces that
+ * touch at most -m pages are measured exactly. The most referenced pages
+ * are counted over all references with a space-saving top-k count, whose
+ * counts are over by at most the error given. The working set rows are
+ * thinned to every other one, and the interval doubled, when there would
+ * be more than MAXROWS of them.
+ *
+ * Pages of different processes (X lines) are different pages.
+ *
+ * The output is text, made to be read by plotting scripts: a header of
+ * comment lines with the totals, then blocks of numbers separated by two
+ * blank lines (gnuplot's "index"; numpy can split the text on them), each
+ * preceded by a comment naming its columns:
+ *   0. reuse distance: low high refs
+ *   1. inter-reference time: low high refs
+ *   2. popularity: low high pages (the pages with low..high references)
+ *   3. hottest pages: pid vaddr refs error
+ *   4. working set: t W(t, tau) for each tau
+ * The histograms are in buckets that are exact up to 32 and an eighth of a
+ * power of two wide above that, and leave out empty buckets. First
+ * references have no reuse distance; the header counts them as cold.
+ */
+
+#define PAGE_SHIFT  12
+#define MAXLINE     256
+#define HASH_BITS   24        // Sampling hashes are below 1 << HASH_BITS
+#define MAXTAUS     8
+#define MAXROWS     2048
+
+/* Sampled pages in a max-heap by hash, to find the ones to shed. */
+struct sample {
+	uint32_t *hash;
+	uint64_t *page;
+	unsigned len;
+	uint32_t threshold;       // Pages with hashes below this are tracked
+};
+
+/* Space-saving top-k count of references per page. */
+struct top {
+	uint64_t *page;
+	uint64_t *count;
+	uint64_t *error;
+	unsigned k, used;
+};
+
+struct wsrow {
+	uint64_t t;
+	double w[MAXTAUS];
+};
+
+static uint32_t page_hash(uint64_t key) {
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key & ((1 << HASH_BITS) - 1);
+}
+
+static void heap_push(struct sample *h, uint32_t hash, uint64_t page) {
+	unsigned i = h->len++;
+
+	while (i > 0 && h->hash[(i - 1) / 2] < hash) {
+		h->hash[i] = h->hash[(i - 1) / 2];
+		h->page[i] = h->page[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	h->hash[i] = hash;
+	h->page[i] = page;
+}
+
+static void heap_pop(struct sample *h) {
+	uint32_t hash = h->hash[--h->len];
+	uint64_t page = h->page[h->len];
+	unsigned i = 0, c;
+
+	while ((c = 2 * i + 1) < h->len) {
+		if (c + 1 < h->len && h->hash[c + 1] > h->hash[c]) {
+			c++;
+		}
+		if (h->hash[c] <= hash) {
+			break;
+		}
+		h->hash[i] = h->hash[c];
+		h->page[i] = h->page[c];
+		i = c;
+	}
+	h->hash[i] = hash;
+	h->page[i] = page;
+}
+
+/* Lowers the threshold to the largest tracked hash, and stops tracking
+ * the pages with that hash.
+ */
+static void shed(struct sample *h, struct lru *s) {
+	uint32_t max = h->hash[0];
+
+	h->threshold = max;
+	while (h->len > 0 && h->hash[0] == max) {
+		lru_remove(s, h->page[0]);
+		heap_pop(h);
+	}
+}
+
+static void top_count(struct top *tp, uint64_t page) {
+	unsigned i, min = 0;
+
+	for (i = 0; i < tp->used; i++) {
+		if (tp->page[i] == page) {
+			tp->count[i]++;
+			return;
+		}
+		if (tp->count[i] < tp->count[min]) {
+			min = i;
+		}
+	}
+	if (tp->used < tp->k) {
+		min = tp->used++;
+		tp->count[min] = 0;
+	}
+	// A new page takes over the smallest count, which bounds how far its
+	// own count can be over
+	tp->page[min] = page;
+	tp->error[min] = tp->count[min];
+	tp->count[min]++;
+}
+
+static int by_count(const void *a, const void *b) {
+	const uint64_t *x = a, *y = b;
+	return x[1] < y[1] ? 1 : x[1] > y[1] ? -1 : 0;
+}
+
+static void add(double *hist, uint64_t d, double weight) {
+	int b = bucket(d);
+	hist[b < NBUCKETS ? b : NBUCKETS - 1] += weight;
+}
+
+static void print_hist(FILE *out, const char *title, double *hist) {
+	uint64_t low, width;
+	int b;
+
+	fprintf(out, "\n\n# %s\n", title);
+	for (b = 0; b < NBUCKETS; b++) {
+		if (hist[b] > 0) {
+			low = bucket_low(b, &width);
+			fprintf(out, "%lu %lu %.0f\n", (unsigned long)low,
+				(unsigned long)(low + width - 1), hist[b]);
+		}
+	}
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-o out] [-m pages] [-i interval] [-k top] "
+		"[-t tau,...] tracefile\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	uint64_t max_pages = 65536, interval = 10000, taus[MAXTAUS];
+	uint64_t types[4] = { 0 }, refs = 0, key, page, d, gap;
+	double reuse[NBUCKETS] = { 0 }, irt[NBUCKETS] = { 0 }, pop[NBUCKETS] = { 0 };
+	double rate = 1, cold_est = 0;
+	unsigned ntaus = 0, nrows = 0, i, j;
+	struct wsrow *rows;
+	struct sample h;
+	struct top tp;
+	struct lru s;
+	FILE *fp, *out = stdout;
+	char buf[MAXLINE], *p;
+	unsigned long pid = 0;
+	int opt;
+
+	memset(&tp, 0, sizeof(tp));
+	tp.k = 32;
+	while ((opt = getopt(argc, argv, "o:m:i:k:t:")) != -1) {
+		switch (opt) {
+		case 'o':
+			if ((out = fopen(optarg, "w")) == NULL) {
+				perror(optarg);
+				exit(1);
+			}
+			break;
+		case 'm':
+			max_pages = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			tp.k = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			for (p = optarg; *p != '\0' && ntaus < MAXTAUS; p++) {
+				taus[ntaus++] = strtoul(p, &p, 10);
+				if (*p != ',') {
+					break;
+				}
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || max_pages < 16 || interval == 0 || tp.k == 0) {
+		usage(argv[0]);
+	}
+	if (ntaus == 0) {
+		for (d = 1000; d <= 1000000; d *= 10) {
+			taus[ntaus++] = d;
+		}
+	}
+	if ((fp = fopen(argv[optind], "r")) == NULL) {
+		perror(argv[optind]);
+		exit(1);
+	}
+
+	lru_init(&s);
+	h.hash = xcalloc(max_pages + 1, sizeof(uint32_t));
+	h.page = xcalloc(max_pages + 1, sizeof(uint64_t));
+	h.len = 0;
+	h.threshold = 1 << HASH_BITS;
+	tp.page = xcalloc(tp.k, sizeof(uint64_t));
+	tp.count = xcalloc(tp.k, sizeof(uint64_t));
+	tp.error = xcalloc(tp.k, sizeof(uint64_t));
+	rows = xcalloc(MAXROWS, sizeof(struct wsrow));
+
+	while (fgets(buf, MAXLINE, fp) != NULL) {
+		uint32_t hash;
+
+		if (buf[0] == '=' || buf[0] == 'F') {
+			continue;
+		}
+		if (buf[0] == 'X') {
+			pid = strtoul(buf + 1, NULL, 10);
+			continue;
+		}
+		page = strtoul(buf + 1, NULL, 16) >> PAGE_SHIFT;
+		key = page | (uint64_t)pid << 48;
+		refs++;
+		switch (buf[0]) {
+		case 'I': types[0]++; break;
+		case 'S': types[2]++; break;
+		case 'M': types[3]++; break;
+		default: types[1]++; break;
+		}
+		top_count(&tp, key);
+
+		hash = page_hash(key);
+		if (hash < h.threshold) {
+			d = lru_ref(&s, key, refs, &gap);
+			if (d == UINT64_MAX) {
+				cold_est += 1 / rate;
+				heap_push(&h, hash, key);
+				if (h.len > max_pages) {
+					shed(&h, &s);
+					rate = (double)h.threshold / (1 << HASH_BITS);
+				}
+			} else {
+				add(reuse, d / rate, 1 / rate);
+				add(irt, gap, 1 / rate);
+			}
+		}
+
+		if (refs % interval == 0) {
+			if (nrows == MAXROWS) {
+				for (i = 0; i < MAXROWS / 2; i++) {
+					rows[i] = rows[2 * i + 1];
+				}
+				nrows = MAXROWS / 2;
+				interval *= 2;
+			}
+			if (refs % interval == 0) {
+				rows[nrows].t = refs;
+				for (j = 0; j < ntaus; j++) {
+					d = refs >= taus[j] ? refs - taus[j] + 1 : 0;
+					rows[nrows].w[j] = lru_active_since(&s, d) / rate;
+				}
+				nrows++;
+			}
+		}
+	}
+	fclose(fp);
+	if (refs == 0) {
+		fprintf(stderr, "traceprof: the trace has no references\n");
+		exit(1);
+	}
+
+	for (i = 0; i <= s.hash_mask; i++) {
+		if (s.keys[i] != 0) {
+			add(pop, s.count[i], 1 / rate);
+		}
+	}
+
+	fprintf(out, "# traceprof 1 %s\n", argv[optind]);
+	fprintf(out, "# refs %lu pages %.0f cold %.0f sampled %lu rate %g\n",
+		(unsigned long)refs, s.npages / rate, cold_est,
+		(unsigned long)s.npages, rate);
+	fprintf(out, "# instr %lu loads %lu stores %lu modifies %lu "
+		"reads/writes %.3f\n", (unsigned long)types[0],
+		(unsigned long)types[1], (unsigned long)types[2],
+		(unsigned long)types[3], types[2] + types[3] > 0
+		? (double)(types[1] + types[3]) / (types[2] + types[3]) : 0.0);
+	fprintf(out, "# blocks: reuse distance, inter-reference time, popularity, "
+		"hottest pages, working set");
+	print_hist(out, "reuse distance: low high refs", reuse);
+	print_hist(out, "inter-reference time: low high refs", irt);
+	print_hist(out, "popularity: low high pages", pop);
+
+	{
+		uint64_t (*hot)[3] = xcalloc(tp.used, sizeof(*hot));
+		for (i = 0; i < tp.used; i++) {
+			hot[i][0] = tp.page[i];
+			hot[i][1] = tp.count[i];
+			hot[i][2] = tp.error[i];
+		}
+		qsort(hot, tp.used, sizeof(*hot), by_count);
+		fprintf(out, "\n\n# hottest pages: pid vaddr refs error\n");
+		for (i = 0; i < tp.used; i++) {
+			fprintf(out, "%lu %#lx %lu %lu\n", (unsigned long)(hot[i][0] >> 48),
+				(unsigned long)((hot[i][0] & (((uint64_t)1 << 48) - 1))
+						<< PAGE_SHIFT),
+				(unsigned long)hot[i][1], (unsigned long)hot[i][2]);
+		}
+		free(hot);
+	}
+
+	fprintf(out, "\n\n# working set: t");
+	for (j = 0; j < ntaus; j++) {
+		fprintf(out, " W(t,%lu)", (unsigned long)taus[j]);
+	}
+	fprintf(out, "\n");
+	for (i = 0; i < nrows; i++) {
+		fprintf(out, "%lu", (unsigned long)rows[i].t);
+		for (j = 0; j < ntaus; j++) {
+			fprintf(out, " %.0f", rows[i].w[j]);
+		}
+		fprintf(out, "\n");
+	}
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	lru_free(&s);
+	free(h.hash);
+	free(h.page);
+	free(tp.page);
+	free(tp.count);
+	free(tp.error);
+	free(rows);
+	return 0;
+}
@@ -0,0 +1,139 @@
+/* File:     Breadth-first search on a CSR graph
+ *
+ * Purpose:  Run a breadth-first search over a random graph stored in
+ *           compressed sparse row (CSR) form, as graph analytics engines
+ *           do. The offsets, edge and queue arrays are read sequentially,
+ *           but every edge leads to a random vertex, so the per-vertex
+ *           data is touched all over.
+ *
+ * Compile:  gcc -g -Wall -o bfs bfs.c
+ * Run:      ./bfs <vertices> <average degree> [searches]
+ *
+ * Output:   The number of vertices reached and the deepest level of each
+ *           search.
+ *
+ * Notes:
+ * 1.  Edges go from each vertex to random vertices, with a degree drawn
+ *     uniformly from 1 to twice the average less one, so a few vertices
+ *     may not be reachable from the source.
+ * 2.  Per-vertex data is padded to 64 bytes, as for a vertex with a few
+ *     properties besides its level and parent.
+ * 3.  Each search starts from a random vertex (default 1 search).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PAD 48
+
+struct vertex {
+	long level;          // -1 until visited
+	long parent;
+	char props[PAD];
+};
+
+long *offsets;           // Edges of v are edges[offsets[v]..offsets[v + 1])
+long *edges;
+struct vertex *vdata;
+long *queue;
+
+/* Builds a random graph with n vertices in CSR form. */
+void make_graph(long n, long degree) {
+	long v, e, m = 0;
+
+	offsets = malloc((n + 1) * sizeof(long));
+	edges = malloc(n * 2 * degree * sizeof(long));
+	if (offsets == NULL || edges == NULL) {
+		fprintf(stderr, "Can't allocate storage!\n");
+		exit(1);
+	}
+	for (v = 0; v < n; v++) {
+		long d = 1 + random() % (2 * degree - 1);
+		offsets[v] = m;
+		for (e = 0; e < d; e++) {
+			edges[m++] = random() % n;
+		}
+	}
+	offsets[n] = m;
+}
+
+/* Returns the number of vertices reached from source, and the deepest
+ * level in *depth.
+ */
+long bfs(long n, long source, long *depth) {
+	long head = 0, tail = 0, v, e, reached = 1;
+
+	for (v = 0; v < n; v++) {
+		vdata[v].level = -1;
+	}
+	vdata[source].level = 0;
+	vdata[source].parent = source;
+	queue[tail++] = source;
+	*depth = 0;
+	while (head < tail) {
+		v = queue[head++];
+		for (e = offsets[v]; e < offsets[v + 1]; e++) {
+			long w = edges[e];
+			if (vdata[w].level < 0) {
+				vdata[w].level = vdata[v].level + 1;
+				vdata[w].parent = v;
+				queue[tail++] = w;
+				reached++;
+				*depth = vdata[w].level;
+			}
+		}
+	}
+	return reached;
+}
+
+int main(int argc, char ** argv) {
+	long n, degree, searches = 1, i, reached, depth;
+	/* Markers used to bound trace regions of interest */
+	volatile char MARKER_START, MARKER_END;
+	/* Record marker addresses */
+	FILE* marker_fp = fopen("bfs.marker","w");
+	if(marker_fp == NULL ) {
+		perror("Couldn't open marker file:");
+		exit(1);
+	}
+	fprintf(marker_fp, "%p %p", &MARKER_START, &MARKER_END );
+	fclose(marker_fp);
+
+	if (argc < 3 || argc > 4) {
+		fprintf(stderr, "usage: %s <vertices> <average degree> [searches]\n",
+			argv[0]);
+		exit(1);
+	}
+	n = strtol(argv[1], NULL, 10);
+	degree = strtol(argv[2], NULL, 10);
+	if (n <= 0 || degree <= 0) {
+		fprintf(stderr, "need at least one vertex and an average degree of 1\n");
+		exit(1);
+	}
+	if (argc == 4) {
+		searches = strtol(argv[3], NULL, 10);
+	}
+	vdata = malloc(n * sizeof(struct vertex));
+	queue = malloc(n * sizeof(long));
+	if (vdata == NULL || queue == NULL) {
+		fprintf(stderr, "Can't allocate storage!\n");
+		exit(1);
+	}
+
+	srandom(1);
+	make_graph(n, degree);
+
+	MARKER_START = 33;
+	for (i = 0; i < searches; i++) {
+		reached = bfs(n, random() % n, &depth);
+		printf("search %ld: reached %ld of %ld vertices, depth %ld\n",
+		       i, reached, n, depth);
+	}
+	MARKER_END = 34;
+
+	free(offsets);
+	free(edges);
+	free(vdata);
+	free(queue);
+	return 0;
+}
@@ -0,0 +1,237 @@
+/* File:     B+tree lookups and range scans
+ *
+ * Purpose:  Build a B+tree index by inserting keys in random order, then
+ *           run point lookups and range scans against it, as a database
+ *           index does. Lookups touch one node per level, so the upper
+ *           levels stay hot while the leaves are touched at random; range
+ *           scans walk the leaf chain sequentially.
+ *
+ * Compile:  gcc -g -Wall -o btree btree.c
+ * Run:      ./btree <keys> <lookups> <scans> [scan length]
+ *
+ * Output:   How many lookups found their key, and the sum of the values
+ *           the scans read.
+ *
+ * Notes:
+ * 1.  Nodes hold up to 63 keys and are about 1KB, so four fit in a page.
+ * 2.  Leaves hold the values, padded to 32 bytes each as a stand-in for
+ *     row ids and included columns.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ORDER 64             // Children per inner node
+#define MAXKEYS (ORDER - 1)
+
+struct value {
+	long v;
+	char padding[24];
+};
+
+struct node {
+	int leaf;
+	int nkeys;
+	long keys[MAXKEYS];
+	union {
+		struct node *child[ORDER];  // Inner nodes
+		struct {
+			struct value *vals;  // Leaves: MAXKEYS values
+			struct node *next;   // Leaf to the right
+		} l;
+	} u;
+};
+
+struct node *root;
+long nodes;
+
+struct node *new_node(int leaf) {
+	struct node *n = calloc(1, sizeof(struct node));
+	if (n == NULL || (leaf && (n->u.l.vals = calloc(MAXKEYS, sizeof(struct value))) == NULL)) {
+		fprintf(stderr, "Can't allocate storage!\n");
+		exit(1);
+	}
+	n->leaf = leaf;
+	nodes++;
+	return n;
+}
+
+/* Index of the first key in n that is greater than key. */
+static int upper(struct node *n, long key) {
+	int lo = 0, hi = n->nkeys;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (n->keys[mid] <= key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Inserts key into the subtree at n. If n splits, returns the new node to
+ * its right and sets *up to the key that separates them.
+ */
+struct node *insert(struct node *n, long key, long val, long *up) {
+	struct node *right, *child;
+	int i = upper(n, key), half = MAXKEYS / 2;
+	long sep;
+
+	if (n->leaf) {
+		memmove(&n->keys[i + 1], &n->keys[i], (n->nkeys - i) * sizeof(long));
+		memmove(&n->u.l.vals[i + 1], &n->u.l.vals[i],
+			(n->nkeys - i) * sizeof(struct value));
+		n->keys[i] = key;
+		n->u.l.vals[i].v = val;
+		if (++n->nkeys < MAXKEYS) {
+			return NULL;
+		}
+		// Full: move the upper half to a new leaf
+		right = new_node(1);
+		right->nkeys = n->nkeys - half;
+		memcpy(right->keys, &n->keys[half], right->nkeys * sizeof(long));
+		memcpy(right->u.l.vals, &n->u.l.vals[half],
+		       right->nkeys * sizeof(struct value));
+		n->nkeys = half;
+		right->u.l.next = n->u.l.next;
+		n->u.l.next = right;
+		*up = right->keys[0];
+		return right;
+	}
+
+	if ((child = insert(n->u.child[i], key, val, &sep)) == NULL) {
+		return NULL;
+	}
+	memmove(&n->keys[i + 1], &n->keys[i], (n->nkeys - i) * sizeof(long));
+	memmove(&n->u.child[i + 2], &n->u.child[i + 1],
+		(n->nkeys - i) * sizeof(struct node *));
+	n->keys[i] = sep;
+	n->u.child[i + 1] = child;
+	if (++n->nkeys < MAXKEYS) {
+		return NULL;
+	}
+	// Full: the middle key moves up, and the keys after it to a new node
+	right = new_node(0);
+	right->nkeys = n->nkeys - half - 1;
+	memcpy(right->keys, &n->keys[half + 1], right->nkeys * sizeof(long));
+	memcpy(right->u.child, &n->u.child[half + 1],
+	       (right->nkeys + 1) * sizeof(struct node *));
+	*up = n->keys[half];
+	n->nkeys = half;
+	return right;
+}
+
+void tree_insert(long key, long val) {
+	long sep;
+	struct node *right = insert(root, key, val, &sep);
+
+	if (right != NULL) {
+		struct node *r = new_node(0);
+		r->nkeys = 1;
+		r->keys[0] = sep;
+		r->u.child[0] = root;
+		r->u.child[1] = right;
+		root = r;
+	}
+}
+
+/* The leaf that key is in, if it is in the tree. */
+struct node *find_leaf(long key) {
+	struct node *n = root;
+
+	while (!n->leaf) {
+		n = n->u.child[upper(n, key)];
+	}
+	return n;
+}
+
+int lookup(long key, long *val) {
+	struct node *n = find_leaf(key);
+	int i = upper(n, key) - 1;
+
+	if (i >= 0 && n->keys[i] == key) {
+		*val = n->u.l.vals[i].v;
+		return 1;
+	}
+	return 0;
+}
+
+/* Sums the values of the len keys from key on. */
+long scan(long key, long len) {
+	struct node *n = find_leaf(key);
+	int i = upper(n, key - 1);
+	long sum = 0;
+
+	while (n != NULL && len > 0) {
+		for (; i < n->nkeys && len > 0; i++, len--) {
+			sum += n->u.l.vals[i].v;
+		}
+		n = n->u.l.next;
+		i = 0;
+	}
+	return sum;
+}
+
+int main(int argc, char ** argv) {
+	long nkeys, nlookups, nscans, scan_len = 100, i, val, found = 0, sum = 0;
+	long *keys;
+	/* Markers used to bound trace regions of interest */
+	volatile char MARKER_START, MARKER_END;
+	/* Record marker addresses */
+	FILE* marker_fp = fopen("btree.marker","w");
+	if(marker_fp == NULL ) {
+		perror("Couldn't open marker file:");
+		exit(1);
+	}
+	fprintf(marker_fp, "%p %p", &MARKER_START, &MARKER_END );
+	fclose(marker_fp);
+
+	if (argc < 4 || argc > 5) {
+		fprintf(stderr, "usage: %s <keys> <lookups> <scans> [scan length]\n",
+			argv[0]);
+		exit(1);
+	}
+	nkeys = strtol(argv[1], NULL, 10);
+	nlookups = strtol(argv[2], NULL, 10);
+	nscans = strtol(argv[3], NULL, 10);
+	if (argc == 5) {
+		scan_len = strtol(argv[4], NULL, 10);
+	}
+
+	// Keys are 0, 2, 4, ... inserted in random order
+	srandom(1);
+	if ((keys = malloc(nkeys * sizeof(long))) == NULL) {
+		fprintf(stderr, "Can't allocate storage!\n");
+		exit(1);
+	}
+	for (i = 0; i < nkeys; i++) {
+		keys[i] = 2 * i;
+	}
+	for (i = nkeys - 1; i > 0; i--) {
+		long j = random() % (i + 1), t = keys[i];
+		keys[i] = keys[j];
+		keys[j] = t;
+	}
+
+	MARKER_START = 33;
+	root = new_node(1);
+	for (i = 0; i < nkeys; i++) {
+		tree_insert(keys[i], keys[i] / 2);
+	}
+	for (i = 0; i < nlookups; i++) {
+		found += lookup(random() % (2 * nkeys), &val);
+	}
+	for (i = 0; i < nscans; i++) {
+		sum += scan(random() % (2 * nkeys), scan_len);
+	}
+	MARKER_END = 34;
+
+	printf("%ld nodes, %ld of %ld lookups found, scans summed %ld\n",
+	       nodes, found, nlookups, sum);
+	free(keys);
+	return 0;
+}
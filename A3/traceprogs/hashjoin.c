@@ -0,0 +1,127 @@
+/* File:     Hash join
+ *
+ * Purpose:  Join two relations on their key with a hash table, the way a
+ *           database does an equi-join: build a table on the smaller
+ *           relation, then probe it with every row of the larger one.
+ *           The build scans R sequentially and writes buckets all over the
+ *           table; the probe scans S sequentially and reads random buckets
+ *           and the R rows they chain to.
+ *
+ * Compile:  gcc -g -Wall -o hashjoin hashjoin.c
+ * Run:      ./hashjoin <build rows> <probe rows> [match percent]
+ *
+ * Output:   The number of matching pairs.
+ *
+ * Notes:
+ * 1.  A match percent of p (default 50) makes p% of the probe keys keys
+ *     of R; the rest miss.
+ * 2.  Rows are padded to 128 bytes, so 32 fit in a page.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PAD 112
+
+struct row {
+	long key;
+	long next;           // Next row of R in the same bucket, or -1
+	char payload[PAD];
+};
+
+struct row *R, *S;
+long *buckets;
+long nbuckets;
+
+/* Scatters the keys so that nearby keys land in different buckets. */
+static unsigned long hash(long key) {
+	return (unsigned long)key * 0x9e3779b97f4a7c15UL >> 17;
+}
+
+void build(long nr) {
+	long i;
+
+	for (i = 0; i < nbuckets; i++) {
+		buckets[i] = -1;
+	}
+	for (i = 0; i < nr; i++) {
+		long b = hash(R[i].key) % nbuckets;
+		R[i].next = buckets[b];
+		buckets[b] = i;
+	}
+}
+
+long probe(long ns) {
+	long i, j, matches = 0;
+
+	for (i = 0; i < ns; i++) {
+		long b = hash(S[i].key) % nbuckets;
+		for (j = buckets[b]; j >= 0; j = R[j].next) {
+			if (R[j].key == S[i].key) {
+				matches++;
+				S[i].payload[0] = R[j].payload[0];
+			}
+		}
+	}
+	return matches;
+}
+
+int main(int argc, char ** argv) {
+	long nr, ns, i, matches;
+	int match_pct = 50;
+	/* Markers used to bound trace regions of interest */
+	volatile char MARKER_START, MARKER_END;
+	/* Record marker addresses */
+	FILE* marker_fp = fopen("hashjoin.marker","w");
+	if(marker_fp == NULL ) {
+		perror("Couldn't open marker file:");
+		exit(1);
+	}
+	fprintf(marker_fp, "%p %p", &MARKER_START, &MARKER_END );
+	fclose(marker_fp);
+
+	if (argc < 3 || argc > 4) {
+		fprintf(stderr, "usage: %s <build rows> <probe rows> [match percent]\n",
+			argv[0]);
+		exit(1);
+	}
+	nr = strtol(argv[1], NULL, 10);
+	ns = strtol(argv[2], NULL, 10);
+	if (argc == 4) {
+		match_pct = strtol(argv[3], NULL, 10);
+	}
+	nbuckets = nr;
+	R = malloc(nr * sizeof(struct row));
+	S = malloc(ns * sizeof(struct row));
+	buckets = malloc(nbuckets * sizeof(long));
+	if (R == NULL || S == NULL || buckets == NULL) {
+		fprintf(stderr, "Can't allocate storage!\n");
+		exit(1);
+	}
+
+	// R holds the even keys 0..2nr in random order; S probes with keys of
+	// R or odd keys, which miss
+	srandom(1);
+	for (i = 0; i < nr; i++) {
+		R[i].key = 2 * i;
+	}
+	for (i = nr - 1; i > 0; i--) {
+		long j = random() % (i + 1), t = R[i].key;
+		R[i].key = R[j].key;
+		R[j].key = t;
+	}
+	for (i = 0; i < ns; i++) {
+		S[i].key = 2 * (random() % nr) + (random() % 100 >= match_pct);
+	}
+
+	MARKER_START = 33;
+	build(nr);
+	matches = probe(ns);
+	MARKER_END = 34;
+
+	printf("%ld matches\n", matches);
+	free(R);
+	free(S);
+	free(buckets);
+	return 0;
+}
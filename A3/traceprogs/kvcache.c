@@ -0,0 +1,206 @@
+/* File:     Key-value cache with Zipfian keys
+ *
+ * Purpose:  Serve gets and sets against an in-memory key-value cache, like
+ *           memcached, with keys drawn from a Zipfian distribution so a
+ *           few keys are very popular and most are rarely asked for. The
+ *           cache is a chained hash table with an LRU list, and evicts the
+ *           least recently used item once it holds its capacity.
+ *
+ * Compile:  gcc -g -Wall -o kvcache kvcache.c -lm
+ * Run:      ./kvcache <keys> <requests> [theta] [capacity] [set percent]
+ *
+ * Output:   The hit rate of the gets.
+ *
+ * Notes:
+ * 1.  theta (default 0.99, as in YCSB) sets the skew: 0 is uniform, and
+ *     values near 1 send most requests to the most popular keys.
+ * 2.  capacity defaults to a quarter of the keys; set percent to 10.
+ * 3.  Items are 256 bytes, 16 to a page, and take slots in the order
+ *     their keys are first set, until the cache is full.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define VALSIZE 216
+
+struct item {
+	long key;
+	struct item *hnext;          // Next item in the hash chain
+	struct item *prev, *next;    // LRU list, most recent first
+	char value[VALSIZE];
+};
+
+struct item *items;      // Storage for capacity items
+long nitems;
+struct item **table;
+long nbuckets;
+struct item lru;         // Head of the LRU list
+
+// Zipfian generator (Gray et al., "Quickly generating billion-record
+// synthetic databases", as used by YCSB)
+double zipf_theta, zipf_alpha, zipf_eta, zipf_zetan;
+long zipf_n;
+
+void zipf_init(long n, double theta) {
+	double zeta2 = 0;
+	long i;
+
+	zipf_n = n;
+	zipf_theta = theta;
+	zipf_zetan = 0;
+	for (i = 1; i <= n; i++) {
+		zipf_zetan += 1 / pow(i, theta);
+	}
+	for (i = 1; i <= 2; i++) {
+		zeta2 += 1 / pow(i, theta);
+	}
+	zipf_alpha = 1 / (1 - theta);
+	zipf_eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf_zetan);
+}
+
+/* Returns a rank from 0 (the most popular) to n - 1. */
+long zipf_next() {
+	double u = (double)random() / RAND_MAX;
+	double uz = u * zipf_zetan;
+
+	if (uz < 1) {
+		return 0;
+	}
+	if (uz < 1 + pow(0.5, zipf_theta)) {
+		return 1;
+	}
+	return (long)(zipf_n * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha)) % zipf_n;
+}
+
+static long bucket(long key) {
+	return (unsigned long)key * 0x9e3779b97f4a7c15UL % nbuckets;
+}
+
+static void lru_unlink(struct item *it) {
+	it->prev->next = it->next;
+	it->next->prev = it->prev;
+}
+
+static void lru_push(struct item *it) {
+	it->next = lru.next;
+	it->prev = &lru;
+	lru.next->prev = it;
+	lru.next = it;
+}
+
+struct item *find(long key) {
+	struct item *it;
+
+	for (it = table[bucket(key)]; it != NULL; it = it->hnext) {
+		if (it->key == key) {
+			return it;
+		}
+	}
+	return NULL;
+}
+
+/* Removes the least recently used item from the table and returns it. */
+struct item *evict() {
+	struct item *it = lru.prev, **pp;
+
+	lru_unlink(it);
+	for (pp = &table[bucket(it->key)]; *pp != it; pp = &(*pp)->hnext) {
+	}
+	*pp = it->hnext;
+	return it;
+}
+
+void set(long key, long capacity) {
+	struct item *it = find(key);
+
+	if (it != NULL) {
+		lru_unlink(it);
+	} else {
+		it = nitems < capacity ? &items[nitems++] : evict();
+		it->key = key;
+		it->hnext = table[bucket(key)];
+		table[bucket(key)] = it;
+	}
+	it->value[0] = (char)key;
+	lru_push(it);
+}
+
+int get(long key) {
+	struct item *it = find(key);
+
+	if (it == NULL) {
+		return 0;
+	}
+	lru_unlink(it);
+	lru_push(it);
+	return it->value[0] == (char)key;
+}
+
+int main(int argc, char ** argv) {
+	long nkeys, nreqs, capacity, i, gets = 0, hits = 0;
+	double theta = 0.99;
+	int set_pct = 10;
+	/* Markers used to bound trace regions of interest */
+	volatile char MARKER_START, MARKER_END;
+	/* Record marker addresses */
+	FILE* marker_fp = fopen("kvcache.marker","w");
+	if(marker_fp == NULL ) {
+		perror("Couldn't open marker file:");
+		exit(1);
+	}
+	fprintf(marker_fp, "%p %p", &MARKER_START, &MARKER_END );
+	fclose(marker_fp);
+
+	if (argc < 3 || argc > 6) {
+		fprintf(stderr, "usage: %s <keys> <requests> [theta] [capacity] "
+			"[set percent]\n", argv[0]);
+		exit(1);
+	}
+	nkeys = strtol(argv[1], NULL, 10);
+	nreqs = strtol(argv[2], NULL, 10);
+	if (argc > 3) {
+		theta = strtod(argv[3], NULL);
+	}
+	capacity = argc > 4 ? strtol(argv[4], NULL, 10) : nkeys / 4;
+	if (argc > 5) {
+		set_pct = strtol(argv[5], NULL, 10);
+	}
+	if (nkeys <= 2 || capacity <= 0 || theta < 0 || theta == 1) {
+		fprintf(stderr, "need more than 2 keys, a capacity, and theta >= 0, != 1\n");
+		exit(1);
+	}
+	nbuckets = capacity;
+	items = malloc(capacity * sizeof(struct item));
+	table = calloc(nbuckets, sizeof(struct item *));
+	if (items == NULL || table == NULL) {
+		fprintf(stderr, "Can't allocate storage!\n");
+		exit(1);
+	}
+	lru.next = lru.prev = &lru;
+	srandom(1);
+	zipf_init(nkeys, theta);
+
+	MARKER_START = 33;
+	for (i = 0; i < nreqs; i++) {
+		long key = zipf_next();
+
+		if (random() % 100 < set_pct) {
+			set(key, capacity);
+		} else {
+			gets++;
+			if (get(key)) {
+				hits++;
+			} else {
+				set(key, capacity);   // Fill on a miss
+			}
+		}
+	}
+	MARKER_END = 34;
+
+	printf("%ld gets, hit rate %.2f%%\n", gets, gets ? 100.0 * hits / gets : 0.0);
+	free(items);
+	free(table);
+	return 0;
+}
@@ -0,0 +1,164 @@
+/* File:     LSM-tree compaction
+ *
+ * Purpose:  Merge sorted runs into one, the way a log-structured merge
+ *           (LSM) tree compacts its levels: runs are written as sorted
+ *           batches of puts arrive, then a k-way merge streams through all
+ *           of them at once, keeps the newest version of each key, and
+ *           writes the merged run out. Every run is read sequentially, but
+ *           k of them are read at once, interleaved.
+ *
+ * Compile:  gcc -g -Wall -o lsm lsm.c
+ * Run:      ./lsm <runs> <entries per run> [key space]
+ *
+ * Output:   How many entries the merged run holds.
+ *
+ * Notes:
+ * 1.  Keys are drawn from 0 to key space - 1 (default 4 times the total
+ *     number of entries), so some keys are overwritten by later runs.
+ * 2.  Entries are 64 bytes, 64 to a page.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PAD 48
+
+struct entry {
+	long key;
+	long seq;            // Newer puts have higher sequence numbers
+	char value[PAD];
+};
+
+struct run {
+	struct entry *e;
+	long len;
+	long pos;            // Next entry to merge
+};
+
+struct run *runs;
+int *heap;               // Runs by their next key, smallest first
+int heap_len;
+
+static int cmp_entry(const void *a, const void *b) {
+	const struct entry *x = a, *y = b;
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/* True if run a's next entry sorts before run b's: by key, and newest
+ * first for the same key.
+ */
+static int before(int a, int b) {
+	struct entry *x = &runs[a].e[runs[a].pos], *y = &runs[b].e[runs[b].pos];
+	return x->key < y->key || (x->key == y->key && x->seq > y->seq);
+}
+
+static void sift_down(int i) {
+	int r = heap[i];
+
+	while (2 * i + 1 < heap_len) {
+		int c = 2 * i + 1;
+		if (c + 1 < heap_len && before(heap[c + 1], heap[c])) {
+			c++;
+		}
+		if (!before(heap[c], r)) {
+			break;
+		}
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = r;
+}
+
+/* Merges the runs into out, keeping the newest entry of each key.
+ * Returns the number of entries written.
+ */
+long merge(int k, struct entry *out) {
+	long n = 0;
+	int i;
+
+	heap_len = k;
+	for (i = 0; i < k; i++) {
+		heap[i] = i;
+	}
+	for (i = k / 2 - 1; i >= 0; i--) {
+		sift_down(i);
+	}
+	while (heap_len > 0) {
+		struct run *r = &runs[heap[0]];
+		struct entry *e = &r->e[r->pos];
+
+		// The newest version of a key comes out first
+		if (n == 0 || out[n - 1].key != e->key) {
+			out[n++] = *e;
+		}
+		if (++r->pos == r->len) {
+			heap[0] = heap[--heap_len];
+		}
+		if (heap_len > 0) {
+			sift_down(0);
+		}
+	}
+	return n;
+}
+
+int main(int argc, char ** argv) {
+	long len, space, i, seq = 0, merged;
+	struct entry *out;
+	int k, j;
+	/* Markers used to bound trace regions of interest */
+	volatile char MARKER_START, MARKER_END;
+	/* Record marker addresses */
+	FILE* marker_fp = fopen("lsm.marker","w");
+	if(marker_fp == NULL ) {
+		perror("Couldn't open marker file:");
+		exit(1);
+	}
+	fprintf(marker_fp, "%p %p", &MARKER_START, &MARKER_END );
+	fclose(marker_fp);
+
+	if (argc < 3 || argc > 4) {
+		fprintf(stderr, "usage: %s <runs> <entries per run> [key space]\n",
+			argv[0]);
+		exit(1);
+	}
+	k = strtol(argv[1], NULL, 10);
+	len = strtol(argv[2], NULL, 10);
+	space = argc == 4 ? strtol(argv[3], NULL, 10) : 4 * k * len;
+	runs = malloc(k * sizeof(struct run));
+	heap = malloc(k * sizeof(int));
+	out = malloc(k * len * sizeof(struct entry));
+	if (k <= 0 || runs == NULL || heap == NULL || out == NULL) {
+		fprintf(stderr, "Can't allocate storage!\n");
+		exit(1);
+	}
+
+	srandom(1);
+	MARKER_START = 33;
+	// Flush each batch of puts as a sorted run
+	for (j = 0; j < k; j++) {
+		runs[j].e = malloc(len * sizeof(struct entry));
+		if (runs[j].e == NULL) {
+			fprintf(stderr, "Can't allocate storage!\n");
+			exit(1);
+		}
+		runs[j].len = len;
+		runs[j].pos = 0;
+		for (i = 0; i < len; i++) {
+			runs[j].e[i].key = random() % space;
+			runs[j].e[i].seq = seq++;
+			runs[j].e[i].value[0] = (char)i;
+		}
+		qsort(runs[j].e, len, sizeof(struct entry), cmp_entry);
+	}
+	merged = merge(k, out);
+	MARKER_END = 34;
+
+	printf("merged %d runs of %ld entries into %ld entries\n", k, len, merged);
+	for (j = 0; j < k; j++) {
+		free(runs[j].e);
+	}
+	free(runs);
+	free(heap);
+	free(out);
+	return 0;
+}
@@ -0,0 +1,563 @@
+/*
+ * pgtrace: page-granularity trace capture at close to native speed.
+ *
+ * Loaded with LD_PRELOAD (see pgrun), it makes the program's heap, stack
+ * and anonymous mappings inaccessible with mprotect, and catches the first
+ * touch of each page in a SIGSEGV handler. The handler writes the page to
+ * the trace and opens it up again: read-only after a load, so that a later
+ * store is still seen, and read-write after a store. A timer on the
+ * program's user CPU time ends each epoch by protecting everything again,
+ * so a page appears in the trace at most twice per epoch instead of once
+ * per access as with lackey. Time spent handling faults is system time,
+ * so it does not make epochs shorter as the faults grow.
+ *
+ * The trace is written in the format sim reads ("L addr", "S addr" or
+ * "M addr" for a store to a page loaded earlier in the epoch), with page
+ * addresses like fastslim.py produces. Code pages are not traced. sim
+ * only simulates 36-bit addresses, so addresses are cut down to their low
+ * bits; the heap, stack and mappings are far enough apart that their pages
+ * are very unlikely to collide.
+ *
+ * Settings come from the environment:
+ *   PGTRACE_FILE      the trace file (default pgtrace.ref)
+ *   PGTRACE_EPOCH     epoch length in microseconds of the program's user
+ *                     CPU time (default 10000)
+ *   PGTRACE_ADDRBITS  address bits kept in the trace (default 36)
+ *
+ * Limitations: only the main thread is traced, and system calls that
+ * access memory not touched by the program since the epoch began fail
+ * with EFAULT instead of faulting, since the kernel does not deliver
+ * SIGSEGV for them. read and write are wrapped to touch their buffers
+ * first; other calls are not. userfaultfd would avoid this, but it
+ * cannot re-arm read tracking without discarding the page, and is often
+ * not available to unprivileged users.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define PAGE_SIZE     4096UL
+#define PAGE_ALIGN(a) ((uintptr_t)(a) & ~(PAGE_SIZE - 1))
+#define MAXREGIONS    256
+#define OUTBUF_SIZE   (64 * 1024)
+#define ALTSTACK_SIZE (64 * 1024)
+#define LOADED_SLOTS  8192 // Must be a power of 2
+
+struct region {
+	uintptr_t start;
+	uintptr_t end;
+};
+
+// Anonymous mappings that existed before the program started (libc's
+// data, thread-local storage, our own state), which are never protected.
+static struct region excluded[MAXREGIONS];
+static int nexcluded;
+
+// The regions protected at the start of the current and the last epoch
+static struct region tracked[MAXREGIONS];
+static int ntracked;
+static struct region prev[MAXREGIONS];
+static int nprev;
+
+// Pages loaded in the current epoch, so that a store to one of them is
+// written as a modify. Entries from older epochs are simply stale.
+static struct {
+	uintptr_t page;
+	unsigned epoch;
+} loaded[LOADED_SLOTS];
+static unsigned epoch = 1;
+
+static uintptr_t addr_mask = (1UL << 36) - 1;
+static int out_fd = -1;
+static char outbuf[OUTBUF_SIZE];
+static size_t outlen;
+static volatile sig_atomic_t active;
+
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+
+/* Writes out the buffered trace lines. Async-signal-safe. */
+static void flush_out(void) {
+	size_t done = 0;
+
+	while (done < outlen) {
+		ssize_t n = real_write(out_fd, outbuf + done, outlen - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		done += n;
+	}
+	outlen = 0;
+}
+
+/* Appends "type addr" to the trace. Async-signal-safe. */
+static void emit(char type, uintptr_t addr) {
+	static const char hex[] = "0123456789abcdef";
+	char tmp[2 * sizeof(uintptr_t)];
+	int n = 0;
+
+	if (outlen + sizeof(tmp) + 3 > OUTBUF_SIZE) {
+		flush_out();
+	}
+	addr &= addr_mask;
+	outbuf[outlen++] = type;
+	outbuf[outlen++] = ' ';
+	do {
+		tmp[n++] = hex[addr & 0xf];
+		addr >>= 4;
+	} while (addr);
+	while (n > 0) {
+		outbuf[outlen++] = tmp[--n];
+	}
+	outbuf[outlen++] = '\n';
+}
+
+/* Returns the slot for page in the loaded table. */
+static unsigned loaded_slot(uintptr_t page) {
+	return (page / PAGE_SIZE * 0x9E3779B97F4A7C15ull) >> 32 & (LOADED_SLOTS - 1);
+}
+
+/* Returns 1 if addr lies in one of the n regions in r. */
+static int in_regions(const struct region *r, int n, uintptr_t addr) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (addr >= r[i].start && addr < r[i].end) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static uintptr_t parse_hex(const char **s) {
+	uintptr_t v = 0;
+
+	for (;; (*s)++) {
+		char c = **s;
+		if (c >= '0' && c <= '9') {
+			v = v * 16 + c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			v = v * 16 + c - 'a' + 10;
+		} else {
+			return v;
+		}
+	}
+}
+
+/*
+ * Calls fn on every line of /proc/self/maps, with the range of the mapping,
+ * whether it is writable, and its name ("" for anonymous mappings). Uses
+ * only system calls and static buffers, so it can run in the timer handler.
+ */
+static void scan_maps(void (*fn)(uintptr_t, uintptr_t, int, const char *)) {
+	static char buf[16 * 1024];
+	static char line[512];
+	size_t linelen = 0;
+	ssize_t n, i;
+	int fd;
+
+	if ((fd = open("/proc/self/maps", O_RDONLY)) < 0) {
+		return;
+	}
+	while ((n = real_read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++) {
+			const char *s;
+			uintptr_t start, end;
+			int writable, field;
+
+			if (buf[i] != '\n') {
+				if (linelen < sizeof(line) - 1) {
+					line[linelen++] = buf[i];
+				}
+				continue;
+			}
+			line[linelen] = '\0';
+			linelen = 0;
+
+			// start-end perms offset dev inode name
+			s = line;
+			start = parse_hex(&s);
+			s++;
+			end = parse_hex(&s);
+			s++;
+			writable = s[1] == 'w';
+			for (field = 0; field < 4 && *s; field++) {
+				while (*s && *s != ' ') {
+					s++;
+				}
+				while (*s == ' ') {
+					s++;
+				}
+			}
+			fn(start, end, writable, s);
+		}
+	}
+	close(fd);
+}
+
+static void exclude_region(uintptr_t start, uintptr_t end, int writable,
+			   const char *name) {
+	if (name[0] == '\0' && nexcluded < MAXREGIONS) {
+		excluded[nexcluded].start = start;
+		excluded[nexcluded].end = end;
+		nexcluded++;
+	}
+}
+
+/*
+ * Returns the end of the first part of [a, end) that is not covered by
+ * the n regions in r, and moves a to its start (to end if there is none).
+ */
+static uintptr_t next_gap(uintptr_t *a, uintptr_t end,
+			  const struct region *r, int n) {
+	uintptr_t b = end;
+	int i, moved;
+
+	do {
+		moved = 0;
+		for (i = 0; i < n; i++) {
+			if (*a >= r[i].start && *a < r[i].end) {
+				*a = r[i].end;
+				moved = 1;
+			}
+		}
+	} while (moved && *a < end);
+	if (*a >= end) {
+		*a = end;
+		return end;
+	}
+	for (i = 0; i < n; i++) {
+		if (r[i].start > *a && r[i].start < b) {
+			b = r[i].start;
+		}
+	}
+	return b;
+}
+
+/* Returns 1 if a mapping named name may belong to the program. */
+static int program_mapping(const char *name) {
+	return name[0] == '\0' || strcmp(name, "[heap]") == 0
+		|| strcmp(name, "[stack]") == 0;
+}
+
+/*
+ * Adds a mapping to the tracked regions if it belongs to the program:
+ * the heap, the stack, or an anonymous mapping made after we started.
+ * Mappings we protected show up without write permission, so those are
+ * kept only if they were tracked in the last epoch. The kernel may merge
+ * a new mapping with an excluded one, so only the parts outside the
+ * excluded regions are added, and adjacent parts are merged, since
+ * mprotect splits them.
+ */
+static void track_region(uintptr_t start, uintptr_t end, int writable,
+			 const char *name) {
+	uintptr_t a = start, b;
+
+	if (!program_mapping(name)
+	    || (!writable && !in_regions(prev, nprev, start))) {
+		return;
+	}
+	while ((b = next_gap(&a, end, excluded, nexcluded)) > a) {
+		if (ntracked > 0 && tracked[ntracked - 1].end == a) {
+			tracked[ntracked - 1].end = b;
+		} else if (ntracked < MAXREGIONS) {
+			tracked[ntracked].start = a;
+			tracked[ntracked].end = b;
+			ntracked++;
+		}
+		a = b;
+	}
+}
+
+/*
+ * Starts a new epoch: finds the program's regions again, since the heap
+ * and mappings come and go, and protects all of them. The stack pages the
+ * interrupted code is using right now are left open, so that the red zone
+ * below the stack pointer stays usable, and so is the lowest page of the
+ * stack, since the kernel only grows the stack into a page it can access.
+ */
+static void protect_all(uintptr_t sp) {
+	uintptr_t lo = PAGE_ALIGN(sp - 128);
+	uintptr_t hi = PAGE_ALIGN(sp) + PAGE_SIZE;
+	int i;
+
+	memcpy(prev, tracked, ntracked * sizeof(struct region));
+	nprev = ntracked;
+	ntracked = 0;
+	scan_maps(track_region);
+	epoch++;
+
+	for (i = 0; i < ntracked; i++) {
+		uintptr_t start = tracked[i].start, end = tracked[i].end;
+
+		if (sp >= start && sp < end) {
+			start += PAGE_SIZE;
+			if (lo > start) {
+				mprotect((void *)start, lo - start, PROT_NONE);
+			}
+			if (end > hi) {
+				mprotect((void *)hi, end - hi, PROT_NONE);
+			}
+		} else {
+			mprotect((void *)start, end - start, PROT_NONE);
+		}
+	}
+}
+
+/* Opens up every tracked region again. */
+static void unprotect_all(void) {
+	int i;
+
+	for (i = 0; i < ntracked; i++) {
+		mprotect((void *)tracked[i].start, tracked[i].end - tracked[i].start,
+			 PROT_READ | PROT_WRITE);
+	}
+}
+
+/*
+ * Opens up one page. Every page opened splits a mapping, and once the
+ * process reaches its limit on mappings mprotect fails, so the rest of the
+ * epoch is then left untraced rather than faulting on the page forever.
+ */
+static void open_page(uintptr_t page, int prot) {
+	if (mprotect((void *)page, PAGE_SIZE, prot) != 0) {
+		unprotect_all();
+	}
+}
+
+static void segv_handler(int sig, siginfo_t *si, void *ctx) {
+	uintptr_t page = PAGE_ALIGN(si->si_addr);
+	unsigned slot = loaded_slot(page);
+	int store = 1;
+#if defined(__x86_64__)
+	store = (((ucontext_t *)ctx)->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+#endif
+
+	if (!active || si->si_code != SEGV_ACCERR
+	    || !in_regions(tracked, ntracked, (uintptr_t)si->si_addr)) {
+		// A real fault: let it happen again with the default action
+		signal(SIGSEGV, SIG_DFL);
+		return;
+	}
+
+	if (store) {
+		open_page(page, PROT_READ | PROT_WRITE);
+		emit(loaded[slot].page == page && loaded[slot].epoch == epoch
+		     ? 'M' : 'S', page);
+	} else {
+		open_page(page, PROT_READ);
+		loaded[slot].page = page;
+		loaded[slot].epoch = epoch;
+		emit('L', page);
+	}
+}
+
+static void timer_handler(int sig, siginfo_t *si, void *ctx) {
+	uintptr_t sp = 0;
+#if defined(__x86_64__)
+	sp = ((ucontext_t *)ctx)->uc_mcontext.gregs[REG_RSP];
+#else
+	sp = (uintptr_t)&sp;
+#endif
+	if (active) {
+		protect_all(sp);
+	}
+}
+
+/*
+ * Protects the parts of a new mapping, or of the heap after it grew, that
+ * are not tracked yet, without starting a new epoch.
+ */
+static void track_new_region(uintptr_t start, uintptr_t end, int writable,
+			     const char *name) {
+	uintptr_t a = start, b, c;
+
+	if (!program_mapping(name) || !writable) {
+		return;
+	}
+	while ((b = next_gap(&a, end, excluded, nexcluded)) > a) {
+		while ((c = next_gap(&a, b, tracked, ntracked)) > a
+		       && ntracked < MAXREGIONS) {
+			mprotect((void *)a, c - a, PROT_NONE);
+			tracked[ntracked].start = a;
+			tracked[ntracked].end = c;
+			ntracked++;
+			a = c;
+		}
+		a = b;
+	}
+}
+
+/*
+ * The heap and the mappings malloc makes for large blocks are only found
+ * at the next epoch, which a short program may never reach, so memory
+ * that malloc hands out from outside the tracked regions is tracked right
+ * away. glibc calls these for its own allocations too.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static void *check_new(void *p) {
+	sigset_t set, old;
+
+	if (p != NULL && active && !in_regions(tracked, ntracked, (uintptr_t)p)) {
+		sigemptyset(&set);
+		sigaddset(&set, SIGVTALRM);
+		sigprocmask(SIG_BLOCK, &set, &old);
+		scan_maps(track_new_region);
+		sigprocmask(SIG_SETMASK, &old, NULL);
+	}
+	return p;
+}
+
+void *malloc(size_t size) {
+	return check_new(__libc_malloc(size));
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	return check_new(__libc_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size) {
+	return check_new(__libc_realloc(ptr, size));
+}
+
+/*
+ * The program's own reads and writes fault in the kernel rather than
+ * raising SIGSEGV, so touch the buffer first: that faults the pages in as
+ * the program would have, and records them. The epoch timer is blocked
+ * until the call is done, so the pages stay open. Returns 1 if it was
+ * blocked, and the mask to restore in old.
+ */
+static int touch(const void *buf, size_t len, int store, sigset_t *old) {
+	volatile char *p = (volatile char *)buf;
+	sigset_t set;
+	uintptr_t a;
+
+	if (!active || len == 0) {
+		return 0;
+	}
+	sigemptyset(&set);
+	sigaddset(&set, SIGVTALRM);
+	sigprocmask(SIG_BLOCK, &set, old);
+	for (a = PAGE_ALIGN(buf); a < (uintptr_t)buf + len; a += PAGE_SIZE) {
+		volatile char *q = (uintptr_t)p > a ? p : (volatile char *)a;
+		if (store) {
+			*q = *q;
+		} else {
+			(void)*q;
+		}
+	}
+	return 1;
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+	sigset_t old;
+	int blocked = touch(buf, count, 1, &old);
+	ssize_t ret = real_read(fd, buf, count);
+	int saved = errno;
+
+	if (blocked) {
+		sigprocmask(SIG_SETMASK, &old, NULL);
+	}
+	errno = saved;
+	return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+	sigset_t old;
+	int blocked = touch(buf, count, 0, &old);
+	ssize_t ret = real_write(fd, buf, count);
+	int saved = errno;
+
+	if (blocked) {
+		sigprocmask(SIG_SETMASK, &old, NULL);
+	}
+	errno = saved;
+	return ret;
+}
+
+__attribute__((constructor))
+static void pgtrace_start(void) {
+	const char *file = getenv("PGTRACE_FILE");
+	const char *epoch_env = getenv("PGTRACE_EPOCH");
+	const char *bits_env = getenv("PGTRACE_ADDRBITS");
+	long usec = epoch_env ? atol(epoch_env) : 10000;
+	int bits = bits_env ? atoi(bits_env) : 36;
+	struct sigaction sa;
+	struct itimerval it;
+	stack_t ss;
+
+	real_read = dlsym(RTLD_NEXT, "read");
+	real_write = dlsym(RTLD_NEXT, "write");
+	if ((out_fd = open(file ? file : "pgtrace.ref",
+			   O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		return;
+	}
+	if (usec <= 0) {
+		usec = 10000;
+	}
+	if (bits > 12 && bits < 64) {
+		addr_mask = (1UL << bits) - 1;
+	}
+
+	// The handlers run on their own stack, since the program's is
+	// protected
+	ss.ss_sp = mmap(NULL, ALTSTACK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ss.ss_size = ALTSTACK_SIZE;
+	ss.ss_flags = 0;
+	if (ss.ss_sp == MAP_FAILED || sigaltstack(&ss, NULL) != 0) {
+		close(out_fd);
+		out_fd = -1;
+		return;
+	}
+
+	// Everything anonymous that exists now is ours or libc's
+	scan_maps(exclude_region);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaddset(&sa.sa_mask, SIGVTALRM);
+	sa.sa_sigaction = segv_handler;
+	sigaction(SIGSEGV, &sa, NULL);
+	sa.sa_sigaction = timer_handler;
+	sigaddset(&sa.sa_mask, SIGSEGV);
+	sigaction(SIGVTALRM, &sa, NULL);
+
+	it.it_interval.tv_sec = usec / 1000000;
+	it.it_interval.tv_usec = usec % 1000000;
+	it.it_value = it.it_interval;
+	active = 1;
+	protect_all((uintptr_t)__builtin_frame_address(0));
+	setitimer(ITIMER_VIRTUAL, &it, NULL);
+}
+
+__attribute__((destructor))
+static void pgtrace_stop(void) {
+	struct itimerval it;
+
+	if (!active) {
+		return;
+	}
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_VIRTUAL, &it, NULL);
+	active = 0;
+	unprotect_all();
+	flush_out();
+	close(out_fd);
+}
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "pagetable.h"
+
+/*
+ * Reference replacement algorithms (-V), run alongside the real one to
+ * check every eviction it makes. Each is the plainest version of its
+ * algorithm, kept simple enough to be obviously right, and with none of
+ * the state of the real one: it is told about every reference, and when
+ * the real algorithm picks a victim, picks its own and stops the run if
+ * they differ. So an optimized algorithm that passes on a trace made
+ * exactly the decisions the textbook one would have.
+ *
+ *  lru    the frame whose last reference is the oldest.
+ *  fifo   the frame whose page was loaded the longest ago.
+ *  clock  a hand sweeps the frames from where the last victim was,
+ *         clearing reference bits, and stops at the first frame without.
+ *  opt    the frame whose page is next referenced the furthest in the
+ *         future (by any process that maps it), with pages that are never
+ *         referenced again first. Ties go to the lowest frame.
+ *
+ * The references that stand in for PG_REF (clock) and for the time of the
+ * last reference (lru) or load (fifo) are kept here, so they do not share
+ * a bug with the real ones. Frames are only taken by evictions, so -V does
+ * not go with the page-out daemon (-H), which frees frames the algorithms
+ * are not told about.
+ *
+ * -V also checks the contents of pages, for every algorithm and with the
+ * page-out daemon as well. Each page starts with a version that access_mem
+ * bumps on every store, so a store that is lost, or that lands in a page
+ * another process can see, leaves a page whose version is not the number
+ * of stores its process made to it. The expected versions are kept here
+ * for each process and page; a fork gives the child its parent's.
+ */
+
+int verify = 0;
+int verify_count = 0;        // Evictions checked
+
+static const char *ref_alg;
+static int (*ref_victim)(void);
+static int *resident;        // 1 if a page has been referenced in the frame
+static long *last_use;       // Time of the frame's last reference (lru)
+static long *loaded;         // Time the frame's page was loaded (fifo)
+static unsigned char *ref_bit;
+static int hand;
+static long now;
+
+// Expected page versions, in an open-addressed table keyed by the page
+// tagged with its pid. Keys have VERSION_USED set, so 0 is an empty slot.
+#define VERSION_USED ((addr_t)1 << 63)
+struct page_version {
+	addr_t key;
+	int version;
+};
+static struct page_version *versions;
+static unsigned long versions_cap, versions_len;
+
+// The pages of the trace, tagged with their pid, for opt
+static addr_t *future;
+static long future_len;
+
+static int lru_victim(void) {
+	int i, victim = -1;
+
+	for (i = 0; i < (int)memsize; i++) {
+		if (resident[i] && (victim < 0 || last_use[i] < last_use[victim])) {
+			victim = i;
+		}
+	}
+	return victim;
+}
+
+static int fifo_victim(void) {
+	int i, victim = -1;
+
+	for (i = 0; i < (int)memsize; i++) {
+		if (resident[i] && (victim < 0 || loaded[i] < loaded[victim])) {
+			victim = i;
+		}
+	}
+	return victim;
+}
+
+static int clock_victim(void) {
+	while (ref_bit[hand]) {
+		ref_bit[hand] = 0;
+		hand = (hand + 1) % memsize;
+	}
+	return hand;
+}
+
+/* Index of the next reference to the page in frame by any process that
+ * maps it, or -1 if there is none.
+ */
+static long next_use(int frame) {
+	addr_t page = VADDR_ADDR(coremap.vaddr[frame]) >> PAGE_SHIFT;
+	long i;
+
+	for (i = now; i < future_len; i++) {
+		if ((coremap.mappers[frame] & PID_BIT(VADDR_PID(future[i])))
+		    && VADDR_ADDR(future[i]) == page) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int opt_victim(void) {
+	int i, victim = -1;
+	long when, furthest = -1;
+
+	for (i = 0; i < (int)memsize; i++) {
+		if (!resident[i]) {
+			continue;
+		}
+		when = next_use(i);
+		if (when < 0) {
+			return i;
+		}
+		if (when > furthest) {
+			furthest = when;
+			victim = i;
+		}
+	}
+	return victim;
+}
+
+/* Reads the pages of the trace for opt. */
+static void load_future(void) {
+	char buf[MAXLINE];
+	addr_t vaddr;
+	unsigned pid = 0;
+	long cap = 1024;
+	char type;
+	FILE *fp;
+
+	if ((fp = fopen(tracefile, "r")) == NULL) {
+		perror(tracefile);
+		exit(1);
+	}
+	future = malloc(cap * sizeof(addr_t));
+	while (future != NULL && fgets(buf, MAXLINE, fp) != NULL) {
+		if (buf[0] == '=' || buf[0] == 'F') {
+			continue;
+		}
+		if (buf[0] == 'X') {
+			sscanf(buf, "%c %u", &type, &pid);
+			continue;
+		}
+		sscanf(buf, "%c %lx", &type, &vaddr);
+		if (future_len == cap) {
+			cap *= 2;
+			future = realloc(future, cap * sizeof(addr_t));
+			if (future == NULL) {
+				break;
+			}
+		}
+		future[future_len++] = VADDR_TAG(pid, vaddr >> PAGE_SHIFT);
+	}
+	if (future == NULL) {
+		perror("Failed to allocate the trace for -V");
+		exit(1);
+	}
+	fclose(fp);
+}
+
+/*
+ * Sets up the reference version of alg. Returns 0, or -1 if there is none
+ * or it cannot be run (opt needs the tracefile).
+ */
+int verify_init(const char *alg) {
+	if (strcmp(alg, "lru") == 0) {
+		ref_victim = lru_victim;
+	} else if (strcmp(alg, "fifo") == 0) {
+		ref_victim = fifo_victim;
+	} else if (strcmp(alg, "clock") == 0) {
+		ref_victim = clock_victim;
+	} else if (strcmp(alg, "opt") == 0 && tracefile != NULL) {
+		ref_victim = opt_victim;
+		load_future();
+	} else {
+		return -1;
+	}
+	ref_alg = alg;
+	resident = calloc(memsize, sizeof(int));
+	last_use = calloc(memsize, sizeof(long));
+	loaded = calloc(memsize, sizeof(long));
+	ref_bit = calloc(memsize, sizeof(unsigned char));
+	if (!resident || !last_use || !loaded || !ref_bit) {
+		perror("Failed to allocate the reference algorithm");
+		exit(1);
+	}
+	return 0;
+}
+
+/* Returns the slot for key in the table of page versions, which is empty
+ * if the page has not been seen.
+ */
+static struct page_version *version_slot(addr_t key) {
+	unsigned long i = (key * 0x9E3779B97F4A7C15ull) >> 20;
+
+	for (i &= versions_cap - 1; versions[i].key != 0 && versions[i].key != key;
+	     i = (i + 1) & (versions_cap - 1)) {
+	}
+	return &versions[i];
+}
+
+/* Makes room in the table of page versions for n more pages. */
+static void versions_reserve(unsigned long n) {
+	struct page_version *old = versions;
+	unsigned long old_cap = versions_cap, i;
+
+	if ((versions_len + n) * 2 <= versions_cap) {
+		return;
+	}
+	if (versions_cap == 0) {
+		versions_cap = 1024;
+	}
+	while ((versions_len + n) * 2 > versions_cap) {
+		versions_cap *= 2;
+	}
+	if ((versions = calloc(versions_cap, sizeof(struct page_version))) == NULL) {
+		perror("Failed to allocate the page versions for -V");
+		exit(1);
+	}
+	for (i = 0; i < old_cap; i++) {
+		if (old[i].key != 0) {
+			*version_slot(old[i].key) = old[i];
+		}
+	}
+	free(old);
+}
+
+/*
+ * Checks that the current process's page at vaddr, which it references
+ * with type, holds version: the number of stores it has made to the page
+ * so far. Exits if it does not.
+ */
+void verify_data(addr_t vaddr, int version, char type) {
+	addr_t key = VADDR_TAG(cur_pid, vaddr >> PAGE_SHIFT) | VERSION_USED;
+	struct page_version *slot;
+
+	versions_reserve(1);
+	slot = version_slot(key);
+	if (slot->key == 0) {
+		slot->key = key;
+		versions_len++;
+	}
+	if (version != slot->version) {
+		fprintf(stderr, "Error: at reference %d, process %u found version "
+			"%d of page %lx, but has stored to it %d times\n", ref_count,
+			cur_pid, version, vaddr, slot->version);
+		exit(1);
+	}
+	if (type == 'S' || type == 'M') {
+		slot->version++;
+	}
+}
+
+/* Gives process child the page versions of the current process. */
+void verify_fork(unsigned child) {
+	unsigned long n = 0, i;
+
+	for (i = 0; i < versions_cap; i++) {
+		n += versions[i].key != 0 && VADDR_PID(versions[i].key & ~VERSION_USED) == cur_pid;
+	}
+	versions_reserve(n);
+	for (i = 0; i < versions_cap; i++) {
+		addr_t key = versions[i].key & ~VERSION_USED;
+		if (versions[i].key != 0 && VADDR_PID(key) == cur_pid) {
+			struct page_version *slot =
+				version_slot(VADDR_TAG(child, VADDR_ADDR(key)) | VERSION_USED);
+			slot->key = VADDR_TAG(child, VADDR_ADDR(key)) | VERSION_USED;
+			slot->version = versions[i].version;
+			versions_len++;
+		}
+	}
+}
+
+/* Tells the reference algorithm about a reference to the page in frame. */
+void verify_ref(int frame) {
+	if (ref_victim == NULL) {
+		return;
+	}
+	if (!resident[frame]) {
+		resident[frame] = 1;
+		loaded[frame] = now;
+	}
+	last_use[frame] = now;
+	ref_bit[frame] = 1;
+	now++;
+}
+
+/*
+ * Checks that frame, which the real algorithm picked to evict, is the
+ * reference algorithm's victim as well, and exits if it is not.
+ */
+void verify_evict(int frame) {
+	int expect;
+
+	if (ref_victim == NULL) {
+		return;
+	}
+	expect = ref_victim();
+
+	if (frame != expect) {
+		fprintf(stderr, "Error: at reference %ld, %s evicted frame %d, but "
+			"the reference %s evicts frame %d\n", now, ref_alg, frame,
+			ref_alg, expect);
+		exit(1);
+	}
+	resident[frame] = 0;
+	verify_count++;
+}
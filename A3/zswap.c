@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include "sim.h"
+#include "pagetable.h"
+
+//---------------------------------------------------------------------
+// Compressed swap cache (zswap).
+//
+// Dirty pages that are evicted are compressed and kept in a fixed-size
+// pool in memory, in front of the swapfile. A fault on a page in the pool
+// decompresses it straight into its new frame, without any swap I/O. When
+// the pool is full, the pages that have been in it longest are written
+// back to the swapfile to make room. Pages that do not compress to 3/4 of
+// a page or less are not worth keeping, and go straight to swap.
+//
+// Loads are exclusive: the compressed copy is freed as soon as the page is
+// back in memory, and the page is marked dirty, since the pool copy was
+// the only up-to-date one.
+//
+// An entry belongs to a single pte, so pages that more than one process
+// maps after a fork are not stored, and fork moves the pages of the
+// parent that are in the pool out to swap.
+
+// The pool is allocated in chunks; a compressed page takes a run of them
+#define ZCHUNK (SIMPAGESIZE < 64 ? SIMPAGESIZE : 64)
+#define ZMAX   (SIMPAGESIZE * 3 / 4)
+
+#define DIVROUNDUP(a,b) (((a)+(b)-1)/(b))
+
+// Size of the pool, as a percentage of physmem. The pool is off at 0.
+unsigned zswap_percent = 0;
+
+// Pages stored in the pool, pages that did not compress well enough,
+// page-ins served from the pool, and pages the pool wrote back to swap
+int zswap_stores = 0;
+int zswap_rejects = 0;
+int zswap_loads = 0;
+int zswap_writebacks = 0;
+
+// Total size of the pages stored, before and after compression
+long zswap_raw_bytes = 0;
+long zswap_comp_bytes = 0;
+
+// A compressed page. Entries are linked in the order they were stored,
+// which is the order the pool writes them back in; free entries are kept
+// on a list through next.
+struct zentry {
+	pgtbl_entry_t *pte;
+	addr_t vaddr;
+	unsigned chunk;  // First chunk of the compressed data
+	unsigned len;    // Compressed size in bytes
+	int prev;
+	int next;
+};
+
+static unsigned nchunks;
+static char *zpool;            // nchunks * ZCHUNK bytes of compressed data
+static unsigned char *zmap;    // 1 for each chunk in use
+static unsigned zcursor;       // Where the next chunk search starts
+static struct zentry *zentries;
+static int zhead, ztail;       // Oldest and newest stored pages
+static int zfree;              // Free entries
+
+//---------------------------------------------------------------------
+// A small LZ77 compressor, in the style of LZ4. The output is a series
+// of sequences, each a token byte (literal count in the high nibble,
+// match length - ZMINMATCH in the low nibble, with 15 meaning that more
+// length bytes follow), the literals, and a two byte match offset. The
+// last sequence has only literals.
+
+#define ZMINMATCH 4
+#define ZHASHLOG  10
+
+static unsigned zhash(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - ZHASHLOG);
+}
+
+static unsigned char *put_len(unsigned char *op, unsigned len) {
+	for (; len >= 255; len -= 255) {
+		*op++ = 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/*
+ * Compresses n bytes from src into dst. Returns the compressed size, or 0
+ * if it would be larger than cap.
+ */
+static unsigned lz_compress(const unsigned char *src, unsigned n,
+			    unsigned char *dst, unsigned cap) {
+	int table[1 << ZHASHLOG];
+	const unsigned char *ip = src, *anchor = src;
+	const unsigned char *end = src + n;
+	unsigned char *op = dst;
+	unsigned char *limit = dst + cap;  // Give up if output would pass this
+
+	memset(table, -1, sizeof(table));
+	while (ip + ZMINMATCH <= end) {
+		unsigned h = zhash(ip);
+		const unsigned char *ref = table[h] >= 0 ? src + table[h] : NULL;
+		table[h] = ip - src;
+
+		if (ref == NULL || memcmp(ref, ip, ZMINMATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		unsigned lit = ip - anchor;
+		unsigned mlen = ZMINMATCH;
+		while (ip + mlen < end && ref[mlen] == ip[mlen]) {
+			mlen++;
+		}
+		if (op + 1 + lit/255 + 1 + lit + 2 + (mlen - ZMINMATCH)/255 + 1 > limit) {
+			return 0;
+		}
+
+		unsigned char *token = op++;
+		*token = (lit < 15 ? lit : 15) << 4;
+		if (lit >= 15) {
+			op = put_len(op, lit - 15);
+		}
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		*token |= mlen - ZMINMATCH < 15 ? mlen - ZMINMATCH : 15;
+		if (mlen - ZMINMATCH >= 15) {
+			op = put_len(op, mlen - ZMINMATCH - 15);
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+
+	// Trailing literals
+	unsigned lit = end - anchor;
+	if (op + 1 + lit/255 + 1 + lit > limit) {
+		return 0;
+	}
+	*op = (lit < 15 ? lit : 15) << 4;
+	op++;
+	if (lit >= 15) {
+		op = put_len(op, lit - 15);
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+	return op - dst;
+}
+
+/* Decompresses n bytes from src into dst. Returns the decompressed size. */
+static unsigned lz_decompress(const unsigned char *src, unsigned n,
+			      unsigned char *dst) {
+	const unsigned char *ip = src, *end = src + n;
+	unsigned char *op = dst;
+
+	while (ip < end) {
+		unsigned token = *ip++;
+		unsigned len = token >> 4;
+		if (len == 15) {
+			do {
+				len += *ip;
+			} while (*ip++ == 255);
+		}
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip >= end) {
+			break;
+		}
+
+		unsigned off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		len = token & 15;
+		if (len == 15) {
+			do {
+				len += *ip;
+			} while (*ip++ == 255);
+		}
+		len += ZMINMATCH;
+		// Byte by byte, since the match may overlap what it produces
+		for (; len > 0; len--, op++) {
+			*op = op[-(int)off];
+		}
+	}
+	return op - dst;
+}
+
+//---------------------------------------------------------------------
+// Pool management
+
+/* Sets up a pool of zswap_percent of physmem. Must be called after swap
+ * and the page tables are initialized.
+ */
+void zswap_init() {
+	int i;
+
+	nchunks = (unsigned long)memsize * SIMPAGESIZE * zswap_percent / 100 / ZCHUNK;
+	zpool = malloc((size_t)nchunks * ZCHUNK);
+	zmap = calloc(nchunks, 1);
+	zentries = malloc(nchunks * sizeof(struct zentry));
+	if (nchunks == 0 || !zpool || !zmap || !zentries) {
+		fprintf(stderr, "Failed to allocate compressed pool of %u%% of memory\n",
+			zswap_percent);
+		exit(1);
+	}
+
+	zhead = ztail = -1;
+	zfree = -1;
+	for (i = nchunks - 1; i >= 0; i--) {
+		zentries[i].next = zfree;
+		zfree = i;
+	}
+	zcursor = 0;
+}
+
+/*
+ * Finds and marks a run of n free chunks, starting from the chunk after
+ * the last run that was handed out. Returns the first chunk, or -1 if no
+ * run is long enough.
+ */
+static int zalloc(unsigned n) {
+	unsigned i = zcursor, end = nchunks, run = 0;
+	int wrapped = (zcursor == 0);
+
+	while (1) {
+		if (i >= end) {
+			// Runs do not wrap: search up to zcursor from scratch
+			if (wrapped) {
+				return -1;
+			}
+			wrapped = 1;
+			end = zcursor + n - 1 < nchunks ? zcursor + n - 1 : nchunks;
+			i = 0;
+			run = 0;
+			continue;
+		}
+		if (zmap[i]) {
+			run = 0;
+		} else if (++run == n) {
+			unsigned first = i + 1 - n;
+			memset(&zmap[first], 1, n);
+			zcursor = i + 1 < nchunks ? i + 1 : 0;
+			return first;
+		}
+		i++;
+	}
+}
+
+/* Takes an entry off the stored list and frees it and its chunks. */
+static void zfree_entry(int e) {
+	struct zentry *z = &zentries[e];
+
+	if (z->prev >= 0) {
+		zentries[z->prev].next = z->next;
+	} else {
+		zhead = z->next;
+	}
+	if (z->next >= 0) {
+		zentries[z->next].prev = z->prev;
+	} else {
+		ztail = z->prev;
+	}
+	memset(&zmap[z->chunk], 0, DIVROUNDUP(z->len, ZCHUNK));
+	z->pte = NULL;
+	z->next = zfree;
+	zfree = e;
+}
+
+/*
+ * Writes the page in entry e to the swapfile, and frees its space in the
+ * pool.
+ */
+static void zswap_writeback(int e) {
+	unsigned char page[SIMPAGESIZE];
+	struct zentry *z = &zentries[e];
+	pgtbl_entry_t *pte = z->pte;
+	int off;
+
+	lz_decompress((unsigned char *)&zpool[z->chunk * ZCHUNK], z->len, page);
+	off = swap_pageout_page((char *)page, pte->swap_off, z->vaddr);
+	assert(off != INVALID_SWAP);
+
+	pte->swap_off = off;
+	pte->frame |= PG_ONSWAP;
+	pte->frame &= ~PG_INZPOOL;
+	zfree_entry(e);
+	zswap_writebacks++;
+}
+
+/* Moves the page with the handle in pte out of the pool and into swap,
+ * where it can be shared by a fork.
+ */
+void zswap_writeback_pte(pgtbl_entry_t *pte) {
+	assert(zentries[pte->zhandle].pte == pte);
+	zswap_writeback(pte->zhandle);
+}
+
+/*
+ * Compresses the page in frame into the pool, writing older pages back to
+ * swap if there is no room for it. On success, records the handle in pte
+ * and returns 0. Returns -1 if the page does not compress well enough, in
+ * which case it has to be written to swap.
+ */
+int zswap_store(int frame, pgtbl_entry_t *pte, addr_t vaddr) {
+	unsigned char buf[ZMAX];
+	unsigned len, n;
+	int chunk, e;
+
+	len = lz_compress((unsigned char *)&physmem[frame * SIMPAGESIZE],
+			  SIMPAGESIZE, buf, ZMAX);
+	n = DIVROUNDUP(len, ZCHUNK);
+	if (len == 0 || n > nchunks) {
+		zswap_rejects++;
+		return -1;
+	}
+	// Make room by writing back the pages that have been stored longest
+	while ((chunk = zalloc(n)) < 0) {
+		assert(zhead >= 0);
+		zswap_writeback(zhead);
+	}
+
+	e = zfree;
+	zfree = zentries[e].next;
+	zentries[e].pte = pte;
+	zentries[e].vaddr = vaddr;
+	zentries[e].chunk = chunk;
+	zentries[e].len = len;
+	zentries[e].prev = ztail;
+	zentries[e].next = -1;
+	if (ztail >= 0) {
+		zentries[ztail].next = e;
+	} else {
+		zhead = e;
+	}
+	ztail = e;
+	memcpy(&zpool[chunk * ZCHUNK], buf, len);
+
+	pte->zhandle = e;
+	zswap_stores++;
+	zswap_raw_bytes += SIMPAGESIZE;
+	zswap_comp_bytes += len;
+	return 0;
+}
+
+/*
+ * Decompresses the page with the handle in pte into frame, and frees it
+ * from the pool.
+ */
+void zswap_load(int frame, pgtbl_entry_t *pte) {
+	struct zentry *z = &zentries[pte->zhandle];
+	unsigned len;
+
+	assert(z->pte == pte);
+	len = lz_decompress((unsigned char *)&zpool[z->chunk * ZCHUNK], z->len,
+			    (unsigned char *)&physmem[frame * SIMPAGESIZE]);
+	assert(len == SIMPAGESIZE);
+	zfree_entry(pte->zhandle);
+	zswap_loads++;
+}
+
+// Write the pool and its counters to a checkpoint file. Entries are
+// saved with their vaddr, and their pte pointers rebuilt on restore.
+void zswap_save(FILE *fp) {
+	ckpt_write(fp, &nchunks, sizeof(unsigned));
+	ckpt_write(fp, zpool, (size_t)nchunks * ZCHUNK);
+	ckpt_write(fp, zmap, nchunks);
+	ckpt_write(fp, zentries, nchunks * sizeof(struct zentry));
+	ckpt_write(fp, &zcursor, sizeof(unsigned));
+	ckpt_write(fp, &zhead, sizeof(int));
+	ckpt_write(fp, &ztail, sizeof(int));
+	ckpt_write(fp, &zfree, sizeof(int));
+	ckpt_write(fp, &zswap_stores, sizeof(int));
+	ckpt_write(fp, &zswap_rejects, sizeof(int));
+	ckpt_write(fp, &zswap_loads, sizeof(int));
+	ckpt_write(fp, &zswap_writebacks, sizeof(int));
+	ckpt_write(fp, &zswap_raw_bytes, sizeof(long));
+	ckpt_write(fp, &zswap_comp_bytes, sizeof(long));
+}
+
+void zswap_restore(FILE *fp) {
+	unsigned n;
+	int e;
+
+	ckpt_read(fp, &n, sizeof(unsigned));
+	if (n != nchunks) {
+		fprintf(stderr, "zswap_restore: checkpoint has a pool of %u chunks, not %u\n",
+			n, nchunks);
+		exit(1);
+	}
+	ckpt_read(fp, zpool, (size_t)nchunks * ZCHUNK);
+	ckpt_read(fp, zmap, nchunks);
+	ckpt_read(fp, zentries, nchunks * sizeof(struct zentry));
+	ckpt_read(fp, &zcursor, sizeof(unsigned));
+	ckpt_read(fp, &zhead, sizeof(int));
+	ckpt_read(fp, &ztail, sizeof(int));
+	ckpt_read(fp, &zfree, sizeof(int));
+	ckpt_read(fp, &zswap_stores, sizeof(int));
+	ckpt_read(fp, &zswap_rejects, sizeof(int));
+	ckpt_read(fp, &zswap_loads, sizeof(int));
+	ckpt_read(fp, &zswap_writebacks, sizeof(int));
+	ckpt_read(fp, &zswap_raw_bytes, sizeof(long));
+	ckpt_read(fp, &zswap_comp_bytes, sizeof(long));
+
+	for (e = zhead; e >= 0; e = zentries[e].next) {
+		zentries[e].pte = find_pte(zentries[e].vaddr);
+	}
+}
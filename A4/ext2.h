@@ -18,9 +18,18 @@
 #ifndef CSC369_EXT2_FS_H
 #define CSC369_EXT2_FS_H
 
-/* The ext2 block size used in the assignment. */
+/*
+ * The smallest ext2 block size, and the offset of the super block on the
+ * disk. The block size of an image is 1024 << s_log_block_size.
+ */
 #define EXT2_BLOCK_SIZE 1024
 
+/* The s_magic of an ext2 super block */
+#define EXT2_SUPER_MAGIC 0xEF53
+
+/* Feature in s_feature_ro_compat for files of 2G or more */
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+
 /*
  * Structure of the super block
  */
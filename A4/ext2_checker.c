@@ -5,17 +5,12 @@
 #include "ext2_utils.h"
 #include "ext2_checker.h"
 
-static unsigned char *inode_bitmap;
-static unsigned char *block_bitmap;
-
-static int get_free_bits(unsigned char *bitmap, int size) {
+static int get_free_bits(unsigned char *bitmap, int nbits) {
     int count = 0;
-    for (int byte = 0 ; byte < size ; byte++) {
-        for (int bit = 0 ; bit < 8 ; bit++) {
-            int in_use = bitmap[byte] & (1 << bit);
-            if (!in_use) {
-                count++;
-            }
+    for (int bit = 0 ; bit < nbits ; bit++) {
+        int in_use = bitmap[bit / 8] & (1 << (bit % 8));
+        if (!in_use) {
+            count++;
         }
     }
     return count;
@@ -44,29 +39,39 @@ static int is_set(unsigned char *bitmap, int bit) {
     return *byte & (1 << (bit % 8));
 }
 
-// Fix unallocated blocks for inode in the bitmap
-static int fix_blocks(struct ext2_inode *inode) {
-    int fixed_blocks = 0;
-    for (int i = 0 ; i < 15 ; i++) {
-        if (inode->i_block[i] == 0) {
-            continue;
-        }
+// Whether an inode bit is set, in the bitmap of the inode's block group
+static int inode_is_set(int bit) {
+    int g = bit / sb->s_inodes_per_group;
+    return is_set(get_block(gd[g].bg_inode_bitmap), bit % sb->s_inodes_per_group);
+}
 
-        if (i < 12) {
-            if (!is_set(block_bitmap, inode->i_block[i] - 1)) {
-                claim_block(inode->i_block[i] - 1);
-                fixed_blocks += 1;
-            }
-        } else {
-            unsigned int *iblock = (unsigned int *) get_block(inode->i_block[i]);
-            for (int j = 0 ; j < PTRS_PER_INDIRECT_BLOCK ; j++) {
-                if (iblock[j] != 0 && !is_set(block_bitmap, iblock[j] - 1)) {
-                    claim_block(iblock[j] - 1);
-                    fixed_blocks += 1;
-                }
-            }
-        }
+// Whether a block bit is set, in the bitmap of the block's block group
+static int block_is_set(int bit) {
+    int g = bit / sb->s_blocks_per_group;
+    return is_set(get_block(gd[g].bg_block_bitmap), bit % sb->s_blocks_per_group);
+}
+
+// Number of bits of a group's bitmap in use, [per_group] to a group and
+// [total] in all (the last group can be short)
+static int group_bits(int g, unsigned int per_group, unsigned int total) {
+    unsigned int first = g * per_group;
+    return total - first < per_group ? total - first : per_group;
+}
+
+// walk_blocks function that claims a block not marked in the bitmap
+static int fix_block(unsigned int blk, int level, void *fixed_blocks) {
+    if (!block_is_set(BLOCK_BIT(blk))) {
+        claim_block(BLOCK_BIT(blk));
+        *(int *) fixed_blocks += 1;
     }
+    return 0;
+}
+
+// Fix unallocated blocks for inode in the bitmap, its indirect blocks
+// included
+static int fix_blocks(struct ext2_inode *inode) {
+    int fixed_blocks = 0;
+    walk_blocks(inode, fix_block, &fixed_blocks);
     return fixed_blocks;
 }
 
@@ -78,10 +83,10 @@ int check_directory(int ino, unsigned char * block) {
     int fixed = 0;
     int len = 0;
 
-    while (len < EXT2_BLOCK_SIZE) {
+    while (len < block_size) {
         struct ext2_dir_entry *curr = (struct ext2_dir_entry *)(block + len);
 
-        if (curr->rec_len == 0 || curr->rec_len == EXT2_BLOCK_SIZE) {
+        if (curr->rec_len == 0 || curr->rec_len == block_size) {
             break;
         }
 
@@ -120,6 +125,21 @@ int check_directory(int ino, unsigned char * block) {
 }
 
 
+// A directory being checked, for check_directory_block
+struct dir_check {
+    int ino;
+    int fixes;
+};
+
+// walk_blocks function that checks each data block of a directory
+static int check_directory_block(unsigned int blk, int level, void *arg) {
+    struct dir_check *check = arg;
+    if (level == 0) {
+        check->fixes += check_directory(check->ino, get_block(blk));
+    }
+    return 0;
+}
+
 int fix_inode(int ino) {
     struct ext2_inode *inode = get_inode(ino);
 
@@ -133,7 +153,7 @@ int fix_inode(int ino) {
     }
 
     // Fix inode not being allocated in inode bitmap
-    if (!is_set(inode_bitmap, ino - 1)) {
+    if (!inode_is_set(ino - 1)) {
         claim_inode(ino -1);
         fixes += 1;
         printf("Fixed: inode [%d] not marked as in-use\n", ino);
@@ -150,22 +170,9 @@ int fix_inode(int ino) {
     // and check the entries against their inodes. If a found inode is a directory
     // we must recursively traverse to fix any nested issues.
     if (inode->i_mode & EXT2_S_IFDIR) {
-        for (int i = 0 ; i < 15 ; i++) {
-            if (inode->i_block[i] == 0) {
-                continue;
-            }
-
-            if (i < 12) {
-                fixes += check_directory(ino, get_block(inode->i_block[i]));
-            } else {
-                unsigned int *iblock = (unsigned int *) get_block(inode->i_block[i]);
-                for (int j = 0 ; j < PTRS_PER_INDIRECT_BLOCK ; j++) {
-                    if (iblock[j] != 0) {
-                        fixes += check_directory(ino, get_block(iblock[j]));
-                    }
-                }
-            }
-        }
+        struct dir_check check = { ino, 0 };
+        walk_blocks(inode, check_directory_block, &check);
+        fixes += check.fixes;
     }
 
     return fixes;
@@ -179,13 +186,27 @@ int main(int argc, char **argv) {
     }
 
     ext2_init(argv[1]);
-    inode_bitmap = (unsigned char *)(disk + (EXT2_BLOCK_SIZE * gd->bg_inode_bitmap));
-    block_bitmap = (unsigned char *)(disk + (EXT2_BLOCK_SIZE * gd->bg_block_bitmap));
 
     int total_fixed = 0;
 
-    int free_inodes = get_free_bits(inode_bitmap, sb->s_inodes_count / 8);
-    int free_blocks = get_free_bits(block_bitmap, sb->s_blocks_count / 8);
+    // Count the free bits of every block group, fixing the group's
+    // counters as we go, and sum them for the super block.
+    int free_inodes = 0;
+    int free_blocks = 0;
+    int fixed_gd_inodes = 0;
+    int fixed_gd_blocks = 0;
+
+    for (unsigned int g = 0 ; g < group_count ; g++) {
+        int nbits = group_bits(g, sb->s_inodes_per_group, sb->s_inodes_count);
+        int group_free = get_free_bits(get_block(gd[g].bg_inode_bitmap), nbits);
+        fixed_gd_inodes += fix_count_gd(group_free, &gd[g].bg_free_inodes_count);
+        free_inodes += group_free;
+
+        nbits = group_bits(g, sb->s_blocks_per_group, BLOCK_BIT(sb->s_blocks_count));
+        group_free = get_free_bits(get_block(gd[g].bg_block_bitmap), nbits);
+        fixed_gd_blocks += fix_count_gd(group_free, &gd[g].bg_free_blocks_count);
+        free_blocks += group_free;
+    }
 
     int fixed;
 
@@ -199,12 +220,12 @@ int main(int argc, char **argv) {
         total_fixed += fixed;
     }
 
-    if ((fixed = fix_count_gd(free_inodes, &gd->bg_free_inodes_count)) > 0) {
+    if ((fixed = fixed_gd_inodes) > 0) {
         printf("Fixed: block group's free inodes counter was off by %d compared to bitmap\n", fixed);
         total_fixed += fixed;
     }
 
-    if ((fixed = fix_count_gd(free_blocks, &gd->bg_free_blocks_count)) > 0) {
+    if ((fixed = fixed_gd_blocks) > 0) {
         printf("Fixed: block group's free inodes counter was off by %d compared to bitmap\n", fixed);
         total_fixed += fixed;
     }
@@ -1,58 +1,134 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
 #include "ext2.h"
 #include "ext2_utils.h"
 
+/* The file being copied */
+struct source {
+    int fd;
+    unsigned char *data; /* The file mapped into memory, or NULL */
+};
+
+/**
+ * Copies [len] bytes at [off] in the source to [pos] in the image through
+ * the image file, with copy_file_range, or with sendfile where that cannot
+ * copy between the two files.
+ *
+ * @return 0 on success, -1 if neither can be used, an error code otherwise.
+ */
+static int copy_through_file(struct source *src, uint64_t pos, size_t off, size_t len) {
+    loff_t in = off;
+    loff_t out = pos;
+    ssize_t n = 0;
+    while (len > 0 && (n = copy_file_range(src->fd, &in, disk_fd, &out, len, 0)) > 0) {
+        len -= n;
+    }
+
+    // Nothing has been copied if copy_file_range cannot copy between them
+    if (n == -1 && in == (loff_t) off && (errno == ENOSYS || errno == EXDEV
+        || errno == EINVAL || errno == EOPNOTSUPP)) {
+        if (lseek(disk_fd, pos, SEEK_SET) == -1) {
+            return -1;
+        }
+        while (len > 0 && (n = sendfile(disk_fd, src->fd, &in, len)) > 0) {
+            len -= n;
+        }
+        if (n == -1 && in == (loff_t) off) {
+            return -1;
+        }
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+    // The source ended early, or failed part of the way through
+    return n == 0 ? EIO : errno;
+}
+
+/**
+ * Fills a stretch of the file's blocks in the image from the source.
+ *
+ * The data is copied from the source's mapping. A source that could not be
+ * mapped is copied through the image file instead, or failing that, read
+ * straight into the image's mapping.
+ */
+static int copy_extent(uint64_t pos, size_t off, size_t len, void *arg) {
+    struct source *src = arg;
+
+    if (src->data != NULL) {
+        memcpy(disk + pos, src->data + off, len);
+        return 0;
+    }
+
+    int err = copy_through_file(src, pos, off, len);
+    if (err >= 0) {
+        return err;
+    }
+    while (len > 0) {
+        ssize_t n = pread(src->fd, disk + pos, len, off);
+        if (n <= 0) {
+            return n == 0 ? EIO : errno;
+        }
+        pos += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
 /**
  * Copies the contents of a file on the native operating system into an
  * inode on the EXT2 file system.
+ *
+ * The whole file is written with one call to append_to_inode, so all of
+ * its blocks are allocated together, and the data is copied a stretch of
+ * contiguous blocks at a time from the file mapped into memory.
  */
 static int copy_file_to_inode(char *file, int ino) {
-    FILE *fp = fopen(file, "r");
+    struct source src = { open(file, O_RDONLY), NULL };
 
-    if (!fp) {
+    if (src.fd == -1) {
         return ENOENT;
     }
 
     // Get the size of the inode in order to check the size
     // against our drive.
-    fseek(fp, 0L, SEEK_END);
-    size_t fsize = ftell(fp);
-    if (fsize > sb->s_free_blocks_count * EXT2_BLOCK_SIZE
-        || fsize > MAX_INODE_SIZE) {
-        fclose(fp);
+    struct stat st;
+    if (fstat(src.fd, &st) == -1) {
+        close(src.fd);
+        return EIO;
+    }
+    size_t fsize = st.st_size;
+    if (fsize > (size_t) sb->s_free_blocks_count * block_size
+        || fsize > max_file_size) {
+        close(src.fd);
         return ENOSPC;
     }
 
-    // Reset the file pointer to the first index, prepare for reading
-    char buffer[EXT2_BLOCK_SIZE + 1];
-    buffer[EXT2_BLOCK_SIZE] = '\0';
-    fseek(fp, 0L, SEEK_SET);
-    size_t read;
-
-    // Read in 1K (or what EXT2_BLOCK_SIZE is set to) at a time, writing the
-    // new data to the inode.
-    while ((read = fread(buffer, 1, EXT2_BLOCK_SIZE, fp)) == EXT2_BLOCK_SIZE) {
-        int err = write_to_inode(ino, buffer, read);
-        if (err != 0) {
-            fclose(fp);
-            return err;
+    // Without a mapping, the data is read from the file instead
+    if (fsize > 0) {
+        src.data = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, src.fd, 0);
+        if (src.data == MAP_FAILED) {
+            src.data = NULL;
+        } else {
+            madvise(src.data, fsize, MADV_SEQUENTIAL);
         }
     }
 
-    // When we exit the while loop, we must write the remaining data
-    // (< EXT2_BLOCK_SIZE) not written in the loop to our block.
-    if (read > 0) {
-        buffer[read] = '\0';
-        int err = write_to_inode(ino, buffer, read);
-        if (err != 0) {
-            fclose(fp);
-            return err;
-        }
-    }
+    int err = append_to_inode(ino, fsize, copy_extent, &src);
 
-    fclose(fp);
-    return EXIT_SUCCESS;
+    if (src.data != NULL) {
+        munmap(src.data, fsize);
+    }
+    close(src.fd);
+    return err;
 }
 
 int main(int argc, char **argv) {
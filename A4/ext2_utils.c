@@ -7,16 +7,25 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <stdint.h>
+#include <endian.h>
 
 #include "ext2.h"
 #include "ext2_utils.h"
 
 #define MAX(x, y) ((x > y) ? x : y) /* Take the max of 2 values */
+#define MIN(x, y) ((x < y) ? x : y) /* Take the min of 2 values */
 
 unsigned char *disk;
+int disk_fd;
 struct ext2_super_block *sb;
 struct ext2_group_desc *gd;
 
+unsigned int block_size;
+unsigned int group_count;
+unsigned int inode_size;
+uint64_t max_file_size;
+
 /******************/
 /** STRING UTILS **/
 /******************/
@@ -112,24 +121,89 @@ static int get_rec_len(int name_len) {
 /** BITMAP UTILS **/
 /******************/
 
+/*
+ * Search hints for the bitmaps. Every bit below a hint is known to be in
+ * use, so searches start there instead of at bit 0: a search leaves its
+ * hint at the bit it found, and freeing a bit below the hint moves the
+ * hint back down to it. search_groups (for new inodes, and the block of a
+ * new directory) starts at a hint, and the second pass of find_run, which
+ * looks for a run before the write's goal block, starts at block_hint, so
+ * neither rescans the used part of the bitmap at the start of the disk.
+ * Like the bits, hints count across all block groups.
+ */
+static int inode_hint = 0;
+static int block_hint = 0;
+
 /**
  * Helper method that returns the first available index in a bitmap
  *
- * [size] indicates the number of bytes that can be searched, [reserved]
- * indicating which first n bits are reserved by the file system.
- */
-static int search_bitmap(unsigned char *bitmap, int size, int reserved) {
-    for (int byte = 0 ; byte < size ; byte++) {
-        for (int bit = 0 ; bit < 8 ; bit++) {
-            int in_use = bitmap[byte] & (1 << bit);
-            if (!in_use) {
-                int pos = 8 * byte + bit;
-                if (pos >= reserved) {
-                    return pos + 1;
-                }
+ * [nbits] indicates the number of bits that can be searched, starting
+ * from bit [start]. Bits are tested 64 at a time, so a word with every
+ * bit in use is skipped in one step. Returns -1 if every bit is in use.
+ */
+static int search_bitmap(unsigned char *bitmap, int nbits, int start) {
+    int bit = start;
+
+    while (bit < nbits) {
+        if (bit % 64 == 0 && bit + 64 <= nbits) {
+            uint64_t word;
+            memcpy(&word, bitmap + bit / 8, sizeof(word));
+            word = le64toh(word); // Bit n of the word is bit n of the run
+            if (word == ~(uint64_t)0) {
+                bit += 64;
+                continue;
             }
+            return bit + __builtin_ctzll(~word);
+        }
+
+        // Bits up to the next word boundary, and the tail, one at a time
+        if (!(bitmap[bit / 8] & (1 << (bit % 8)))) {
+            return bit;
+        }
+        bit++;
+    }
+    return -1;
+}
+
+/* Returns the inode bitmap of a block group */
+static unsigned char *inode_bitmap(int group) {
+    return get_block(gd[group].bg_inode_bitmap);
+}
+
+/* Returns the block bitmap of a block group */
+static unsigned char *block_bitmap(int group) {
+    return get_block(gd[group].bg_block_bitmap);
+}
+
+/**
+ * Finds the first free bit of a bitmap that is split across the block
+ * groups, [per_group] bits to a group and [total] bits in all. The search
+ * starts at bit [reserved] or the bitmap's [hint], whichever is further,
+ * and skips the groups whose descriptors have no free bits left.
+ *
+ * Returns the bit, counted across all groups, or -1 if there is none.
+ */
+static int search_groups(int inodes, unsigned int per_group, unsigned int total,
+                         int reserved, int *hint) {
+    int start = MAX(reserved, *hint);
+
+    for (unsigned int g = start / per_group ; g < group_count ; g++) {
+        struct ext2_group_desc *desc = &gd[g];
+        if ((inodes ? desc->bg_free_inodes_count : desc->bg_free_blocks_count) == 0) {
+            continue;
+        }
+
+        // The last group can be short
+        unsigned int first = g * per_group;
+        int nbits = total - first < per_group ? total - first : per_group;
+        int from = start > first ? start - first : 0;
+        int bit = search_bitmap(inodes ? inode_bitmap(g) : block_bitmap(g), nbits, from);
+        if (bit != -1) {
+            *hint = first + bit;
+            return *hint;
         }
     }
+    *hint = total;
     return -1;
 }
 
@@ -139,8 +213,9 @@ static int search_bitmap(unsigned char *bitmap, int size, int reserved) {
  * NOTE: Not to be confused with the inode index in the bitmap
  */
 static int next_inode() {
-    unsigned char *inode_bitmap = (unsigned char *)(disk + (EXT2_BLOCK_SIZE * gd->bg_inode_bitmap));
-    return search_bitmap(inode_bitmap, sb->s_inodes_count / 8, sb->s_first_ino);
+    int bit = search_groups(1, sb->s_inodes_per_group, sb->s_inodes_count,
+                            sb->s_first_ino, &inode_hint);
+    return bit == -1 ? -1 : bit + 1;
 }
 
 /**
@@ -149,8 +224,115 @@ static int next_inode() {
  * NOTE: Not to be confused with the block index in the bitmap
  */
 static int next_block() {
-    unsigned char *block_bitmap = (unsigned char *)(disk + (EXT2_BLOCK_SIZE * gd->bg_block_bitmap));
-    return search_bitmap(block_bitmap, sb->s_blocks_count / 8, 0);
+    int bit = search_groups(0, sb->s_blocks_per_group, BLOCK_BIT(sb->s_blocks_count),
+                            0, &block_hint);
+    return bit == -1 ? -1 : bit + sb->s_first_data_block;
+}
+
+/**
+ * Returns the number of free bits in a bitmap from bit [start] on, up to
+ * [max] of them and the end of the bitmap at [nbits].
+ */
+static int run_length(unsigned char *bitmap, int nbits, int start, int max) {
+    int bit = start;
+
+    while (bit < nbits && bit - start < max) {
+        if (bit % 64 == 0 && bit + 64 <= nbits) {
+            uint64_t word;
+            memcpy(&word, bitmap + bit / 8, sizeof(word));
+            word = le64toh(word);
+            if (word == 0) {
+                bit += 64;
+                continue;
+            }
+            bit += __builtin_ctzll(word);
+            break;
+        }
+
+        if (bitmap[bit / 8] & (1 << (bit % 8))) {
+            break;
+        }
+        bit++;
+    }
+    return MIN(bit - start, max);
+}
+
+/*
+ * A free run this long is taken even if the write wants more. Longer runs
+ * would save little, and a multi-megabyte write could never find a run of
+ * its size, since the block groups' metadata splits the disk up.
+ */
+#define RUN_ENOUGH 1024
+
+/**
+ * Finds a run of free blocks for a write that wants [want] blocks, ideally
+ * starting at block bit [goal], which is where the file's last block
+ * would be followed.
+ *
+ * A run at the goal is always taken, keeping the file contiguous.
+ * Otherwise the first run of [want] blocks (or RUN_ENOUGH) after the
+ * goal is, wrapping around to the start of the disk, and failing that the
+ * longest run there is. Runs do not cross block groups.
+ *
+ * @param goal Block bit to start at
+ * @param want Number of blocks wanted
+ * @param len  Set to the length of the run, at most [want]
+ *
+ * @return The block bit the run starts at, or -1 if no block is free.
+ */
+static int find_run(unsigned int goal, int want, int *len) {
+    unsigned int per_group = sb->s_blocks_per_group;
+    unsigned int total = BLOCK_BIT(sb->s_blocks_count);
+    int enough = MIN(want, RUN_ENOUGH);
+    int best = -1;
+    int best_len = 0;
+
+    if (goal >= total) {
+        goal = 0;
+    }
+
+    // Searched from the goal to the end, then from the start (less the
+    // blocks known to be in use) up to the goal
+    for (int pass = 0 ; pass < 2 ; pass++) {
+        unsigned int bit = pass == 0 ? goal : MIN((unsigned int) block_hint, goal);
+        unsigned int end = pass == 0 ? total : goal;
+
+        while (bit < end) {
+            unsigned int g = bit / per_group;
+            unsigned int first = g * per_group;
+            int nbits = MIN(total - first, per_group);
+            if (gd[g].bg_free_blocks_count == 0) {
+                bit = first + nbits;
+                continue;
+            }
+
+            unsigned char *bitmap = block_bitmap(g);
+            int start = search_bitmap(bitmap, MIN(end - first, (unsigned int) nbits), bit - first);
+            if (start == -1) {
+                bit = first + nbits;
+                continue;
+            }
+
+            int run = run_length(bitmap, nbits, start, want);
+            if (run >= enough || (first + start == goal && pass == 0)) {
+                *len = run;
+                return first + start;
+            }
+            if (run > best_len) {
+                best = first + start;
+                best_len = run;
+            }
+            bit = first + start + run;
+        }
+    }
+
+    *len = best_len;
+    return best;
+}
+
+/* Helper method to get a bit in a bitmap */
+static int get_bit(unsigned char *bitmap, int bit) {
+    return (bitmap[bit / 8] >> (bit % 8)) & 1;
 }
 
 /* Helper method to set the proper bit in a bitmap */
@@ -167,17 +349,20 @@ static void set_bit(unsigned char *bitmap, int bit, int val) {
  * @see ext2_utils.h
  */
 void claim_inode(int bit) {
-    unsigned char *inode_bitmap = (unsigned char *)(disk + (EXT2_BLOCK_SIZE * gd->bg_inode_bitmap));
-    set_bit(inode_bitmap, bit, 1);
-    gd->bg_free_inodes_count--;
+    int g = bit / sb->s_inodes_per_group;
+    set_bit(inode_bitmap(g), bit % sb->s_inodes_per_group, 1);
+    gd[g].bg_free_inodes_count--;
     sb->s_free_inodes_count--;
 }
 
 /* Unclaims a bit inside the inode bitmap */
 static void unclaim_inode(int bit) {
-    unsigned char *inode_bitmap = (unsigned char *)(disk + (EXT2_BLOCK_SIZE * gd->bg_inode_bitmap));
-    set_bit(inode_bitmap, bit, 0);
-    gd->bg_free_inodes_count++;
+    int g = bit / sb->s_inodes_per_group;
+    set_bit(inode_bitmap(g), bit % sb->s_inodes_per_group, 0);
+    if (bit < inode_hint) {
+        inode_hint = bit;
+    }
+    gd[g].bg_free_inodes_count++;
     sb->s_free_inodes_count++;
 }
 
@@ -185,33 +370,238 @@ static void unclaim_inode(int bit) {
  * @see ext2_utils.h
  */
 void claim_block(int bit) {
-    unsigned char *block_bitmap = (unsigned char *)(disk + (EXT2_BLOCK_SIZE * gd->bg_block_bitmap));
-    set_bit(block_bitmap, bit, 1);
-    gd->bg_free_blocks_count--;
+    int g = bit / sb->s_blocks_per_group;
+    set_bit(block_bitmap(g), bit % sb->s_blocks_per_group, 1);
+    gd[g].bg_free_blocks_count--;
     sb->s_free_blocks_count--;
 }
 
 /* Unclaims a bit inside the block bitmap */
 static void unclaim_block(int bit) {
-    unsigned char *block_bitmap = (unsigned char *)(disk + (EXT2_BLOCK_SIZE * gd->bg_block_bitmap));
-    set_bit(block_bitmap, bit, 0);
-    gd->bg_free_blocks_count++;
+    int g = bit / sb->s_blocks_per_group;
+    set_bit(block_bitmap(g), bit % sb->s_blocks_per_group, 0);
+    if (bit < block_hint) {
+        block_hint = bit;
+    }
+    gd[g].bg_free_blocks_count++;
     sb->s_free_blocks_count++;
 }
 
+/* Claims the [len] block bits from [bit] on */
+static void claim_run(int bit, int len) {
+    for (int i = 0 ; i < len ; i++) {
+        claim_block(bit + i);
+    }
+}
+
 /*
  * @see ext2_utils.h
  */
 struct ext2_inode *get_inode(int ino) {
-    return & ((struct ext2_inode *)
-              (disk + EXT2_BLOCK_SIZE * gd->bg_inode_table))[ino-1];
+    int g = (ino - 1) / sb->s_inodes_per_group;
+    int index = (ino - 1) % sb->s_inodes_per_group;
+    return (struct ext2_inode *)
+           (get_block(gd[g].bg_inode_table) + (size_t) index * inode_size);
 }
 
 /*
  * @see ext2_utils.h
  */
 unsigned char *get_block(int blk) {
-    return disk + (EXT2_BLOCK_SIZE * blk);
+    return disk + ((size_t) block_size * (unsigned int) blk);
+}
+
+/***************/
+/** BLOCK MAP **/
+/***************/
+
+/*
+ * Logical blocks 0-11 are mapped by the direct pointers in i_block[0-11].
+ * The single indirect block (i_block[12]) maps the next P, where P is
+ * PTRS_PER_INDIRECT_BLOCK; the double indirect block (i_block[13]) maps
+ * the next P * P, through P single indirect blocks; and the triple
+ * indirect block (i_block[14]) the next P * P * P, through P double
+ * indirect ones.
+ */
+
+/**
+ * Finds the path to logical block [lblk] through the indirect blocks.
+ *
+ * Returns its depth: 0 for a direct block, or 1 to 3 for a block mapped
+ * by the single, double or triple indirect block, with [index] set to the
+ * pointer to follow in each indirect block on the way, from the top.
+ */
+static int block_path(unsigned int lblk, unsigned int index[3]) {
+    unsigned int p = PTRS_PER_INDIRECT_BLOCK;
+
+    if (lblk < 12) {
+        return 0;
+    }
+    lblk -= 12;
+    if (lblk < p) {
+        index[0] = lblk;
+        return 1;
+    }
+    lblk -= p;
+    if (lblk < p * p) {
+        index[0] = lblk / p;
+        index[1] = lblk % p;
+        return 2;
+    }
+    lblk -= p * p;
+    index[0] = lblk / (p * p);
+    index[1] = (lblk / p) % p;
+    index[2] = lblk % p;
+    return 3;
+}
+
+/**
+ * Returns how many of the [n] numbers [base], [base] + [step], ... are in
+ * [first, end).
+ */
+static uint64_t count_starts(uint64_t base, uint64_t step, uint64_t n,
+                             uint64_t first, uint64_t end) {
+    uint64_t from = first <= base ? 0 : MIN((first - base + step - 1) / step, n);
+    uint64_t to = end <= base ? 0 : MIN((end - base + step - 1) / step, n);
+    return to > from ? to - from : 0;
+}
+
+/**
+ * Returns how many indirect blocks the inode does not have yet are needed
+ * to map logical blocks [first, first + count): those whose first block
+ * is in that range. The inode must map every block before [first], which
+ * is so for files written by write_to_inode.
+ */
+static unsigned int indirect_blocks_needed(uint64_t first, uint64_t count) {
+    uint64_t p = PTRS_PER_INDIRECT_BLOCK;
+    uint64_t single = 12, dbl = single + p, triple = dbl + p * p;
+    uint64_t end = first + count;
+
+    return count_starts(single, 1, 1, first, end)
+           + count_starts(dbl, 1, 1, first, end) + count_starts(dbl, p, p, first, end)
+           + count_starts(triple, 1, 1, first, end) + count_starts(triple, p * p, p, first, end)
+           + count_starts(triple, p, p * p, first, end);
+}
+
+/*
+ * A lookup of logical blocks by number. Each walk down the indirect
+ * blocks leaves the map at the block of pointers it ended in, which maps
+ * the next P logical blocks (or the direct pointers, the first 12), so
+ * looking blocks up in order walks down only once for every P of them.
+ */
+struct block_map {
+    struct ext2_inode *inode;
+    unsigned int *leaf;  /* Pointers of logical blocks [start, start + count) */
+    unsigned int start;
+    unsigned int count;
+};
+
+/* Sets up a block map for an inode */
+static void block_map_init(struct block_map *map, struct ext2_inode *inode) {
+    map->inode = inode;
+    map->leaf = inode->i_block;
+    map->start = 0;
+    map->count = 12;
+}
+
+/**
+ * Returns the block pointer that maps logical block [lblk], or NULL if an
+ * indirect block on the way to it is missing, in which case [missing] (if
+ * not NULL) is set to the pointer the missing block would go in.
+ */
+static unsigned int *block_map_slot(struct block_map *map, unsigned int lblk,
+                                    unsigned int **missing) {
+    if (lblk - map->start < map->count) {
+        return &map->leaf[lblk - map->start];
+    }
+
+    unsigned int index[3];
+    int depth = block_path(lblk, index);
+    if (depth == 0) {
+        block_map_init(map, map->inode);
+        return &map->leaf[lblk];
+    }
+
+    unsigned int *slot = &map->inode->i_block[11 + depth];
+    for (int i = 0 ; i < depth ; i++) {
+        if (*slot == 0) {
+            if (missing) {
+                *missing = slot;
+            }
+            return NULL;
+        }
+        slot = &((unsigned int *) get_block(*slot))[index[i]];
+    }
+
+    map->leaf = slot - index[depth - 1];
+    map->start = lblk - index[depth - 1];
+    map->count = PTRS_PER_INDIRECT_BLOCK;
+    return slot;
+}
+
+/* Calls [fn] on an indirect block of [level], then on the blocks it points to */
+static int walk_indirect(unsigned int blk, int level,
+                         int (*fn) (unsigned int, int, void *), void *arg) {
+    int ret = fn(blk, level, arg);
+    if (ret != 0) {
+        return ret;
+    }
+
+    unsigned int *ptrs = (unsigned int *) get_block(blk);
+    for (int i = 0 ; i < PTRS_PER_INDIRECT_BLOCK ; i++) {
+        if (ptrs[i] == 0) {
+            continue;
+        }
+        ret = level == 1 ? fn(ptrs[i], 0, arg) : walk_indirect(ptrs[i], level - 1, fn, arg);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @see ext2_utils.h
+ */
+int walk_blocks(struct ext2_inode *inode, int (*fn) (unsigned int, int, void *), void *arg) {
+    for (int i = 0 ; i < 15 ; i++) {
+        if (inode->i_block[i] == 0) {
+            continue;
+        }
+
+        int ret = i < 12 ? fn(inode->i_block[i], 0, arg)
+                         : walk_indirect(inode->i_block[i], i - 11, fn, arg);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Sizes of regular files have their high 32 bits in i_dir_acl, which is
+ * i_size_high in later versions of ext2. A file of 2G or more needs the
+ * large file feature, which is turned on when one is written.
+ */
+
+/* Returns the size of an inode's file */
+static uint64_t get_file_size(struct ext2_inode *inode) {
+    uint64_t size = inode->i_size;
+    if ((inode->i_mode & 0xF000) == EXT2_S_IFREG) {
+        size |= (uint64_t) inode->i_dir_acl << 32;
+    }
+    return size;
+}
+
+/* Sets the size of an inode's file, turning on the large file feature if needed */
+static void set_file_size(struct ext2_inode *inode, uint64_t size) {
+    inode->i_size = size;
+    if ((inode->i_mode & 0xF000) == EXT2_S_IFREG) {
+        inode->i_dir_acl = size >> 32;
+        if (size > 0x7FFFFFFF) {
+            sb->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+        }
+    }
 }
 
 /*************************/
@@ -221,7 +611,7 @@ unsigned char *get_block(int blk) {
 /* Finds the last entry in a directory */
 struct ext2_dir_entry *last_entry(struct ext2_dir_entry *entry, int* fs_dest) {
     int size = 0;
-    while (size < EXT2_BLOCK_SIZE) {
+    while (size < block_size) {
         int rsize = get_rec_len(entry->name_len);
         if (rsize != entry->rec_len) {
             size += rsize;
@@ -233,7 +623,7 @@ struct ext2_dir_entry *last_entry(struct ext2_dir_entry *entry, int* fs_dest) {
     }
 
     if (fs_dest) {
-        *fs_dest = EXT2_BLOCK_SIZE - size;
+        *fs_dest = block_size - size;
     }
     return entry;
 }
@@ -283,10 +673,8 @@ static int offset_to_hidden(struct ext2_dir_entry *entry, char *name, int space)
 
 /* Predicate function to test if an entry is hiding a removed inode */
 static int test_hiding_entry(struct ext2_dir_entry *entry, void* fname) {
-    int real_len = get_rec_len(entry->name_len);
     char *name = (char *) fname;
-    int space = entry->rec_len - real_len;
-    int offset = offset_to_hidden(entry, name, space);
+    int offset = offset_to_hidden(entry, name, entry->rec_len);
     return offset > 0 ? PRED_VALID : PRED_INVALID;
 }
 
@@ -338,7 +726,7 @@ static struct ext2_dir_entry *search_block(int rmode, unsigned int block,
     struct ext2_dir_entry *prev = NULL;
     struct ext2_dir_entry *curr = NULL;
 
-    while (len < EXT2_BLOCK_SIZE) {
+    while (len < block_size) {
         prev = curr;
         curr = (struct ext2_dir_entry *)(get_block(block) + len);
 
@@ -367,6 +755,23 @@ static struct ext2_dir_entry *search_block(int rmode, unsigned int block,
     return NULL;
 }
 
+/* A directory search in progress, for search_directory_block */
+struct dir_search {
+    int rmode;
+    int (*predicate) (struct ext2_dir_entry*, void*);
+    void *param;
+    struct ext2_dir_entry *found;
+};
+
+/* walk_blocks function that searches a directory's data blocks */
+static int search_directory_block(unsigned int blk, int level, void *arg) {
+    struct dir_search *search = arg;
+    if (level == 0) {
+        search->found = search_block(search->rmode, blk, search->predicate, search->param);
+    }
+    return search->found != NULL;
+}
+
 /**
  * Searches the blocks inside a directory.
  *
@@ -380,34 +785,9 @@ static struct ext2_dir_entry *search_block(int rmode, unsigned int block,
 static struct ext2_dir_entry *search_directory(int rmode, struct ext2_inode *inode,
                  int (*predicate) (struct ext2_dir_entry*, void*),
                  void *param) {
-    for (int i = 0 ; i < 13 ; i++) {
-        if (inode->i_block[i] == 0) {
-            continue;
-        }
-
-        struct ext2_dir_entry *entry;
-        if (i < 12) { // Search direct block
-            entry = search_block(rmode, inode->i_block[i], predicate, param);
-        } else { // Get pointers to indirect block
-            unsigned int *iblock = (unsigned int *) get_block(inode->i_block[i]);
-            for (int j = 0 ; j < PTRS_PER_INDIRECT_BLOCK ; j++) {
-                if (iblock[j] == 0) {
-                    continue;
-                }
-
-                entry = search_block(rmode, iblock[j], predicate, param);
-                if (entry) {
-                    return entry;
-                }
-            }
-        }
-
-        if (entry) {
-            return entry;
-        }
-    }
-
-    return NULL;
+    struct dir_search search = { rmode, predicate, param, NULL };
+    walk_blocks(inode, search_directory_block, &search);
+    return search.found;
 }
 
 /* Finds an inode entry with a specific name inside a directory */
@@ -433,7 +813,7 @@ static struct ext2_dir_entry *find_entry(struct ext2_inode *inode, char *fname)
      entry = last_entry(entry, &free_space);
 
      // This case only occurs when we are inserting the first item into a block
-     if (entry->rec_len < EXT2_BLOCK_SIZE) {
+     if (entry->rec_len < block_size) {
          int size = get_rec_len(entry->name_len);
          entry->rec_len = size; // Adjust the current last entry length to its real size
          entry = (struct ext2_dir_entry *)(((unsigned char *) entry) + size); // Move to next entry
@@ -447,92 +827,156 @@ static struct ext2_dir_entry *find_entry(struct ext2_inode *inode, char *fname)
      return entry;
  }
 
-/**
- * Finds a place inside an inode to insert a block.
- *
- * @param ino Inode to insert to
- * @parma blk Block number to insert
- *
- * @return 0 or error code.
+/*
+ * Allocation cursor of the inode last written to, kept in memory like the
+ * kernel's i_next_alloc_block. It says where the next block goes, so an
+ * append does not look through the block map to find the end of the file,
+ * and where the last block is, whose unused tail the append fills first.
+ * Its block map keeps the block of pointers the last block was mapped in,
+ * so the blocks of a write are mapped without walking the indirect blocks
+ * again for each one.
  */
-static int add_block_to_inode(int ino, int blk) {
-    struct ext2_inode *inode = get_inode(ino);
-    for (int i = 0 ; i < 13 ; i++) {
-        // Direct pointer insertion is simple - just assign it
-        if (i < 12) {
-            if (inode->i_block[i] == 0) {
-                inode->i_block[i] = blk;
-                inode->i_blocks += 2;
-                return 0;
-            }
-        } else { // Handle indirect pointer creation
-            // If the indirect block hasn't been assigned yet, we create it
-            // and add it to the inode.
-            if (inode->i_block[i] == 0) {
-                int b = next_block();
-                if (b == -1) {
-                    break;
-                }
-                inode->i_block[i] = b;
-                inode->i_blocks += 2;
-                claim_block(b - 1);
-            }
+static struct {
+    int ino;           /* Inode of the cursor, 0 if none */
+    unsigned int next; /* Next logical block to map */
+    unsigned int last; /* Block number of logical block next - 1 */
+    unsigned int goal; /* Block bit to allocate the next block at */
+    struct block_map map;
+} cursor;
+
+/* Points the cursor at the end of inode [ino] */
+static void load_cursor(int ino) {
+    if (cursor.ino == ino) {
+        return;
+    }
 
-            // With the indirect block, we must find a free slot to insert the
-            // block number we want to add to the inode.
-            unsigned int *iblock = (unsigned int *) get_block(inode->i_block[i]);
-            for (int i = 0 ; i < PTRS_PER_INDIRECT_BLOCK ; i++) {
-                if (iblock[i] == 0) {
-                    iblock[i] = blk;
-                    inode->i_blocks += 2;
-                    return 0;
-                }
-            }
+    struct ext2_inode *inode = get_inode(ino);
+    cursor.ino = ino;
+    cursor.last = 0;
+    // An empty file starts in its inode's block group
+    cursor.goal = ((ino - 1) / sb->s_inodes_per_group) * sb->s_blocks_per_group;
+    block_map_init(&cursor.map, inode);
+
+    // Files are written without holes, so the size says how many
+    // blocks are mapped
+    cursor.next = (get_file_size(inode) + block_size - 1) / block_size;
+    if (cursor.next > 0) {
+        unsigned int *slot = block_map_slot(&cursor.map, cursor.next - 1, NULL);
+        if (slot != NULL && *slot != 0) {
+            cursor.last = *slot;
+            cursor.goal = BLOCK_BIT(*slot) + 1;
         }
     }
-    return ENOSPC;
 }
 
-/* Helper function that finds a block to append data to an inode */
-static int _write(int ino, char *data, size_t len) {
-    int blk = next_block();
-
-    if (blk == -1) {
-        return ENOSPC;
-    }
-
-    unsigned char *b = get_block(blk);
-    get_inode(ino)->i_size += len;
-    memcpy(b, data, len);
-    int err = add_block_to_inode(ino, blk);
-    if (err != 0) {
-        return err;
-    }
-    claim_block(blk - 1);
+/* Fills data for write_to_inode from a buffer in memory */
+static int copy_from_buffer(uint64_t pos, size_t off, size_t len, void *data) {
+    memcpy(disk + pos, (char *) data + off, len);
     return 0;
 }
 
-/**
- * Writes new data to an inode.
- *
- * @param ino  Inode number
- * @param data Data to write
- * @param len  Size of data
- *
- * @return 0 or error code
+/*
+ * @see ext2_utils.h
  */
 int write_to_inode(int ino, char *data, size_t len) {
-    // while len > max block size, write block and then move pointer forward
-    while (len > EXT2_BLOCK_SIZE) {
-        int err = _write(ino, data, len);
-        if (err > 0) {
+    return append_to_inode(ino, len, copy_from_buffer, data);
+}
+
+/*
+ * @see ext2_utils.h
+ */
+int append_to_inode(int ino, size_t len, int (*fill) (uint64_t, size_t, size_t, void *), void *arg) {
+    struct ext2_inode *inode = get_inode(ino);
+    load_cursor(ino);
+
+    uint64_t size = get_file_size(inode);
+    if (len > max_file_size - size) {
+        return EFBIG;
+    }
+
+    // The rest of the last block is filled before taking new ones
+    size_t done = 0;
+    size_t tail = size % block_size;
+    if (tail != 0 && cursor.last != 0) {
+        done = MIN(len, block_size - tail);
+    }
+
+    // The blocks the write needs, with the indirect blocks to map them,
+    // are all checked for up front, before anything is written
+    uint64_t nblocks = (len - done + block_size - 1) / block_size;
+    uint64_t need = nblocks + indirect_blocks_needed(cursor.next, nblocks);
+    if (need > sb->s_free_blocks_count) {
+        return ENOSPC;
+    }
+
+    if (done > 0) {
+        int err = fill((uint64_t) cursor.last * block_size + tail, 0, done, arg);
+        if (err != 0) {
             return err;
         }
-        data = data + EXT2_BLOCK_SIZE;
-        len -= EXT2_BLOCK_SIZE;
+        size += done;
+        len -= done;
     }
 
-    return _write(ino, data, len);
+    // Take runs of free blocks as long as the rest of the write, each
+    // starting where the last one ended if it can, and lay the data out
+    // along them. Indirect blocks go before the first block they map, and
+    // the data blocks between them are filled with one call.
+    int err = 0;
+    while (len > 0 && err == 0) {
+        int run;
+        int bit = find_run(cursor.goal, MIN(MAX(need, 1), RUN_ENOUGH), &run);
+        if (bit == -1) {
+            err = ENOSPC;
+            break;
+        }
+        claim_run(bit, run);
+        need -= MIN(need, (uint64_t) run);
+        cursor.goal = bit + run;
+
+        int blk = bit + sb->s_first_data_block;
+        while (run > 0 && len > 0) {
+            unsigned int *missing;
+            unsigned int *slot = block_map_slot(&cursor.map, cursor.next, &missing);
+            if (slot == NULL) {
+                *missing = blk;
+                memset(get_block(blk), 0, block_size);
+                inode->i_blocks += SECTORS_PER_BLOCK;
+                blk++;
+                run--;
+                continue;
+            }
+
+            // As many blocks as are left of the run, of the write and of
+            // the pointers in the block map's current leaf
+            unsigned int count = MIN((uint64_t) run, (len + block_size - 1) / block_size);
+            count = MIN(count, cursor.map.start + cursor.map.count - cursor.next);
+            size_t n = MIN(len, (size_t) count * block_size);
+            err = fill((uint64_t) blk * block_size, done, n, arg);
+            if (err != 0) {
+                break;
+            }
+            for (unsigned int i = 0; i < count; i++) {
+                slot[i] = blk + i;
+            }
+            inode->i_blocks += count * SECTORS_PER_BLOCK;
+            size += n;
+            done += n;
+            len -= n;
+            blk += count;
+            run -= count;
+            cursor.last = blk - 1;
+            cursor.next += count;
+        }
+
+        // Should the write have needed fewer blocks than it took
+        for ( ; run > 0 ; blk++, run--) {
+            unclaim_block(BLOCK_BIT(blk));
+        }
+    }
+
+    set_file_size(inode, size);
+    return err;
 }
 
 /**
@@ -545,15 +989,58 @@ int write_to_inode(int ino, char *data, size_t len) {
 void ext2_init(const char *file) {
   int fd = open(file, O_RDWR);
 
-  disk = mmap(NULL, 128 * EXT2_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (fd == -1) {
+    perror(file);
+    exit(EXIT_FAILURE);
+  }
+
+  // The super block says how large the file system is, so it is read
+  // before the rest is mapped.
+  struct ext2_super_block super;
+  if (pread(fd, &super, sizeof(super), EXT2_BLOCK_SIZE) != sizeof(super)
+      || super.s_magic != EXT2_SUPER_MAGIC || super.s_log_block_size > 2) {
+    fprintf(stderr, "%s: not an ext2 file system\n", file);
+    exit(EXIT_FAILURE);
+  }
+
+  block_size = EXT2_BLOCK_SIZE << super.s_log_block_size;
+  group_count = (super.s_blocks_count - super.s_first_data_block
+                 + super.s_blocks_per_group - 1) / super.s_blocks_per_group;
+  inode_size = super.s_rev_level == 0 ? sizeof(struct ext2_inode) : super.s_inode_size;
+
+  // A file is limited by the blocks its block map can address, by
+  // i_blocks, which counts its blocks and indirect blocks in 32 bits of
+  // 512 byte sectors, and by i_size, which only has 31 bits in revision 0
+  uint64_t p = block_size / sizeof(unsigned int);
+  uint64_t blocks = 12 + p + p * p + p * p * p;
+  uint64_t indirect = 1 + (1 + p) + (1 + p + p * p);
+  uint64_t sectors = UINT32_MAX / (block_size / 512);
+  if (blocks + indirect > sectors) {
+    blocks = sectors - indirect;
+  }
+  max_file_size = blocks * block_size;
+  if (super.s_rev_level == 0 && max_file_size > 0x7FFFFFFF) {
+    max_file_size = 0x7FFFFFFF;
+  }
+
+  // Touching a page of the mapping past the end of the file would fault
+  size_t size = (size_t) super.s_blocks_count * block_size;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t) st.st_size < size) {
+    fprintf(stderr, "%s: image is shorter than its file system\n", file);
+    exit(EXIT_FAILURE);
+  }
+
+  disk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
   if(disk == MAP_FAILED) {
     perror("mmap");
     exit(EXIT_FAILURE);
   }
+  disk_fd = fd;
 
   sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
-  gd = (struct ext2_group_desc *)(disk + (EXT2_BLOCK_SIZE * 2));
+  gd = (struct ext2_group_desc *) get_block(sb->s_first_data_block + 1);
 }
 
 /*
@@ -613,6 +1100,8 @@ int create_inode(char *path, int mode, void *extra) {
     inode->i_dir_acl = 0;
     inode->i_faddr = 0;
     inode->i_links_count = 1; // From parent directory
+    // Large inodes have fields past the structure, which we leave unused
+    memset((unsigned char *) inode + sizeof(*inode), 0, inode_size - sizeof(*inode));
 
     int ft;
 
@@ -624,17 +1113,20 @@ int create_inode(char *path, int mode, void *extra) {
 
         inode->i_block[0] = blk; // Set first block to our new claimed
 
+        // The block may have been a removed file's, so it is cleared first
         struct ext2_dir_entry *block = (struct ext2_dir_entry *) get_block(blk);
-        block->rec_len = EXT2_BLOCK_SIZE;
+        memset(block, 0, block_size);
+        block->rec_len = block_size;
         insert_into_directory(inode, ino, ".", EXT2_FT_DIR);
         insert_into_directory(inode, parent, "..", EXT2_FT_DIR);
         parent_ino->i_links_count++;
         inode->i_mode = EXT2_S_IFDIR;
         ft = EXT2_FT_DIR;
         inode->i_links_count = 2; // '.' and entry from parent inode
-        inode->i_size = EXT2_BLOCK_SIZE;
-        inode->i_blocks += 2;
-        claim_block(blk - 1);
+        inode->i_size = block_size;
+        inode->i_blocks += SECTORS_PER_BLOCK;
+        claim_block(BLOCK_BIT(blk));
+        gd[(ino - 1) / sb->s_inodes_per_group].bg_used_dirs_count++;
     } else if (mode == MODE_C_SYMLINK) {
         inode->i_mode = EXT2_S_IFLNK;
         ft = EXT2_FT_SYMLINK;
@@ -650,25 +1142,21 @@ int create_inode(char *path, int mode, void *extra) {
     return ino;
 }
 
+/* walk_blocks function that passes each block's bit to a bitmap function */
+static int fix_block(unsigned int blk, int level, void *bitmap_func) {
+    (*(void (**) (int)) bitmap_func)(BLOCK_BIT(blk));
+    return 0;
+}
+
+/* walk_blocks function that stops at a block that is in use */
+static int block_taken(unsigned int blk, int level, void *arg) {
+    int bit = BLOCK_BIT(blk);
+    return get_bit(block_bitmap(bit / sb->s_blocks_per_group), bit % sb->s_blocks_per_group);
+}
+
 /* Sets or unsets an inodes blocks, depending on bitmap_func */
 static void fix_blocks(int ino, void (*bitmap_func) (int)) {
-    struct ext2_inode *inode = get_inode(ino);
-    for (int i = 0 ; i < 13 ; i++) {
-        if (inode->i_block[i] == 0) {
-            continue;
-        }
-
-        if (i < 12) {
-            bitmap_func(inode->i_block[i] - 1);
-        } else {
-            unsigned int *iblock = (unsigned int *) get_block(inode->i_block[i]);
-            for (int i = 0 ; i < PTRS_PER_INDIRECT_BLOCK ; i++) {
-                if (iblock[i] != 0) {
-                    bitmap_func(iblock[i] - 1);
-                }
-            }
-        }
-    }
+    walk_blocks(get_inode(ino), fix_block, &bitmap_func);
 }
 
 /*
@@ -716,6 +1204,9 @@ int remove_inode(char *path) {
     inode->i_dtime = time(NULL);
     fix_blocks(del->inode, unclaim_block);
     unclaim_inode(del->inode - 1);
+    if (cursor.ino == del->inode) {
+        cursor.ino = 0;
+    }
 
     // Set the previous inodes length to cover over our inode
     prev->rec_len += del->rec_len;
@@ -750,23 +1241,26 @@ int restore_inode(char *path) {
         return -ENOENT;
     }
 
-    /* If there is any extra "padding" (ie. the hiding entry is taking up the
-       remaining space in the block), we must make sure the restored entry takes
-       up that space, so we add it on top of its rec_len */
-    int real_len = get_rec_len(hiding->name_len);
-    int extra = hiding->rec_len - real_len;
-    int len = offset_to_hidden(hiding, f, extra);
-    extra = hiding->rec_len - len;
+    /* The hiding entry covers the hidden one, and anything after it up to
+       the next entry or the end of the block */
+    int len = offset_to_hidden(hiding, f, hiding->rec_len);
+    int extra = hiding->rec_len - len;
 
     struct ext2_dir_entry *hidden = (struct ext2_dir_entry *) (((unsigned char *) hiding) + len);
 
-    // Set the rec_len to its real amount and add any padding on to it
-    int padding = extra - hidden->rec_len;
-    hidden->rec_len = get_rec_len(hidden->name_len);
-    if (padding > 0) {
-        hidden->rec_len += padding;
+    // The inode, or any of its blocks, may have been reused since it was
+    // removed, and then it cannot be restored. Each block is checked before
+    // it is read, as an indirect block that was reused has been overwritten.
+    int bit = hidden->inode - 1;
+    if (get_bit(inode_bitmap(bit / sb->s_inodes_per_group), bit % sb->s_inodes_per_group)
+        || walk_blocks(get_inode(hidden->inode), block_taken, NULL)) {
+        return -ENOENT;
     }
 
+    // The restored entry takes up the rest of what the hiding entry covered,
+    // which is the end of the block if it was the last entry
+    hidden->rec_len = extra;
+
     // Set the rec_len of the hiding entry to its proper amount
     hiding->rec_len = len;
 
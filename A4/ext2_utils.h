@@ -3,36 +3,61 @@
 #define CSC369_EXT2_UTILS_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 
 #include "ext2.h"
 
-/* Size of first 11 blocks + size of single indirect block */
-#define MAX_INODE_SIZE ((EXT2_BLOCK_SIZE * 11) \
-                        + ((EXT2_BLOCK_SIZE / sizeof(unsigned int)) \
-                        * EXT2_BLOCK_SIZE))
-
 /* Number of block pointers in an indirect block */
-#define PTRS_PER_INDIRECT_BLOCK (EXT2_BLOCK_SIZE / sizeof(unsigned int))
+#define PTRS_PER_INDIRECT_BLOCK (block_size / sizeof(unsigned int))
+
+/* Number of 512 byte sectors in a block, the unit of i_blocks */
+#define SECTORS_PER_BLOCK (block_size / 512)
+
+/*
+ * Bit of a block in the block bitmap. The bitmap starts at the first data
+ * block, which is block 1 with 1K blocks and block 0 otherwise.
+ */
+#define BLOCK_BIT(blk) ((blk) - sb->s_first_data_block)
 
 /* The pointer to our super block */
 extern unsigned char *disk;
 extern struct ext2_super_block *sb;
+
+/* The image file, which stays open so that data can also be written to it
+   through the file, rather than through the mapping */
+extern int disk_fd;
+
+/* The group descriptor table, with one descriptor per block group */
 extern struct ext2_group_desc *gd;
 
+/* Geometry of the file system, read from the super block */
+extern unsigned int block_size;
+extern unsigned int group_count;
+extern unsigned int inode_size;
+
+/* Largest file an inode can hold, through its direct and single, double
+   and triple indirect blocks */
+extern uint64_t max_file_size;
+
 /**
  * Loads an EXT2 formatted file system from a path on the system.
  *
- * @param file The path to the file
+ * The whole file system is mapped, s_blocks_count blocks of the block
+ * size given in the super block. Exits with EXIT_FAILURE if the file
+ * cannot be opened, does not hold an ext2 file system, or is shorter than
+ * the file system it holds.
  *
- * @return EXIT_FAILURE or EXIT_SUCCESS depending on whether the
- *         file system was successfully mapped to memory.
+ * @param file The path to the file
  */
 void ext2_init(const char *file);
 
 /**
  * Claims a bit inside the inode bitmap.
  *
+ * The bit is the inode number less 1, counted across all block groups;
+ * the bit's group has its own bitmap and free count.
+ *
  * @param bit The bit to claim
  */
 void claim_inode(int bit);
@@ -40,6 +65,8 @@ void claim_inode(int bit);
 /**
  * Claims a bit inside the block bitmap.
  *
+ * The bit is BLOCK_BIT() of the block, counted across all block groups.
+ *
  * @param bit The bit to claim
  */
 void claim_block(int bit);
@@ -48,7 +75,7 @@ void claim_block(int bit);
  * Returns a pointer to the first entry of a block.
  *
  * @param blk Block number to retrieve. Not to be confused with block bit,
- *            which is actually 1 less than the block number.
+ *            which is BLOCK_BIT(blk).
  *
  * @return First entry of the block
  */
@@ -63,6 +90,21 @@ unsigned char *get_block(int blk);
  */
 struct ext2_inode *get_inode(int ino);
 
+/**
+ * Calls a function on every block of an inode, in the order of the blocks
+ * in the file. Each indirect block comes before the blocks it points to,
+ * so its pointers are read only once for the walk.
+ *
+ * @param inode The inode whose blocks to walk
+ * @param fn    Function called with each block number, the block's level
+ *              (0 for a data block, 1 to 3 for a single, double or triple
+ *              indirect block) and [arg]. A nonzero return stops the walk.
+ * @param arg   Passed on to fn
+ *
+ * @return 0, or the nonzero value fn stopped the walk with.
+ */
+int walk_blocks(struct ext2_inode *inode, int (*fn) (unsigned int, int, void *), void *arg);
+
 /*
  * Creation modes for inode.
  */
@@ -123,10 +165,11 @@ int find_inode(char *path);
 /**
  * Appends data to an inode.
  *
- * The data passed into the function will be truncated every
- * [EXT2_BLOCK_SIZE], with the data being distributed across
- * multiple blocks (if needed). The function assigns and claims
- * any required data blocks to the inode.
+ * The data first fills the unused end of the inode's last block, and the
+ * rest is distributed across as many new [block_size] blocks as it needs.
+ * Those are claimed in runs of contiguous free blocks, starting right
+ * after the inode's last block where possible, so that files stay
+ * contiguous. Nothing is written if there are not enough free blocks.
  *
  * @param ino  Inode being written to
  * @param data Data being written
@@ -136,4 +179,25 @@ int find_inode(char *path);
  */
 int write_to_inode(int ino, char *data, size_t len);
 
+/**
+ * Appends data to an inode, as write_to_inode does, but lets a function
+ * put the data in place.
+ *
+ * The blocks are allocated as for write_to_inode, and [fill] is called in
+ * order for each stretch of the data that lands in contiguous blocks, so
+ * that large writes are copied in a few large pieces. A stretch is at most
+ * one indirect block's worth of blocks.
+ *
+ * @param ino  Inode being written to
+ * @param len  The length of the data being written
+ * @param fill Function called with the byte offset in the image to write
+ *             at, the offset in the data to write from, the number of bytes
+ *             and [arg]. It returns 0, or an error code that stops the
+ *             write, leaving the inode with the data filled before it.
+ * @param arg  Passed on to fill
+ *
+ * @return 0 on successful writing, an error code otherwise.
+ */
+int append_to_inode(int ino, size_t len, int (*fill) (uint64_t, size_t, size_t, void *), void *arg);
+
 #endif